@@ -0,0 +1,1685 @@
+/*
+ * Copyright 2017 DiUS Computing Pty Ltd. All rights reserved.
+ *
+ * Released under GPLv3, see LICENSE for details.
+ *
+ * @author Johny Mattsson <jmattsson@dius.com.au>
+ */
+#include "ql.h"
+#include "raster.h"
+#include "loadpng.h"
+#include "loadimg.h"
+#include "arena.h"
+#include "labelcache.h"
+#include "rasterpool.h"
+#include "compose.h"
+#include "spool.h"
+#include "emulator.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <png.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Benchmarks for the host-side hot paths: loading, rasterising, sending,
+ * and whole jobs against the printer emulator. Each one checks its output
+ * against a straightforward reference implementation (or the emulator's
+ * reconstruction), so a speedup never comes at the cost of a different print.
+ */
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static ql_raster_image_t *synth_image(uint16_t width, uint16_t height, unsigned seed)
+{
+  ql_raster_image_t *img = malloc(sizeof(ql_raster_image_t) + width * height);
+  if (!img)
+    abort();
+  img->width = width;
+  img->height = height;
+  srand(seed);
+  for (unsigned i = 0; i < (unsigned)width * height; ++i)
+    img->data[i] = rand();
+  return img;
+}
+
+
+// The original per-column packer, kept as the reference
+static void pack_column(uint8_t *out, uint16_t bytes, uint16_t colno, const ql_raster_image_t *img, uint8_t black_below_v)
+{
+  for (unsigned n = 0; n < bytes; ++n, ++out)
+  {
+    *out = 0;
+    for (unsigned i = 0; i < 8; ++i)
+    {
+      unsigned img_row = n * 8 + i;
+      if (img_row < img->height)
+        if (img->data[img_row * img->width +  colno] < black_below_v)
+          *out |= 1 << (7 - i);
+    }
+  }
+}
+
+
+static ql_packed_image_t *pack_reference(const ql_raster_image_t *img, uint16_t line_bytes, uint8_t threshold)
+{
+  ql_packed_image_t *out =
+    malloc(sizeof(ql_packed_image_t) + img->width * line_bytes);
+  if (!out)
+    abort();
+  out->lines = img->width;
+  out->line_bytes = line_bytes;
+  out->planes = 1;
+  out->ink = NULL;
+  for (unsigned w = 0; w < img->width; ++w)
+    pack_column(out->data + w * line_bytes, line_bytes, w, img, threshold);
+  return out;
+}
+
+
+static bool check_pack(uint16_t lines, uint16_t dots, uint16_t line_bytes, uint8_t threshold)
+{
+  ql_raster_image_t *img = synth_image(lines, dots, lines * dots);
+  ql_packed_image_t *ref = pack_reference(img, line_bytes, threshold);
+  ql_packed_image_t *got = ql_pack_image(img, line_bytes, threshold, QL_DITHER_NONE);
+  bool ok = got && memcmp(ref->data, got->data, lines * line_bytes) == 0;
+  for (unsigned w = 0; ok && w < lines; ++w)
+  {
+    bool blank = true;
+    for (unsigned n = 0; n < line_bytes; ++n)
+      blank &= !ref->data[w * line_bytes + n];
+    ok = blank == !got->ink[w];
+  }
+  free(got);
+  free(ref);
+  free(img);
+  return ok;
+}
+
+
+/* Colour version of a gray image for two-colour printing: every other
+ * band of 64 columns has its dark parts in red rather than black.
+ */
+static uint8_t *synth_rgb(const ql_raster_image_t *img)
+{
+  uint8_t *rgb = malloc((size_t)img->width * img->height * 3);
+  if (!rgb)
+    abort();
+  uint8_t *px = rgb;
+  for (unsigned r = 0; r < img->height; ++r)
+    for (unsigned c = 0; c < img->width; ++c, px += 3)
+    {
+      const uint8_t gray = img->data[r * img->width + c];
+      px[0] = (c / 64) % 2 ? 255 : gray;
+      px[1] = px[2] = gray;
+    }
+  return rgb;
+}
+
+
+// Classifies each pixel separately, a column and a plane at a time
+static ql_packed_image_t *pack_two_colour_reference(const uint8_t *rgb, uint16_t width, uint16_t height, uint16_t line_bytes, uint8_t threshold)
+{
+  ql_packed_image_t *out =
+    calloc(1, sizeof(ql_packed_image_t) + width * 2 * line_bytes);
+  if (!out)
+    abort();
+  out->lines = width;
+  out->line_bytes = line_bytes;
+  out->planes = 2;
+  for (unsigned plane = 0; plane < 2; ++plane)
+    for (unsigned w = 0; w < width; ++w)
+      for (unsigned y = 0; y < height; ++y)
+      {
+        const uint8_t *px = rgb + (y * width + w) * 3;
+        unsigned gb = px[1] > px[2] ? px[1] : px[2];
+        bool red = gb < threshold && px[0] >= gb + 64;
+        bool black = !red &&
+          (6968 * px[0] + 23434 * px[1] + 2366 * px[2]) >> 15 < threshold;
+        if (plane ? red : black)
+          out->data[(w * 2 + plane) * line_bytes + y / 8] |= 0x80 >> (y % 8);
+      }
+  return out;
+}
+
+
+static ql_packed_image_t *pack_two_colour(const uint8_t *rgb, uint16_t width, uint16_t height, uint16_t line_bytes, uint8_t threshold)
+{
+  ql_packer_t p =
+    ql_packer_create_two_colour(width, height, line_bytes, threshold);
+  if (!p)
+    return NULL;
+  for (unsigned r = 0; r < height; ++r)
+    ql_packer_add_rgb_row(p, rgb + r * width * 3);
+  return ql_packer_finish(p);
+}
+
+
+static bool check_two_colour(uint16_t lines, uint16_t dots, uint16_t line_bytes, uint8_t threshold)
+{
+  ql_raster_image_t *img = synth_image(lines, dots, lines ^ dots);
+  uint8_t *rgb = synth_rgb(img);
+  ql_packed_image_t *ref =
+    pack_two_colour_reference(rgb, lines, dots, line_bytes, threshold);
+  ql_packed_image_t *got = pack_two_colour(rgb, lines, dots, line_bytes, threshold);
+  bool ok = got && got->planes == 2 &&
+    memcmp(ref->data, got->data, lines * 2 * line_bytes) == 0;
+  free(got);
+  free(ref);
+  free(rgb);
+  free(img);
+  return ok;
+}
+
+
+/* Turns pixels of the given size the way the packer does when rotating:
+ * for a quarter turn clockwise the last row becomes the first column.
+ */
+static void *rotate_pixels(const uint8_t *px, uint16_t width, uint16_t height, unsigned channels, uint8_t rotate)
+{
+  uint8_t *out = malloc((size_t)width * height * channels);
+  if (!out)
+    abort();
+  const bool turned = rotate == QL_ROTATE_90 || rotate == QL_ROTATE_270;
+  const unsigned out_w = turned ? height : width;
+  for (unsigned y = 0; y < height; ++y)
+    for (unsigned x = 0; x < width; ++x)
+    {
+      unsigned ox = x, oy = y;
+      switch (rotate)
+      {
+        case QL_ROTATE_90: ox = height - 1 - y; oy = x; break;
+        case QL_ROTATE_180: ox = width - 1 - x; oy = height - 1 - y; break;
+        case QL_ROTATE_270: ox = y; oy = width - 1 - x; break;
+      }
+      memcpy(out + (oy * out_w + ox) * channels,
+        px + (y * width + x) * channels, channels);
+    }
+  return out;
+}
+
+
+// Rotating while packing, against packing a rotated copy
+static bool check_rotate(uint16_t lines, uint16_t dots, uint16_t line_bytes, uint8_t rotate)
+{
+  const bool turned = rotate == QL_ROTATE_90 || rotate == QL_ROTATE_270;
+  // The source is sized so that it fits across the head once rotated
+  const uint16_t w = turned ? dots : lines, h = turned ? lines : dots;
+  ql_raster_image_t *img = synth_image(w, h, w + h + rotate);
+  uint8_t *rgb = synth_rgb(img);
+
+  ql_raster_image_t *turn = malloc(sizeof(ql_raster_image_t) + w * h);
+  if (!turn)
+    abort();
+  turn->width = lines;
+  turn->height = dots;
+  uint8_t *turned_gray = rotate_pixels(img->data, w, h, 1, rotate);
+  memcpy(turn->data, turned_gray, w * h);
+  uint8_t *turned_rgb = rotate_pixels(rgb, w, h, 3, rotate);
+
+  const ql_pack_opts_t mono = { .threshold = 0x80, .rotate = rotate };
+  const ql_pack_opts_t two = { .threshold = 0x80, .two_colour = true,
+    .rotate = rotate };
+  ql_packed_image_t *ref = ql_pack_image(turn, line_bytes, 0x80, QL_DITHER_NONE);
+  ql_packed_image_t *got = ql_pack_image_opts(img, line_bytes, &mono);
+  bool ok = ref && got && got->lines == lines &&
+    memcmp(ref->data, got->data, lines * line_bytes) == 0;
+  for (unsigned l = 0; ok && l < lines; ++l)
+    ok = !ref->ink[l] == !got->ink[l];
+  free(got);
+  free(ref);
+
+  ref = pack_two_colour(turned_rgb, lines, dots, line_bytes, 0x80);
+  ql_packer_t p = ql_packer_create_opts(w, h, line_bytes, &two);
+  for (unsigned r = 0; p && r < h; ++r)
+    ql_packer_add_rgb_row(p, rgb + r * w * 3);
+  got = p ? ql_packer_finish(p) : NULL;
+  ok = ok && ref && got && got->planes == 2 && got->lines == lines &&
+    memcmp(ref->data, got->data, lines * 2 * line_bytes) == 0;
+  free(got);
+  free(ref);
+
+  free(turned_rgb);
+  free(turned_gray);
+  free(turn);
+  free(rgb);
+  free(img);
+  return ok;
+}
+
+
+/* Scaling to fit: a flat dark image should come out exactly the media
+ * width and in proportion, black all the way across and nothing beyond,
+ * whether it's shrunk or enlarged.
+ */
+static void verify_fit(void)
+{
+  static const uint16_t sizes[][2] = {
+    { 1, 1 }, { 300, 50 }, { 1000, 2000 }, { 77, 333 } };
+  static const uint16_t media[] = { 94, 306, 696 };
+  const uint16_t lb = 90;
+  for (unsigned i = 0; i < sizeof(sizes)/sizeof(sizes[0]); ++i)
+    for (unsigned m = 0; m < sizeof(media)/sizeof(media[0]); ++m)
+    {
+      const uint16_t w = sizes[i][0], h = sizes[i][1];
+      ql_raster_image_t *img = malloc(sizeof(ql_raster_image_t) + w * h);
+      if (!img)
+        abort();
+      img->width = w;
+      img->height = h;
+      memset(img->data, 0x40, w * h);
+      const ql_pack_opts_t opts = { .threshold = 0x80, .fit_dots = media[m] };
+      ql_packed_image_t *out = ql_pack_image_opts(img, lb, &opts);
+      const unsigned want = (w * media[m] + h / 2) / h;
+      bool ok = out && out->lines == want;
+      for (unsigned l = 0; ok && l < out->lines; ++l)
+      {
+        unsigned black = 0;
+        for (unsigned n = 0; n < lb; ++n)
+          black += __builtin_popcount(out->data[l * lb + n]);
+        ok = black == media[m] && out->data[l * lb] == 0xff;
+      }
+      if (!ok)
+      {
+        fprintf(stderr, "fit: %ux%u to %u dots gives %u lines, not %u, "
+          "or not solid!\n", w, h, media[m], out ? out->lines : 0, want);
+        exit(EXIT_FAILURE);
+      }
+      free(out);
+      free(img);
+    }
+}
+
+
+/* Decoders called from several threads at once, each with a different
+ * status, must keep giving what they give when called from just one.
+ */
+#define DECODE_THREADS 4
+#define DECODE_ROUNDS  20000
+
+typedef struct {
+  ql_status_t status;
+  char want[3][QL_DECODE_BUF_LEN];
+  bool ok;
+} decode_job_t;
+
+static void *decode_loop(void *arg)
+{
+  decode_job_t *job = arg;
+  char buf[QL_DECODE_BUF_LEN];
+  job->ok = true;
+  for (unsigned i = 0; i < DECODE_ROUNDS && job->ok; ++i)
+    job->ok =
+      strcmp(ql_decode_model(&job->status), job->want[0]) == 0 &&
+      strcmp(ql_decode_errors(&job->status), job->want[1]) == 0 &&
+      strcmp(ql_decode_media_type(&job->status), job->want[2]) == 0 &&
+      strcmp(ql_decode_errors_r(&job->status, buf, sizeof(buf)),
+        job->want[1]) == 0;
+  return NULL;
+}
+
+static void verify_decode(void)
+{
+  decode_job_t jobs[DECODE_THREADS];
+  pthread_t threads[DECODE_THREADS];
+  for (unsigned t = 0; t < DECODE_THREADS; ++t)
+  {
+    // Unknown models and media, and differing error lists
+    ql_emulated_status(&jobs[t].status, t & 1 ? '2' : 'a' + t,
+      t & 2 ? 0x40 + t : QL_MEDIA_TYPE_CONTINUOUS, 62, 0);
+    jobs[t].status.err_info_1 = 0x11 << t;
+    jobs[t].status.err_info_2 = 0xff >> t;
+    snprintf(jobs[t].want[0], QL_DECODE_BUF_LEN, "%s",
+      ql_decode_model(&jobs[t].status));
+    snprintf(jobs[t].want[1], QL_DECODE_BUF_LEN, "%s",
+      ql_decode_errors(&jobs[t].status));
+    snprintf(jobs[t].want[2], QL_DECODE_BUF_LEN, "%s",
+      ql_decode_media_type(&jobs[t].status));
+  }
+  for (unsigned t = 0; t < DECODE_THREADS; ++t)
+    if (pthread_create(&threads[t], NULL, decode_loop, &jobs[t]) != 0)
+      abort();
+  for (unsigned t = 0; t < DECODE_THREADS; ++t)
+  {
+    pthread_join(threads[t], NULL);
+    if (!jobs[t].ok)
+    {
+      fprintf(stderr, "decode: thread %u saw another's status!\n", t);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  ql_status_t a, b;
+  ql_status_summary_t sa, sb;
+  ql_emulated_status(&a, '2', QL_MEDIA_TYPE_CONTINUOUS, 62, 0);
+  ql_emulated_status(&b, '2', QL_MEDIA_TYPE_CONTINUOUS_ALT, 62, 0);
+  b.status_type = QL_STATUS_TYPE_PRINTING_DONE; // an event, not a state
+  ql_status_summarise(&sa, &a);
+  ql_status_summarise(&sb, &b);
+  bool ok = ql_status_summary_equal(&sa, &sb) && sa.model == QL_MODEL_QL570;
+  b.err_info_2 = QL_ERR_2_COVER_OPEN;
+  ql_status_summarise(&sb, &b);
+  ok = ok && !ql_status_summary_equal(&sa, &sb) &&
+    sb.errors == QL_ERR_2_COVER_OPEN << 8;
+  if (!ok)
+  {
+    fprintf(stderr, "decode: status summaries compare wrongly!\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* The corpus: synthetic labels of the kinds we print, at both print head
+ * widths, as short labels and as multi-metre lengths of continuous tape.
+ * Images are laid out as qlprint gets them, one raster line per column.
+ */
+typedef enum { TEXT, BARCODE, BLANK } label_kind_t;
+
+typedef struct {
+  const char *name;
+  label_kind_t kind;
+  uint16_t lines; // label length, at 300 dots per inch
+  uint16_t dots;  // print head width
+} label_spec_t;
+
+#define LINES_SHORT 600   // 5cm
+#define LINES_LONG  23622 // 2m
+
+static const label_spec_t corpus[] = {
+  { "text-720",       TEXT,    LINES_SHORT, 720 },
+  { "barcode-720",    BARCODE, LINES_SHORT, 720 },
+  { "blank-720",      BLANK,   LINES_SHORT, 720 },
+  { "text-1296",      TEXT,    LINES_SHORT, 1296 },
+  { "barcode-1296",   BARCODE, LINES_SHORT, 1296 },
+  { "text-720-2m",    TEXT,    LINES_LONG,  720 },
+  { "blank-1296-2m",  BLANK,   LINES_LONG,  1296 },
+};
+#define CORPUS_SIZE (sizeof(corpus)/sizeof(corpus[0]))
+
+
+static ql_raster_image_t *synth_label(const label_spec_t *spec)
+{
+  const unsigned width = spec->lines, height = spec->dots;
+  ql_raster_image_t *img = malloc(sizeof(ql_raster_image_t) + width * height);
+  if (!img)
+    abort();
+  img->width = width;
+  img->height = height;
+  memset(img->data, 0xff, width * height);
+  srand(width * height + spec->kind);
+
+  switch (spec->kind)
+  {
+    case TEXT: // lines of glyph-sized ink blobs, with some anti-aliasing
+      for (unsigned y = 24; y + 48 < height; y += 72)
+        for (unsigned x = 24; x + 24 < width; x += 28)
+          for (unsigned gy = 0; gy < 48; ++gy)
+            for (unsigned gx = 0; gx < 24; ++gx)
+              if (rand() % 3 == 0)
+                img->data[(y + gy) * width + x + gx] = rand() % 160;
+      break;
+    case BARCODE: // bars of 1-4 modules across the middle of the label
+      for (unsigned x = 40; x + 40 < width; )
+      {
+        unsigned bar = (rand() % 4 + 1) * 3, gap = (rand() % 4 + 1) * 3;
+        for (unsigned y = height / 8; y < height * 7 / 8; ++y)
+          memset(img->data + y * width + x, 0, bar < width - x ? bar : width - x);
+        x += bar + gap;
+      }
+      break;
+    case BLANK: // a single short line of text in the corner
+      for (unsigned y = 16; y < 64 && y < height; ++y)
+        for (unsigned x = 16; x < 400 && x < width; ++x)
+          if (rand() % 3 == 0)
+            img->data[y * width + x] = 0;
+      break;
+  }
+  return img;
+}
+
+
+// Repetitions needed for roughly the same amount of work for any label
+static unsigned reps_for(unsigned lines, unsigned reps)
+{
+  unsigned n = reps * 2000 / lines;
+  return n ? n : 1;
+}
+
+
+static long peak_rss_kb(void)
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss;
+}
+
+
+/* Results are printed one JSON object per line. mb_per_s is the rate at
+ * which the benchmarked step consumed its input (pixels for loading and
+ * packing, raster bytes for sending); peak_rss_kb is for the whole run
+ * so far, and the corpus goes from small to large to keep it meaningful.
+ */
+static void report(const char *bench, const label_spec_t *spec, const char *variant, double secs, unsigned labels, double bytes, double syscalls)
+{
+  printf("{\"bench\":\"%s\",\"label\":\"%s\",\"variant\":\"%s\","
+    "\"lines\":%u,\"dots\":%u,\"labels\":%u,\"ns_per_line\":%.1f,"
+    "\"mb_per_s\":%.1f,",
+    bench, spec->name, variant, spec->lines, spec->dots, labels,
+    secs * 1e9 / ((double)spec->lines * labels), bytes / secs / 1e6);
+  if (syscalls >= 0)
+    printf("\"syscalls_per_label\":%.1f,", syscalls / labels);
+  else
+    printf("\"syscalls_per_label\":null,");
+  printf("\"peak_rss_kb\":%ld}\n", peak_rss_kb());
+  fflush(stdout);
+}
+
+
+// Ordered dithering by the selected kernel, against the scalar one
+static bool check_ordered(uint16_t lines, uint16_t dots, uint16_t line_bytes, uint8_t threshold)
+{
+  const ql_pack_kernel_t *kernel = ql_pack_kernel();
+  ql_raster_image_t *img = synth_image(lines, dots, lines + dots);
+  ql_pack_select_kernel("scalar");
+  ql_packed_image_t *ref =
+    ql_pack_image(img, line_bytes, threshold, QL_DITHER_ORDERED);
+  ql_pack_select_kernel(kernel->name);
+  ql_packed_image_t *got =
+    ql_pack_image(img, line_bytes, threshold, QL_DITHER_ORDERED);
+  bool ok = ref && got &&
+    memcmp(ref->data, got->data, lines * line_bytes) == 0;
+  free(got);
+  free(ref);
+  free(img);
+  return ok;
+}
+
+
+/* Each dithering mode should reproduce a flat gray as the right share of
+ * black dots, to within a couple of percent. Atkinson drops a quarter of
+ * the error on purpose, which pushes dark and light grays to the extremes,
+ * so it only has to get the middle right.
+ */
+static void verify_dither(void)
+{
+  static const uint8_t modes[] = {
+    QL_DITHER_ORDERED, QL_DITHER_FLOYD_STEINBERG, QL_DITHER_ATKINSON };
+  const uint16_t lines = 512, dots = 512, lb = dots / 8;
+  ql_raster_image_t *img = malloc(sizeof(ql_raster_image_t) + lines * dots);
+  if (!img)
+    abort();
+  img->width = lines;
+  img->height = dots;
+  for (unsigned m = 0; m < sizeof(modes); ++m)
+  {
+    for (unsigned gray = 32; gray < 256; gray += 32)
+    {
+      if (modes[m] == QL_DITHER_ATKINSON && gray != 128)
+        continue;
+      memset(img->data, gray, lines * dots);
+      ql_packed_image_t *out = ql_pack_image(img, lb, 0x80, modes[m]);
+      if (!out)
+        abort();
+      unsigned black = 0;
+      for (unsigned i = 0; i < lines * lb; ++i)
+        black += __builtin_popcount(out->data[i]);
+      free(out);
+      double want = 1.0 - gray / 255.0, got = (double)black / (lines * dots);
+      if (got < want - 0.02 || got > want + 0.02)
+      {
+        fprintf(stderr, "dither: mode %u gives %.3f black for gray %u, "
+          "not %.3f!\n", modes[m], got, gray, want);
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+  free(img);
+}
+
+
+static void verify_kernels(void)
+{
+  unsigned num_kernels;
+  const ql_pack_kernel_t *kernels = ql_pack_kernels(&num_kernels);
+  for (unsigned k = 0; k < num_kernels; ++k)
+  {
+    if (!kernels[k].supported())
+      continue;
+    ql_pack_select_kernel(kernels[k].name);
+
+    // Odd sizes exercise the partial band and the vector kernels' tails
+    static const uint16_t odd[][2] = {
+      { 1, 1 }, { 7, 9 }, { 33, 701 }, { 1001, 1293 }, { 2000, 720 }, { 2000, 1296 } };
+    for (unsigned i = 0; i < sizeof(odd)/sizeof(odd[0]); ++i)
+    {
+      uint16_t odd_lb = (odd[i][1] + 7) / 8;
+      if (!check_pack(odd[i][0], odd[i][1], odd_lb, 0x80) ||
+          !check_pack(odd[i][0], odd[i][1], odd_lb + 1, 0) ||
+          !check_pack(odd[i][0], odd[i][1], odd_lb + 1, 0xff) ||
+          !check_ordered(odd[i][0], odd[i][1], odd_lb, 0x80) ||
+          !check_ordered(odd[i][0], odd[i][1], odd_lb, 0) ||
+          !check_ordered(odd[i][0], odd[i][1], odd_lb, 0xff) ||
+          !check_two_colour(odd[i][0], odd[i][1], odd_lb + 1, 0x80) ||
+          !check_rotate(odd[i][0], odd[i][1], odd_lb, QL_ROTATE_90) ||
+          !check_rotate(odd[i][0], odd[i][1], odd_lb + 1, QL_ROTATE_180) ||
+          !check_rotate(odd[i][0], odd[i][1], odd_lb, QL_ROTATE_270))
+      {
+        fprintf(stderr, "pack: %s output mismatch at %ux%u!\n",
+          kernels[k].name, odd[i][0], odd[i][1]);
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+  ql_pack_select_kernel("auto");
+}
+
+
+static void bench_pack(const label_spec_t *spec, const ql_raster_image_t *img, const uint8_t *rgb, unsigned reps)
+{
+  const uint16_t lb = spec->dots / 8;
+  const double pixels = (double)spec->lines * spec->dots * reps;
+
+  double t0 = now();
+  for (unsigned i = 0; i < reps; ++i)
+    free(pack_reference(img, lb, 0x80));
+  report("pack", spec, "column", now() - t0, reps, pixels, -1);
+
+  unsigned num_kernels;
+  const ql_pack_kernel_t *kernels = ql_pack_kernels(&num_kernels);
+  for (unsigned k = 0; k < num_kernels; ++k)
+  {
+    if (!kernels[k].supported())
+      continue;
+    ql_pack_select_kernel(kernels[k].name);
+    t0 = now();
+    for (unsigned i = 0; i < reps; ++i)
+      free(ql_pack_image(img, lb, 0x80, QL_DITHER_NONE));
+    report("pack", spec, kernels[k].name, now() - t0, reps, pixels, -1);
+  }
+  ql_pack_select_kernel("auto");
+
+  static const char *const dithers[] = {
+    "ordered", "floyd-steinberg", "atkinson" };
+  for (unsigned d = 0; d < sizeof(dithers)/sizeof(dithers[0]); ++d)
+  {
+    uint8_t dither;
+    ql_dither_by_name(dithers[d], &dither);
+    t0 = now();
+    for (unsigned i = 0; i < reps; ++i)
+      free(ql_pack_image(img, lb, 0x80, dither));
+    report("pack", spec, dithers[d], now() - t0, reps, pixels, -1);
+  }
+
+  t0 = now();
+  for (unsigned i = 0; i < reps; ++i)
+    free(pack_two_colour(rgb, spec->lines, spec->dots, lb, 0x80));
+  report("pack", spec, "two-colour", now() - t0, reps, pixels, -1);
+
+  // The image turned back, so each rotation packs into the same label
+  static const char *const rotations[] = { "rot90", "rot180", "rot270" };
+  for (uint8_t rot = QL_ROTATE_90; rot <= QL_ROTATE_270; ++rot)
+  {
+    const bool turned = rot != QL_ROTATE_180;
+    ql_raster_image_t *src =
+      malloc(sizeof(ql_raster_image_t) + spec->lines * spec->dots);
+    if (!src)
+      abort();
+    src->width = turned ? spec->dots : spec->lines;
+    src->height = turned ? spec->lines : spec->dots;
+    uint8_t *px = rotate_pixels(img->data, spec->lines, spec->dots, 1,
+      (4 - rot) % 4);
+    memcpy(src->data, px, spec->lines * spec->dots);
+    free(px);
+    const ql_pack_opts_t opts = { .threshold = 0x80, .rotate = rot };
+    t0 = now();
+    for (unsigned i = 0; i < reps; ++i)
+      free(ql_pack_image_opts(src, lb, &opts));
+    report("pack", spec, rotations[rot - 1], now() - t0, reps, pixels, -1);
+    free(src);
+  }
+
+  // Shrunk from twice the size, and enlarged from two thirds
+  static const char *const fits[] = { "fit-shrink", "fit-enlarge" };
+  static const unsigned fit_scale[] = { 6, 2 }; // thirds
+  for (unsigned f = 0; f < 2; ++f)
+  {
+    const uint16_t w = spec->lines * fit_scale[f] / 3;
+    const uint16_t h = spec->dots * fit_scale[f] / 3;
+    ql_raster_image_t *src = synth_image(w, h, f);
+    const ql_pack_opts_t opts = { .threshold = 0x80, .fit_dots = spec->dots };
+    t0 = now();
+    for (unsigned i = 0; i < reps; ++i)
+      free(ql_pack_image_opts(src, lb, &opts));
+    report("pack", spec, fits[f], now() - t0, reps, pixels, -1);
+    free(src);
+  }
+}
+
+
+/* Writes the image as a gray PNG of the given bit depth, or as 8-bit RGB
+ * from rgb if given; returns its path
+ */
+static const char *synth_png(const ql_raster_image_t *img, int bit_depth, const uint8_t *rgb)
+{
+  static char path[] = "/tmp/qlbench-XXXXXX";
+  strcpy(path + strlen(path) - 6, "XXXXXX");
+  int fd = mkstemp(path);
+  FILE *f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+  png_structp png_ptr =
+    png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop info_ptr = png_ptr ? png_create_info_struct(png_ptr) : NULL;
+  if (!f || !info_ptr || setjmp(png_jmpbuf(png_ptr)))
+    abort();
+
+  png_init_io(png_ptr, f);
+  png_set_IHDR(png_ptr, info_ptr, img->width, img->height, bit_depth,
+    rgb ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+    PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png_ptr, info_ptr);
+
+  uint8_t *row = malloc(img->width);
+  for (unsigned r = 0; r < img->height; ++r)
+  {
+    const uint8_t *gray = img->data + r * img->width;
+    if (rgb)
+      png_write_row(png_ptr, (png_bytep)rgb + r * img->width * 3);
+    else if (bit_depth == 1) // white where the 8-bit version wouldn't be black
+    {
+      memset(row, 0, (img->width + 7) / 8);
+      for (unsigned x = 0; x < img->width; ++x)
+        if (gray[x] >= 0x80)
+          row[x / 8] |= 0x80 >> (x % 8);
+      png_write_row(png_ptr, row);
+    }
+    else
+      png_write_row(png_ptr, (png_bytep)gray);
+  }
+  png_write_end(png_ptr, NULL);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+  fclose(f);
+  free(row);
+  return path;
+}
+
+
+static void bench_loadpng(const label_spec_t *spec, const ql_raster_image_t *src, int bit_depth, unsigned reps)
+{
+  const uint16_t lb = spec->dots / 8;
+  const ql_pack_opts_t mono = { .threshold = 0x80 };
+  const char *path = synth_png(src, bit_depth, NULL);
+
+  ql_raster_image_t *img = loadpng(path);
+  ql_packed_image_t *ref =
+    img ? ql_pack_image(img, lb, 0x80, QL_DITHER_NONE) : NULL;
+  uint16_t w, h;
+  ql_packed_image_t *got =
+    loadpng_packed(path, lb, &mono, &w, &h);
+  if (!ref || !got || memcmp(ref->data, got->data, spec->lines * lb) != 0)
+  {
+    fprintf(stderr, "loadpng: %d-bit output mismatch for %s!\n",
+      bit_depth, spec->name);
+    exit(EXIT_FAILURE);
+  }
+  free(got);
+  free(ref);
+  free(img);
+
+  const double pixels = (double)spec->lines * spec->dots * reps;
+  const char *image = bit_depth == 1 ? "1bit-image" : "8bit-image";
+  const char *streamed = bit_depth == 1 ? "1bit-streamed" : "8bit-streamed";
+
+  double t0 = now();
+  for (unsigned i = 0; i < reps; ++i)
+  {
+    img = loadpng(path);
+    free(ql_pack_image(img, lb, 0x80, QL_DITHER_NONE));
+    free(img);
+  }
+  report("loadpng", spec, image, now() - t0, reps, pixels, -1);
+
+  t0 = now();
+  for (unsigned i = 0; i < reps; ++i)
+    free(loadpng_packed(path, lb, &mono, &w, &h));
+  report("loadpng", spec, streamed, now() - t0, reps, pixels, -1);
+  unlink(path);
+}
+
+
+static void bench_loadpng_two_colour(const label_spec_t *spec, const ql_raster_image_t *src, const uint8_t *rgb, unsigned reps)
+{
+  const uint16_t lb = spec->dots / 8;
+  const ql_pack_opts_t two = { .threshold = 0x80, .two_colour = true };
+  const char *path = synth_png(src, 8, rgb);
+
+  ql_packed_image_t *ref = pack_two_colour(rgb, spec->lines, spec->dots, lb, 0x80);
+  uint16_t w, h;
+  ql_packed_image_t *got =
+    loadpng_packed(path, lb, &two, &w, &h);
+  if (!ref || !got || got->planes != 2 ||
+      memcmp(ref->data, got->data, spec->lines * 2 * lb) != 0)
+  {
+    fprintf(stderr, "loadpng: two-colour output mismatch for %s!\n",
+      spec->name);
+    exit(EXIT_FAILURE);
+  }
+  free(got);
+  free(ref);
+
+  double t0 = now();
+  for (unsigned i = 0; i < reps; ++i)
+    free(loadpng_packed(path, lb, &two, &w, &h));
+  report("loadpng", spec, "rgb-two-colour", now() - t0, reps,
+    (double)spec->lines * spec->dots * reps, -1);
+  unlink(path);
+}
+
+
+static void put_frame_header(FILE *f, unsigned bpp, uint16_t width, uint16_t height, uint32_t len)
+{
+  const uint8_t hdr[16] = { 'Q', 'L', 'R', 'F', bpp, 0, 0, 0,
+    width & 0xff, width >> 8, height & 0xff, height >> 8,
+    len & 0xff, (len >> 8) & 0xff, (len >> 16) & 0xff, len >> 24 };
+  fwrite(hdr, sizeof(hdr), 1, f);
+}
+
+
+/* A batch of labels read through one stream, as from stdin: concatenated
+ * PNGs, then raw 8-bit and 1-bit frames, against loading each from its own
+ * file. Every label must come out as the file does.
+ */
+static void bench_stream(const label_spec_t *spec, const ql_raster_image_t *img, unsigned reps)
+{
+  const uint16_t lb = spec->dots / 8;
+  const ql_pack_opts_t mono = { .threshold = 0x80 };
+  const double pixels = (double)spec->lines * spec->dots * reps;
+  const char *png = synth_png(img, 8, NULL);
+  char png_path[32];
+  strcpy(png_path, png);
+  uint16_t w, h;
+  ql_packed_image_t *ref = loadpng_packed(png_path, lb, &mono, &w, &h);
+  FILE *in = fopen(png_path, "rb");
+  const char *path = "/tmp/qlbench-stream";
+  FILE *out = fopen(path, "wb");
+  if (!ref || !in || !out)
+    abort();
+  fseek(in, 0, SEEK_END);
+  const size_t png_len = ftell(in);
+  uint8_t *png_data = malloc(png_len);
+  rewind(in);
+  if (!png_data || fread(png_data, 1, png_len, in) != png_len)
+    abort();
+  fclose(in);
+
+  const size_t bits_len = (size_t)(img->width + 7) / 8 * img->height;
+  uint8_t *bits = calloc(1, bits_len);
+  for (unsigned y = 0; y < img->height; ++y)
+    for (unsigned x = 0; x < img->width; ++x)
+      if (img->data[y * img->width + x] < 0x80)
+        bits[y * ((img->width + 7) / 8) + x / 8] |= 0x80 >> (x % 8);
+  for (unsigned i = 0; i < reps; ++i)
+    fwrite(png_data, 1, png_len, out);
+  for (unsigned i = 0; i < reps; ++i)
+  {
+    put_frame_header(out, 8, img->width, img->height,
+      img->width * img->height);
+    fwrite(img->data, 1, (size_t)img->width * img->height, out);
+  }
+  for (unsigned i = 0; i < reps; ++i)
+  {
+    put_frame_header(out, 1, img->width, img->height, bits_len);
+    fwrite(bits, 1, bits_len, out);
+  }
+  fclose(out);
+  free(bits);
+  free(png_data);
+
+  ql_arena_t arena = ql_arena_create();
+  double t0 = now();
+  for (unsigned i = 0; i < reps; ++i)
+  {
+    ql_arena_reset(arena);
+    if (!loadpng_packed_arena(png_path, lb, &mono, arena, &w, &h))
+      abort();
+  }
+  report("stream", spec, "png-files", now() - t0, reps, pixels, -1);
+
+  int fd = open(path, O_RDONLY);
+  loadpng_stream_t stream = fd >= 0 ? loadpng_stream_open(fd) : NULL;
+  if (!stream)
+    abort();
+  static const char *variants[] = { "png-stream", "frame-8bit", "frame-1bit" };
+  bool same = true;
+  for (unsigned v = 0; v < 3; ++v)
+  {
+    t0 = now();
+    for (unsigned i = 0; i < reps; ++i)
+    {
+      ql_arena_reset(arena);
+      ql_packed_image_t *got =
+        loadpng_stream_next(stream, lb, &mono, arena, &w, &h);
+      same = same && got &&
+        memcmp(got->data, ref->data, (size_t)ref->lines * lb) == 0;
+    }
+    report("stream", spec, variants[v], now() - t0, reps, pixels, -1);
+  }
+  if (!same || loadpng_stream_next(stream, lb, &mono, arena, &w, &h) ||
+      !loadpng_stream_ended(stream))
+  {
+    fprintf(stderr, "stream: output mismatch, or no clean end, for %s!\n",
+      spec->name);
+    exit(EXIT_FAILURE);
+  }
+  loadpng_stream_close(stream);
+  close(fd);
+  ql_arena_destroy(arena);
+  unlink(path);
+  unlink(png_path);
+  free(ref);
+}
+
+
+/* The same label as files in each format loadimg knows, told apart by
+ * their first bytes only. Each must pack as the PNG does; PBM is also run
+ * ordered-dithered, which takes it through gray.
+ */
+static void bench_formats(const label_spec_t *spec, const ql_raster_image_t *img, unsigned reps)
+{
+  const uint16_t lb = spec->dots / 8;
+  const ql_pack_opts_t mono = { .threshold = 0x80 };
+  const ql_pack_opts_t ordered = { .threshold = 0x80, .dither = QL_DITHER_ORDERED };
+  const double pixels = (double)spec->lines * spec->dots * reps;
+  const unsigned w = img->width, h = img->height;
+  const size_t pixels_len = (size_t)w * h;
+  const size_t row_bytes = (w + 7u) / 8;
+
+  // What the PBM holds, as gray, for the dithered reference
+  ql_raster_image_t *bilevel = malloc(sizeof(ql_raster_image_t) + pixels_len);
+  uint8_t *bits = calloc(1, row_bytes * h);
+  uint8_t *wide = malloc(2 * pixels_len);
+  if (!bilevel || !bits || !wide)
+    abort();
+  bilevel->width = w;
+  bilevel->height = h;
+  for (unsigned y = 0; y < h; ++y)
+    for (unsigned x = 0; x < w; ++x)
+    {
+      const uint8_t g = img->data[y * w + x];
+      if (g < 0x80)
+        bits[y * row_bytes + x / 8] |= 0x80 >> (x % 8);
+      bilevel->data[y * w + x] = g < 0x80 ? 0 : 255;
+      wide[2 * (y * w + x)] = wide[2 * (y * w + x) + 1] = g; // g * 257
+    }
+  ql_packed_image_t *ref = ql_pack_image(img, lb, 0x80, QL_DITHER_NONE);
+  ql_packed_image_t *dithered =
+    ql_pack_image(bilevel, lb, 0x80, QL_DITHER_ORDERED);
+  if (!ref || !dithered)
+    abort();
+
+  char png_path[32];
+  strcpy(png_path, synth_png(img, 8, NULL));
+  static const char *paths[] = {
+    "/tmp/qlbench-img.pbm", "/tmp/qlbench-img.pgm",
+    "/tmp/qlbench-img16.pgm", "/tmp/qlbench-img.qlr",
+  };
+  FILE *f = fopen(paths[0], "wb");
+  if (!f)
+    abort();
+  fprintf(f, "P4\n# qlbench\n%u %u\n", w, h);
+  fwrite(bits, 1, row_bytes * h, f);
+  fclose(f);
+  if (!(f = fopen(paths[1], "wb")))
+    abort();
+  fprintf(f, "P5 %u %u 255\n", w, h);
+  fwrite(img->data, 1, pixels_len, f);
+  fclose(f);
+  if (!(f = fopen(paths[2], "wb")))
+    abort();
+  fprintf(f, "P5\n%u\n%u\n65535\n", w, h);
+  fwrite(wide, 1, 2 * pixels_len, f);
+  fclose(f);
+  if (!(f = fopen(paths[3], "wb")))
+    abort();
+  const uint32_t len = (uint32_t)ref->lines * lb;
+  const uint8_t hdr[16] = { 'Q', 'L', 'P', 'R', 1, 0, 0, 0,
+    ref->lines & 0xff, ref->lines >> 8, lb & 0xff, lb >> 8,
+    len & 0xff, (len >> 8) & 0xff, (len >> 16) & 0xff, len >> 24 };
+  fwrite(hdr, sizeof(hdr), 1, f);
+  fwrite(ref->data, 1, len, f);
+  fclose(f);
+  free(wide);
+  free(bits);
+  free(bilevel);
+
+  const struct {
+    const char *variant, *path, *format;
+    const ql_pack_opts_t *opts;
+    const ql_packed_image_t *expect;
+  } runs[] = {
+    { "png", png_path, "png", &mono, ref },
+    { "pbm", paths[0], "pbm", &mono, ref },
+    { "pbm-ordered", paths[0], "pbm", &ordered, dithered },
+    { "pgm-8bit", paths[1], "pgm", &mono, ref },
+    { "pgm-16bit", paths[2], "pgm", &mono, ref },
+    { "qlraster", paths[3], "qlraster", &mono, ref },
+  };
+  ql_arena_t arena = ql_arena_create();
+  for (unsigned r = 0; r < sizeof(runs) / sizeof(runs[0]); ++r)
+  {
+    uint8_t magic[8] = { 0, };
+    f = fopen(runs[r].path, "rb");
+    const size_t got_len = f ? fread(magic, 1, sizeof(magic), f) : 0;
+    if (f)
+      fclose(f);
+    const loadimg_format_t *fmt = loadimg_probe(magic, got_len);
+    bool same = fmt && strcmp(fmt->name, runs[r].format) == 0;
+    uint16_t iw, ih;
+    double t0 = now();
+    for (unsigned i = 0; i < reps && same; ++i)
+    {
+      ql_arena_reset(arena);
+      ql_packed_image_t *got =
+        loadimg_packed(runs[r].path, lb, runs[r].opts, arena, &iw, &ih);
+      same = got && got->lines == ref->lines &&
+        memcmp(got->data, runs[r].expect->data, (size_t)ref->lines * lb) == 0;
+    }
+    if (!same)
+    {
+      fprintf(stderr, "formats: %s output mismatch for %s!\n",
+        runs[r].variant, spec->name);
+      exit(EXIT_FAILURE);
+    }
+    report("formats", spec, runs[r].variant, now() - t0, reps, pixels, -1);
+  }
+
+  // A raster file for another print head can't be printed as it is
+  uint16_t iw, ih;
+  if (loadimg_packed(paths[3], lb + 1, &mono, arena, &iw, &ih) || !iw)
+  {
+    fprintf(stderr, "formats: qlraster for the wrong print head loaded!\n");
+    exit(EXIT_FAILURE);
+  }
+  ql_arena_destroy(arena);
+  for (unsigned i = 0; i < sizeof(paths) / sizeof(paths[0]); ++i)
+    unlink(paths[i]);
+  unlink(png_path);
+  free(dithered);
+  free(ref);
+}
+
+
+/* Loading from memory, as the print server does, with everything from the
+ * heap or from an arena. Once the arena has seen the label, loading again
+ * must not allocate at all.
+ */
+static void bench_arena(const label_spec_t *spec, const ql_raster_image_t *img, unsigned reps)
+{
+  const uint16_t lb = spec->dots / 8;
+  const ql_pack_opts_t opts = { .threshold = 0x80 };
+  const char *path = synth_png(img, 8, NULL);
+  FILE *f = fopen(path, "rb");
+  static uint8_t png[16 << 20];
+  size_t len = f ? fread(png, 1, sizeof(png), f) : 0;
+  if (!f || !len || !feof(f))
+    abort();
+  fclose(f);
+  unlink(path);
+
+  ql_packed_image_t *ref = ql_pack_image(img, lb, 0x80, QL_DITHER_NONE);
+  ql_arena_t arena = ql_arena_create();
+  uint16_t w, h;
+  ql_packed_image_t *got = arena ?
+    loadpng_packed_mem(png, len, lb, &opts, arena, &w, &h) : NULL;
+  if (!ref || !got || memcmp(ref->data, got->data, spec->lines * lb) != 0)
+  {
+    fprintf(stderr, "loadpng: arena output mismatch for %s!\n", spec->name);
+    exit(EXIT_FAILURE);
+  }
+  free(ref);
+
+  const double pixels = (double)spec->lines * spec->dots * reps;
+  double t0 = now();
+  for (unsigned i = 0; i < reps; ++i)
+    free(loadpng_packed_mem(png, len, lb, &opts, NULL, &w, &h));
+  report("loadpng", spec, "mem-heap", now() - t0, reps, pixels, -1);
+
+  ql_arena_reset(arena); // into one block, big enough from now on
+  const uint64_t allocs = ql_alloc_count();
+  t0 = now();
+  for (unsigned i = 0; i < reps; ++i)
+  {
+    ql_arena_reset(arena);
+    if (!loadpng_packed_mem(png, len, lb, &opts, arena, &w, &h))
+      abort();
+  }
+  report("loadpng", spec, "mem-arena", now() - t0, reps, pixels, -1);
+  if (ql_alloc_count() != allocs)
+  {
+    fprintf(stderr, "loadpng: %llu allocations in %u labels for %s!\n",
+      (unsigned long long)(ql_alloc_count() - allocs), reps, spec->name);
+    exit(EXIT_FAILURE);
+  }
+  ql_arena_destroy(arena);
+}
+
+
+/* Packing a long label in stripes on several threads; the result must be
+ * the same as on one, including the ink flags.
+ */
+static void bench_striped(const label_spec_t *spec, const ql_raster_image_t *img, unsigned reps)
+{
+  const uint16_t lb = spec->dots / 8;
+  const double pixels = (double)spec->lines * spec->dots * reps;
+  static const unsigned threads[] = { 2, 4, 8 };
+  ql_packed_image_t *ref = ql_pack_image(img, lb, 0x80, QL_DITHER_ORDERED);
+  for (unsigned t = 0; t < sizeof(threads)/sizeof(threads[0]); ++t)
+  {
+    ql_pack_set_threads(threads[t]);
+    ql_packed_image_t *got = ql_pack_image(img, lb, 0x80, QL_DITHER_ORDERED);
+    if (!ref || !got ||
+        memcmp(ref->data, got->data, spec->lines * lb + spec->lines) != 0)
+    {
+      fprintf(stderr, "pack: output on %u threads differs for %s!\n",
+        threads[t], spec->name);
+      exit(EXIT_FAILURE);
+    }
+    free(got);
+
+    char variant[32];
+    snprintf(variant, sizeof(variant), "striped-%u", threads[t]);
+    double t0 = now();
+    for (unsigned i = 0; i < reps; ++i)
+      free(ql_pack_image(img, lb, 0x80, QL_DITHER_NONE));
+    report("pack", spec, variant, now() - t0, reps, pixels, -1);
+  }
+  ql_pack_set_threads(1);
+  free(ref);
+}
+
+
+/* A batch of different label files, loaded and packed by the pool on
+ * one or more threads and taken in order, as qlprint does while printing.
+ */
+#define BATCH_FILES 16
+
+static void bench_pool(const label_spec_t *spec, const ql_raster_image_t *img, unsigned reps)
+{
+  const uint16_t lb = spec->dots / 8;
+  const ql_pack_opts_t opts = { .threshold = 0x80 };
+  char *paths[BATCH_FILES];
+  for (unsigned f = 0; f < BATCH_FILES; ++f)
+    if (!(paths[f] = strdup(synth_png(img, 8, NULL))))
+      abort();
+  uint16_t w, h;
+  ql_packed_image_t *ref = loadpng_packed(paths[0], lb, &opts, &w, &h);
+  if (!ref)
+    abort();
+
+  static const unsigned threads[] = { 1, 2, 4, 8 };
+  for (unsigned t = 0; t < sizeof(threads)/sizeof(threads[0]); ++t)
+  {
+    const unsigned ahead = threads[t] * 2;
+    double t0 = now();
+    for (unsigned i = 0; i < reps; ++i)
+    {
+      label_cache_t cache = label_cache_create(ahead + 1);
+      raster_pool_t pool = cache ? raster_pool_start(cache, threads[t], ahead,
+        paths, BATCH_FILES, BATCH_FILES, lb, &opts) : NULL;
+      if (!pool)
+        abort();
+      for (unsigned f = 0; f < BATCH_FILES; ++f)
+      {
+        const label_cache_entry_t *entry = raster_pool_next(pool);
+        if (!entry || !entry->packed ||
+            (i == 0 && memcmp(ref->data, entry->packed->data,
+               spec->lines * lb) != 0))
+        {
+          fprintf(stderr, "pool: output on %u threads differs for %s!\n",
+            threads[t], spec->name);
+          exit(EXIT_FAILURE);
+        }
+        label_cache_put(cache, entry);
+      }
+      raster_pool_stop(pool);
+      label_cache_destroy(cache);
+    }
+    char variant[32];
+    snprintf(variant, sizeof(variant), "threads-%u", threads[t]);
+    report("pool", spec, variant, now() - t0, reps * BATCH_FILES,
+      (double)spec->lines * spec->dots * reps * BATCH_FILES, -1);
+  }
+  free(ref);
+  for (unsigned f = 0; f < BATCH_FILES; ++f)
+  {
+    unlink(paths[f]);
+    free(paths[f]);
+  }
+}
+
+
+// A status as reported by a printer with this label's print head
+/* Template labels: stamping each record's data over the background, as
+ * against drawing the whole label afresh, or (as when labels are made
+ * elsewhere) writing it out as a PNG and loading that back.
+ */
+#define COMPOSE_RECORDS 16
+
+static ql_raster_image_t *unpack_label(const ql_packed_image_t *packed)
+{
+  const unsigned w = packed->lines, h = packed->line_bytes * 8;
+  ql_raster_image_t *img = malloc(sizeof(ql_raster_image_t) + w * h);
+  if (!img)
+    abort();
+  img->width = w;
+  img->height = h;
+  for (unsigned y = 0; y < h; ++y)
+    for (unsigned x = 0; x < w; ++x)
+      img->data[y * w + x] =
+        (packed->data[x * packed->line_bytes + y / 8] & (0x80 >> (y % 8))) ?
+          0x00 : 0xff;
+  return img;
+}
+
+static void bench_compose(const label_spec_t *spec, unsigned reps)
+{
+  const uint16_t lb = spec->dots / 8;
+  char text[1024], record[64];
+  snprintf(text, sizeof(text),
+    "size %u\n"
+    "box 0 0 %u %u 4\n"
+    "text 20 20 4 ACME Pty Ltd\n"
+    "text 20 70 3 Asset {1}\n"
+    "text 20 110 2 {2}\n"
+    "code128 20 150 3 80 {1}\n"
+    "ean 300 250 2 40 400638133393\n"
+    "qr 440 20 5 M https://example.com/a/{1}\n"
+    "text 20 250 2 Label {n}\n",
+    spec->lines, spec->lines, spec->dots);
+
+  // Barcodes refuse what they can't encode
+  ql_packed_image_t *scratch = ql_compose_create(spec->lines, lb, NULL);
+  unsigned width;
+  if (!scratch ||
+      !ql_draw_ean(scratch, 0, 0, 1, 10, "4006381333931", &width) ||
+      width != 95 || ql_draw_ean(scratch, 0, 0, 1, 10, "4006381333932", NULL) ||
+      !ql_draw_ean(scratch, 0, 0, 1, 10, "9638507", &width) || width != 67 ||
+      ql_draw_code128(scratch, 0, 0, 1, 10, "tab\there", NULL))
+  {
+    fprintf(stderr, "compose: barcode checks failed!\n");
+    exit(EXIT_FAILURE);
+  }
+  free(scratch);
+
+  // Stamped labels must be the same as ones drawn from scratch
+  unsigned bad_line;
+  ql_template_t tpl = ql_template_parse(text, lb, &bad_line);
+  if (!tpl)
+  {
+    fprintf(stderr, "compose: template rejected at line %u!\n", bad_line);
+    exit(EXIT_FAILURE);
+  }
+  const size_t bytes = (size_t)spec->lines * lb + spec->lines;
+  for (unsigned i = 0; i < COMPOSE_RECORDS; ++i)
+  {
+    snprintf(record, sizeof(record), "A-%0*u,Room %u", 1 + i % 6, i * 7919,
+      i);
+    const ql_packed_image_t *got = ql_template_stamp(tpl, record, i + 1);
+    ql_template_t fresh = ql_template_parse(text, lb, &bad_line);
+    const ql_packed_image_t *want =
+      fresh ? ql_template_stamp(fresh, record, i + 1) : NULL;
+    if (!got || !want || memcmp(got->data, want->data, bytes) != 0)
+    {
+      fprintf(stderr, "compose: stamped label %u differs from redrawn!\n", i);
+      exit(EXIT_FAILURE);
+    }
+    ql_template_destroy(fresh);
+  }
+
+  const double pixels = (double)spec->lines * spec->dots * reps;
+  double t0 = now();
+  for (unsigned i = 0; i < reps; ++i)
+  {
+    snprintf(record, sizeof(record), "A-%06u,Room %u", i, i % 100);
+    ql_template_stamp(tpl, record, i + 1);
+  }
+  report("compose", spec, "stamp", now() - t0, reps, pixels, -1);
+
+  t0 = now();
+  for (unsigned i = 0; i < reps; ++i)
+  {
+    snprintf(record, sizeof(record), "A-%06u,Room %u", i, i % 100);
+    ql_template_t fresh = ql_template_parse(text, lb, &bad_line);
+    ql_template_stamp(fresh, record, i + 1);
+    ql_template_destroy(fresh);
+  }
+  report("compose", spec, "redraw", now() - t0, reps, pixels, -1);
+
+  // The round trip this saves: label out to a PNG, and back in
+  const ql_pack_opts_t mono = { .threshold = 0x80 };
+  uint16_t w, h;
+  t0 = now();
+  for (unsigned i = 0; i < reps; ++i)
+  {
+    snprintf(record, sizeof(record), "A-%06u,Room %u", i, i % 100);
+    const ql_packed_image_t *label = ql_template_stamp(tpl, record, i + 1);
+    ql_raster_image_t *img = unpack_label(label);
+    const char *path = synth_png(img, 8, NULL);
+    ql_packed_image_t *back = loadpng_packed(path, lb, &mono, &w, &h);
+    if (!back || memcmp(back->data, label->data, spec->lines * lb) != 0)
+    {
+      fprintf(stderr, "compose: label changed on the way through PNG!\n");
+      exit(EXIT_FAILURE);
+    }
+    unlink(path);
+    free(back);
+    free(img);
+  }
+  report("compose", spec, "png-roundtrip", now() - t0, reps, pixels, -1);
+  ql_template_destroy(tpl);
+}
+
+
+static void head_status(ql_status_t *status, const label_spec_t *spec)
+{
+  ql_emulated_status(status, spec->dots > 720 ? '4' : '2', // QL-1060N, QL-570
+    QL_MEDIA_TYPE_CONTINUOUS, 62, QL_MEDIA_LENGTH_CONTINUOUS);
+}
+
+
+// Rasterising and sending, into a sink that discards everything
+static void bench_print(const label_spec_t *spec, const ql_raster_image_t *img, unsigned reps)
+{
+  ql_status_t status;
+  head_status(&status, spec);
+  const double raster_bytes = (double)spec->lines * spec->dots / 8 * reps;
+
+  ql_packed_image_t *packed =
+    ql_pack_image(img, spec->dots / 8, 0x80, QL_DITHER_NONE);
+  for (unsigned compress = 0; compress < 2; ++compress)
+  {
+    ql_print_cfg_t cfg = { .threshold = 0x80, .compress = compress };
+
+    ql_ctx_t ctx = ql_open_output("/dev/null", &status);
+    // The first one sizes the context's arena; after that, no allocations
+    if (!ctx || !packed || !ql_print_raster_image(ctx, &status, img, &cfg))
+      abort();
+    const uint64_t allocs = ql_alloc_count();
+    double t0 = now();
+    for (unsigned i = 0; i < reps; ++i)
+      if (!ql_print_raster_image(ctx, &status, img, &cfg))
+        abort();
+    report("print", spec, compress ? "raster-packbits" : "raster",
+      now() - t0, reps, raster_bytes, ql_io_stats(ctx)->syscalls);
+    if (ql_alloc_count() != allocs)
+    {
+      fprintf(stderr, "print: %llu allocations in %u labels for %s!\n",
+        (unsigned long long)(ql_alloc_count() - allocs), reps, spec->name);
+      exit(EXIT_FAILURE);
+    }
+    ql_close(ctx);
+
+    ctx = ql_open_output("/dev/null", &status);
+    if (!ctx)
+      abort();
+    t0 = now();
+    for (unsigned i = 0; i < reps; ++i)
+      if (!ql_print_packed_image(ctx, &status, packed, &cfg))
+        abort();
+    report("print", spec, compress ? "packed-packbits" : "packed",
+      now() - t0, reps, raster_bytes, ql_io_stats(ctx)->syscalls);
+    ql_close(ctx);
+  }
+  free(packed);
+
+  // Packed in stripes on several threads, still without allocating
+  if (spec->lines < LINES_LONG)
+    return;
+  ql_pack_set_threads(4);
+  ql_print_cfg_t cfg = { .threshold = 0x80 };
+  ql_ctx_t ctx = ql_open_output("/dev/null", &status);
+  if (!ctx || !ql_print_raster_image(ctx, &status, img, &cfg))
+    abort();
+  const uint64_t allocs = ql_alloc_count();
+  double t0 = now();
+  for (unsigned i = 0; i < reps; ++i)
+    if (!ql_print_raster_image(ctx, &status, img, &cfg))
+      abort();
+  report("print", spec, "raster-striped-4", now() - t0, reps, raster_bytes,
+    ql_io_stats(ctx)->syscalls);
+  if (ql_alloc_count() != allocs)
+  {
+    fprintf(stderr, "print: %llu allocations in %u striped labels for %s!\n",
+      (unsigned long long)(ql_alloc_count() - allocs), reps, spec->name);
+    exit(EXIT_FAILURE);
+  }
+  ql_close(ctx);
+  ql_pack_set_threads(1);
+}
+
+
+static bool same_file(const char *path_a, const char *path_b)
+{
+  FILE *a = fopen(path_a, "rb"), *b = fopen(path_b, "rb");
+  bool same = a && b;
+  for (int ca = 0, cb = 0; same && ca != EOF; )
+  {
+    ca = fgetc(a);
+    cb = fgetc(b);
+    same = ca == cb;
+  }
+  if (a)
+    fclose(a);
+  if (b)
+    fclose(b);
+  return same;
+}
+
+
+/* A serialised run: the same label but for a serial number and its
+ * barcode, sent with and without delta sending. The output must be the
+ * same; only the lines that changed should be encoded anew.
+ */
+static void bench_delta(const label_spec_t *spec, const ql_raster_image_t *img, unsigned reps)
+{
+  ql_status_t status;
+  head_status(&status, spec);
+  const uint16_t lb = spec->dots / 8;
+  const double raster_bytes = (double)spec->lines * spec->dots / 8 * reps;
+  ql_packed_image_t *base = ql_pack_image(img, lb, 0x80, QL_DITHER_NONE);
+  ql_packed_image_t *label = ql_compose_create(spec->lines, lb, NULL);
+  if (!base || !label)
+    abort();
+  const size_t bytes = (size_t)spec->lines * lb;
+  const ql_print_cfg_t cfg = { .threshold = 0x80, .compress = true };
+
+  char paths[2][32];
+  uint32_t reused = 0;
+  for (unsigned delta = 0; delta < 2; ++delta)
+  {
+    snprintf(paths[delta], sizeof(paths[delta]), "/tmp/qlbench-delta%u", delta);
+    ql_ctx_t ctx = ql_open_output(paths[delta], &status);
+    if (!ctx)
+      abort();
+    ql_set_delta(ctx, delta);
+    double t0 = now();
+    for (unsigned i = 0; i < reps; ++i)
+    {
+      char serial[16];
+      snprintf(serial, sizeof(serial), "SN%06u", i);
+      memcpy(label->data, base->data, bytes);
+      memcpy(label->ink, base->ink, spec->lines);
+      for (unsigned x = 20; x < 300 && x < spec->lines; ++x)
+        memset(label->data + x * lb + 2, 0, 16); // a clear patch, dots 16-143
+      ql_draw_text(label, 30, 20, 3, serial);
+      ql_draw_code128(label, 30, 60, 2, 60, serial, NULL);
+      if (!ql_print_packed_image(ctx, &status, label, &cfg))
+        abort();
+      if (delta)
+        reused += ql_last_print_stats(ctx)->reused_lines;
+    }
+    report("delta", spec, delta ? "serial-delta" : "serial",
+      now() - t0, reps, raster_bytes, ql_io_stats(ctx)->syscalls);
+    ql_close(ctx);
+  }
+
+  if (!same_file(paths[0], paths[1]) || (reps > 1 && !reused))
+  {
+    fprintf(stderr, "delta: output differs, or nothing reused, for %s!\n",
+      spec->name);
+    exit(EXIT_FAILURE);
+  }
+  unlink(paths[0]);
+  unlink(paths[1]);
+  printf("{\"bench\":\"delta\",\"label\":\"%s\",\"reused_pct\":%.1f}\n",
+    spec->name, 100.0 * reused / ((double)spec->lines * reps));
+  free(label);
+  free(base);
+}
+
+
+/* A run spooled, then sent from the spool, against the same labels packed
+ * and sent directly; the output must be the same. Labels marked printed
+ * must still be after reopening, and a spool cut short must not open.
+ */
+static void bench_spool(const label_spec_t *spec, const ql_raster_image_t *img, unsigned reps)
+{
+  ql_status_t status;
+  head_status(&status, spec);
+  const double raster_bytes = (double)spec->lines * spec->dots / 8 * reps;
+  ql_packed_image_t *packed =
+    ql_pack_image(img, spec->dots / 8, 0x80, QL_DITHER_NONE);
+  if (!packed)
+    abort();
+  ql_print_cfg_t cfg = { .threshold = 0x80, .compress = true };
+  const char *path = "/tmp/qlbench.qls";
+  const char *direct = "/tmp/qlbench-direct", *spooled = "/tmp/qlbench-spooled";
+
+  double t0 = now();
+  spool_writer_t sw = spool_create(path, &status);
+  for (unsigned i = 0; sw && i < reps; ++i)
+  {
+    cfg.first_page = i == 0;
+    if (!spool_add(sw, spec->name, packed, &cfg))
+      abort();
+  }
+  if (!sw || !spool_finish(sw))
+    abort();
+  report("spool", spec, "write", now() - t0, reps, raster_bytes, 0);
+
+  ql_ctx_t ctx = ql_open_output(direct, &status);
+  if (!ctx)
+    abort();
+  t0 = now();
+  for (unsigned i = 0; i < reps; ++i)
+  {
+    cfg.first_page = i == 0;
+    if (!ql_print_packed_image(ctx, &status, packed, &cfg))
+      abort();
+  }
+  report("spool", spec, "packed", now() - t0, reps, raster_bytes,
+    ql_io_stats(ctx)->syscalls);
+  ql_close(ctx);
+
+  ctx = ql_open_output(spooled, &status);
+  t0 = now();
+  spool_t sp = spool_open(path);
+  if (!ctx || !sp || spool_labels(sp) != reps || spool_done(sp))
+    abort();
+  for (unsigned i = 0; i < reps; ++i)
+  {
+    ql_encoded_image_t enc;
+    const char *name;
+    spool_label(sp, i, &enc, &cfg, &name);
+    if (strcmp(name, spec->name) != 0 ||
+        !ql_print_encoded_image(ctx, &status, &enc, &cfg))
+      abort();
+  }
+  report("spool", spec, "spooled", now() - t0, reps, raster_bytes,
+    ql_io_stats(ctx)->syscalls);
+  ql_close(ctx);
+
+  const unsigned half = reps / 2;
+  for (unsigned i = 0; i < half; ++i)
+    if (!spool_mark_done(sp, i))
+      abort();
+  spool_close(sp);
+  sp = spool_open(path);
+  bool journal_ok = sp && spool_done(sp) == half;
+  for (unsigned i = 0; journal_ok && i < reps; ++i)
+    journal_ok = spool_is_done(sp, i) == (i < half);
+  spool_close(sp);
+
+  struct stat st;
+  bool cut_ok = stat(path, &st) == 0 && truncate(path, st.st_size - 1) == 0 &&
+    !spool_open(path) && errno == EINVAL;
+
+  if (!same_file(direct, spooled) || !journal_ok || !cut_ok)
+  {
+    fprintf(stderr, "spool: output differs, journal lost or damage unseen, "
+      "for %s!\n", spec->name);
+    exit(EXIT_FAILURE);
+  }
+  unlink(path);
+  unlink(direct);
+  unlink(spooled);
+  free(packed);
+}
+
+
+typedef struct {
+  emulator_t emu;
+  int master;
+  volatile bool stop;
+  bool ok;
+} mock_device_t;
+
+static void *run_mock_device(void *arg)
+{
+  mock_device_t *dev = arg;
+  dev->ok = emulator_run(dev->emu, dev->master, dev->master, &dev->stop);
+  return NULL;
+}
+
+typedef struct {
+  const ql_packed_image_t *expect;
+  unsigned pages, bad_pages;
+} page_check_t;
+
+static void check_page(const ql_packed_image_t *page, void *arg)
+{
+  page_check_t *check = arg;
+  ++check->pages;
+  if (page->lines != check->expect->lines ||
+      page->planes != check->expect->planes ||
+      memcmp(page->data, check->expect->data,
+        page->lines * page->planes * page->line_bytes) != 0)
+    ++check->bad_pages;
+}
+
+
+/* Whole jobs against the emulator on a pty, stop-and-wait like the print
+ * server, with every page checked against what was sent. Two-colour
+ * images go to an emulated QL-800.
+ */
+static void bench_end_to_end(const label_spec_t *spec, ql_packed_image_t *packed, unsigned reps)
+{
+  ql_status_t status;
+  head_status(&status, spec);
+  const bool two_colour = packed && packed->planes == 2;
+  if (two_colour)
+    status.model_code = '8';
+  const uint16_t lb = spec->dots / 8;
+  page_check_t check = { packed, 0, 0 };
+  emulator_cfg_t ecfg = {
+    .model_code = status.model_code,
+    .media_type = status.media_type,
+    .media_width_mm = status.media_width_mm,
+    .media_length_mm = status.media_length_mm,
+  };
+  mock_device_t dev = { .emu = emulator_create(&ecfg, check_page, &check) };
+  int slave;
+  const char *port;
+  if (!packed || !dev.emu || !emulator_open_pty(&dev.master, &slave, &port))
+    abort();
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, run_mock_device, &dev) != 0)
+    abort();
+
+  for (unsigned compress = 0; compress < 2; ++compress)
+  {
+    ql_print_cfg_t cfg = { .threshold = 0x80, .compress = compress };
+    ql_ctx_t ctx = ql_open(port);
+    if (!ctx || !ql_init(ctx) || !ql_request_status(ctx) ||
+        !ql_read_status(ctx, &status))
+      abort();
+    uint64_t syscalls = ql_io_stats(ctx)->syscalls;
+
+    double t0 = now();
+    for (unsigned i = 0; i < reps; ++i)
+    {
+      if (!ql_print_packed_image(ctx, &status, packed, &cfg))
+        abort();
+      do
+      {
+        if (!ql_wait_status(ctx, &status, 5) ||
+            status.status_type == QL_STATUS_TYPE_ERROR_OCCURRED)
+        {
+          fprintf(stderr, "end-to-end: no print for %s!\n", spec->name);
+          exit(EXIT_FAILURE);
+        }
+      } while (status.status_type != QL_STATUS_TYPE_PRINTING_DONE);
+    }
+    report("end-to-end", spec, two_colour ?
+        (compress ? "two-colour-packbits" : "two-colour-raw") :
+        (compress ? "packbits" : "raw"),
+      now() - t0, reps, (double)spec->lines * packed->planes * lb * reps,
+      ql_io_stats(ctx)->syscalls - syscalls);
+    ql_close(ctx);
+  }
+
+  dev.stop = true;
+  pthread_join(thread, NULL);
+  close(slave);
+  close(dev.master);
+  emulator_destroy(dev.emu);
+  free(packed);
+  if (!dev.ok || check.bad_pages || check.pages != 2 * reps)
+  {
+    fprintf(stderr, "end-to-end: %u of %u pages printed wrong for %s!\n",
+      check.bad_pages + 2 * reps - check.pages, 2 * reps, spec->name);
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+int main(int argc, char *argv[])
+{
+  unsigned reps = argc > 1 ? atoi(argv[1]) : 20;
+  verify_kernels();
+  verify_fit();
+  verify_dither();
+  verify_decode();
+  for (unsigned i = 0; i < CORPUS_SIZE; ++i)
+  {
+    const label_spec_t *spec = &corpus[i];
+    ql_raster_image_t *img = synth_label(spec);
+    uint8_t *rgb = synth_rgb(img);
+    const uint16_t lb = spec->dots / 8;
+    unsigned n = reps_for(spec->lines, reps);
+    bench_pack(spec, img, rgb, n);
+    bench_loadpng(spec, img, 8, n);
+    bench_loadpng(spec, img, 1, n);
+    bench_loadpng_two_colour(spec, img, rgb, n);
+    bench_arena(spec, img, n);
+    bench_stream(spec, img, n);
+    bench_formats(spec, img, n);
+    if (spec->lines >= LINES_LONG)
+      bench_striped(spec, img, n);
+    else
+    {
+      bench_pool(spec, img, n);
+      if (spec->kind == TEXT) // the same template whatever the kind
+        bench_compose(spec, n);
+    }
+    bench_print(spec, img, n);
+    bench_delta(spec, img, n);
+    bench_spool(spec, img, n);
+    bench_end_to_end(spec, ql_pack_image(img, lb, 0x80, QL_DITHER_NONE), n);
+    if (spec->dots == 720) // the QL-800 series' print head
+      bench_end_to_end(spec,
+        pack_two_colour(rgb, spec->lines, spec->dots, lb, 0x80), n);
+    free(rgb);
+    free(img);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright 2017 DiUS Computing Pty Ltd. All rights reserved.
+ *
+ * Released under GPLv3, see LICENSE for details.
+ *
+ * @author Johny Mattsson <jmattsson@dius.com.au>
+ */
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Arenas hold the buffers for one label at a time (decoder state, packer
+ * workspace, the packed image itself), so a long-running process can get
+ * through label after label without going to the heap. Everything from an
+ * arena is released at once by resetting it. An arena that had to grow
+ * during a label is remade as a single block big enough for all of it, so
+ * once the largest label has been seen there are no more allocations.
+ * Arenas are not thread-safe; use one per thread.
+ */
+typedef struct ql_arena *ql_arena_t;
+
+ql_arena_t ql_arena_create(void);
+void ql_arena_destroy(ql_arena_t arena);
+void ql_arena_reset(ql_arena_t arena);
+// Suitably aligned for anything, NULL on out-of-memory
+void *ql_arena_alloc(ql_arena_t arena, size_t size);
+
+/* These take an arena or NULL, so code can serve either; with NULL they
+ * use the heap, and ql_arena_free() frees. Memory comes back zeroed.
+ */
+void *ql_arena_calloc(ql_arena_t arena, size_t size);
+void ql_arena_free(ql_arena_t arena, void *ptr);
+
+/* Heap allocation as done throughout, counted (arenas' own blocks
+ * included), so a caller can check that it has stopped allocating.
+ */
+void *ql_malloc(size_t size);
+void *ql_calloc(size_t num, size_t size);
+void *ql_realloc(void *ptr, size_t size);
+char *ql_strdup(const char *s);
+void ql_free(void *ptr);
+uint64_t ql_alloc_count(void);
+
+#endif
@@ -0,0 +1,82 @@
+/*
+ * Copyright 2017 DiUS Computing Pty Ltd. All rights reserved.
+ *
+ * Released under GPLv3, see LICENSE for details.
+ *
+ * @author Johny Mattsson <jmattsson@dius.com.au>
+ */
+#ifndef _COMPOSE_H_
+#define _COMPOSE_H_
+
+#include "ql.h"
+#include "arena.h"
+#include "qrcode.h"
+
+/* Label composition: text, barcodes, QR codes, lines and boxes drawn
+ * straight into a packed image, ready for ql_print_packed_image(), without
+ * an 8-bit image (or a PNG) in between. Coordinates are those of the label
+ * as an image: x along the label (the raster line), y across it (the dot
+ * within the line), from the top left. Everything is black, on the first
+ * plane, and clipped to the image; the ink flags are kept up to date.
+ */
+
+// A blank image, from arena or the heap if NULL; NULL on out-of-memory
+ql_packed_image_t *ql_compose_create(uint16_t lines, uint16_t line_bytes, ql_arena_t arena);
+
+void ql_draw_fill(ql_packed_image_t *img, int x, int y, unsigned w, unsigned h);
+void ql_draw_box(ql_packed_image_t *img, int x, int y, unsigned w, unsigned h, unsigned thickness);
+
+/* Text in the built-in 5x7 font, in cells of 6x8 scaled up by a whole
+ * factor; characters outside printable ASCII show as '?'.
+ */
+unsigned ql_text_width(const char *text, unsigned scale);
+void ql_draw_text(ql_packed_image_t *img, int x, int y, unsigned scale, const char *text);
+
+/* Barcodes, bars 'module' lines per unit width and 'height' dots tall,
+ * without quiet zones (ten modules for Code 128, seven for EAN, to be left
+ * clear). Code 128 takes printable ASCII, switching to code set C for
+ * runs of digits. EAN takes 7 or 12 digits (EAN-8 or EAN-13) and adds the
+ * check digit, or 8 or 13 and checks it. False with errno EINVAL if the
+ * text can't be encoded; else the width in lines, if wanted.
+ */
+bool ql_draw_code128(ql_packed_image_t *img, int x, int y, unsigned module, unsigned height, const char *text, unsigned *width);
+bool ql_draw_ean(ql_packed_image_t *img, int x, int y, unsigned module, unsigned height, const char *digits, unsigned *width);
+
+/* A QR code, 'module' dots per module, without its quiet zone (four
+ * modules). The workspace may be NULL to have one allocated for the call.
+ * False with errno as for ql_qr_encode(); else the size in dots.
+ */
+bool ql_draw_qr(ql_packed_image_t *img, int x, int y, unsigned module, uint8_t ecc, const char *text, ql_qr_t *work, unsigned *size);
+
+/* Templates describe a label, one element per line ('#' starts a comment):
+ *
+ *   size <length>                          label length, in lines
+ *   text <x> <y> <scale> <text>
+ *   code128 <x> <y> <module> <height> <text>
+ *   ean <x> <y> <module> <height> <digits>
+ *   qr <x> <y> <module> <L|M|Q|H> <text>
+ *   line <x> <y> <w> <h>                   i.e. a filled rectangle
+ *   box <x> <y> <w> <h> <thickness>
+ *
+ * Text may take per-label data: {1} to {9} are the fields of the label's
+ * record (separated by commas), and {n} the label's number. Elements
+ * without any are drawn once, into a background; for each label, only the
+ * lines the others covered last time are restored from it, and those are
+ * drawn afresh.
+ */
+typedef struct ql_template *ql_template_t;
+
+/* NULL on error, with errno EINVAL and *bad_line the line at fault for a
+ * bad template (0 if it just lacks a size)
+ */
+ql_template_t ql_template_load(const char *path, uint16_t line_bytes, unsigned *bad_line);
+ql_template_t ql_template_parse(const char *text, uint16_t line_bytes, unsigned *bad_line);
+void ql_template_destroy(ql_template_t tpl);
+
+/* The label for a record and label number, owned by the template and
+ * valid until the next stamp; NULL if the data can't be drawn (e.g. is
+ * not digits, for EAN), with errno set.
+ */
+const ql_packed_image_t *ql_template_stamp(ql_template_t tpl, const char *record, unsigned number);
+
+#endif
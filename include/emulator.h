@@ -0,0 +1,73 @@
+/*
+ * Copyright 2017 DiUS Computing Pty Ltd. All rights reserved.
+ *
+ * Released under GPLv3, see LICENSE for details.
+ *
+ * @author Johny Mattsson <jmattsson@dius.com.au>
+ */
+#ifndef _EMULATOR_H_
+#define _EMULATOR_H_
+
+#include "ql.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/* A software QL printer, for testing and benchmarking without hardware.
+ * It parses the raster command stream the way the printer does, answers
+ * with the same 32-byte status replies (including phase changes and
+ * printing-done), and reconstructs each printed page. The link and the
+ * print mechanism can be throttled to a given speed, so that timing
+ * effects such as pipelining and compression show up deterministically.
+ */
+
+typedef struct {
+  uint8_t model_code;        // as in ql_status_t, e.g. '2' for QL-570
+  uint8_t media_type;        // QL_MEDIA_TYPE_xxx
+  uint8_t media_width_mm;
+  uint8_t media_length_mm;   // QL_MEDIA_LENGTH_CONTINUOUS for rolls
+  uint32_t link_bytes_per_s; // 0 for unthrottled
+  uint32_t print_lines_per_s; // 0 for instant
+} emulator_cfg_t;
+
+typedef struct {
+  uint32_t pages;
+  uint32_t lines;       // raster lines printed, including blank ones
+  uint32_t blank_lines; // of which sent as 'Z'
+  uint32_t errors;      // error statuses sent (bad commands, wrong media)
+  uint64_t bytes;       // command stream bytes received
+} emulator_stats_t;
+
+// Called with each page as printed; page->ink is NULL, and two-colour pages
+// (sent in the QL-800 series' two-colour mode) have planes 2
+typedef void (*emulator_page_fn)(const ql_packed_image_t *page, void *arg);
+
+typedef struct emulator *emulator_t;
+
+emulator_t emulator_create(const emulator_cfg_t *cfg, emulator_page_fn on_page, void *arg);
+void emulator_destroy(emulator_t emu);
+
+/* Serves the printer side of a pty, socket pair or FIFO pair: reads
+ * commands from in_fd and writes status replies to out_fd (which may be
+ * the same fd) until in_fd reaches EOF or hangs up, or stop is set.
+ * Returns false on error, with errno set.
+ */
+bool emulator_run(emulator_t emu, int in_fd, int out_fd, volatile bool *stop);
+
+/* Lower level interface, for driving the emulator from another loop.
+ * emulator_feed() takes command stream bytes as they arrive, in pieces of
+ * any size. emulator_next_status() gives the next status reply once it is
+ * due; otherwise it returns false and sets *wait_ms to how long until it
+ * will be, or -1 if none is pending.
+ */
+bool emulator_feed(emulator_t emu, const uint8_t *buf, size_t len);
+bool emulator_next_status(emulator_t emu, ql_status_t *status, int *wait_ms);
+
+const emulator_stats_t *emulator_stats(emulator_t emu);
+
+/* Creates a raw-mode pty for the emulator to serve on master, with port
+ * being the path for ql_open(). Keeping slave open means clients can come
+ * and go without the master seeing a hangup.
+ */
+bool emulator_open_pty(int *master, int *slave, const char **port);
+
+#endif
@@ -0,0 +1,35 @@
+/*
+ * Copyright 2017 DiUS Computing Pty Ltd. All rights reserved.
+ *
+ * Released under GPLv3, see LICENSE for details.
+ *
+ * @author Johny Mattsson <jmattsson@dius.com.au>
+ */
+#ifndef _FARM_H_
+#define _FARM_H_
+
+#include "ql.h"
+
+/* A printer farm drives several printers at once, each from its own worker
+ * thread. Jobs go into a shared queue, and each idle printer takes the
+ * oldest job that its loaded media satisfies (per the job's
+ * QL_PRINT_CFG_MEDIA_xxx requirements). A printer reporting an error is
+ * taken out of rotation, and the job it was printing goes back on the
+ * queue for the others. Jobs no remaining printer can take fail.
+ */
+
+typedef struct farm *farm_t;
+
+// Opens and fully sets up one printer, reading its status; NULL on failure
+typedef ql_ctx_t (*farm_open_fn)(const char *printer, ql_status_t *status, void *arg);
+
+// Returns NULL if none of the printers could be opened
+farm_t farm_start(char *const printers[], unsigned num_printers, unsigned timeout, farm_open_fn open, void *open_arg);
+
+// Queues an image file (see loadimg.h) for printing; path and cfg are copied
+bool farm_submit(farm_t farm, const char *path, const ql_print_cfg_t *cfg);
+
+// Waits for all jobs to finish and stops the farm; returns exit code
+int farm_finish(farm_t farm);
+
+#endif
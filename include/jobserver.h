@@ -0,0 +1,63 @@
+/*
+ * Copyright 2017 DiUS Computing Pty Ltd. All rights reserved.
+ *
+ * Released under GPLv3, see LICENSE for details.
+ *
+ * @author Johny Mattsson <jmattsson@dius.com.au>
+ */
+#ifndef _JOBSERVER_H_
+#define _JOBSERVER_H_
+
+#include "ql.h"
+
+/* The job server keeps the printer open and set up, and takes print jobs
+ * over a Unix domain socket, so a label costs only its own rasterising
+ * and transfer time rather than a process start and printer handshake.
+ *
+ * A client may send any number of jobs on one connection. Each job is a
+ * jobserver_job_t followed by image_bytes of image data (PNG, or any other
+ * format loadimg.h knows), and is answered with a single line:
+ * "OK <width>x<height>" or "ERR <reason>".
+ *
+ * The socket is only accessible to the user running the server, and is
+ * by default in that user's runtime directory rather than a shared one
+ * such as /tmp, where anyone could put a socket in its place first. A
+ * server won't start on a socket another is still serving.
+ */
+
+#define JOBSERVER_SOCKET_NAME "qlprint.sock"
+
+// $XDG_RUNTIME_DIR/qlprint.sock, or /run/qlprint.sock if that isn't set
+const char *jobserver_default_socket(void);
+
+#define JOBSERVER_JOB_MAGIC 0x324a4c51 // "QLJ2"
+#define JOBSERVER_MAX_IMAGE_BYTES (64u << 20)
+
+typedef struct {
+  uint32_t magic;
+  uint32_t image_bytes;
+  uint16_t copies;
+  uint8_t threshold;
+  uint8_t flags; // QL_PRINT_CFG_xxx, as in ql_print_cfg_t
+  uint8_t media_type;
+  uint8_t media_width;
+  uint8_t media_length;
+  uint8_t compress;
+  uint8_t dither; // QL_DITHER_xxx
+  // These were reserved, so are zero from older clients
+  uint8_t two_colour;
+  uint8_t rotate; // QL_ROTATE_xxx
+  uint8_t fit;
+} jobserver_job_t;
+
+// Called to reinitialise the printer after an error; false if it can't be
+typedef bool (*jobserver_reset_fn)(ql_ctx_t ctx, ql_status_t *status, void *arg);
+
+// Serves jobs until a fatal error; returns the process exit code
+int jobserver_run(ql_ctx_t ctx, ql_status_t *status, const char *socket_path, unsigned timeout, jobserver_reset_fn reset, void *reset_arg);
+
+// Sends each file as a job with the given settings, and 1-65535 copies;
+// returns exit code
+int jobserver_submit(const char *socket_path, const ql_print_cfg_t *cfg, unsigned copies, char *const files[], int num_files);
+
+#endif
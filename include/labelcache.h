@@ -0,0 +1,41 @@
+/*
+ * Copyright 2017 DiUS Computing Pty Ltd. All rights reserved.
+ *
+ * Released under GPLv3, see LICENSE for details.
+ *
+ * @author Johny Mattsson <jmattsson@dius.com.au>
+ */
+#ifndef _LABELCACHE_H_
+#define _LABELCACHE_H_
+
+#include "raster.h"
+
+/* Cache of loaded and rasterised labels, so that printing many copies of
+ * the same file only decodes and packs it once. Entries are keyed by path
+ * and file modification time (as well as the rasterisation parameters),
+ * so a file rewritten between copies is picked up.
+ *
+ * The cache may be shared between threads. Each entry handed out is held
+ * until given back with label_cache_put(), and is never replaced while
+ * held; a label being loaded by one thread is waited for, not loaded
+ * again, by any other wanting it. There must be more entries than can be
+ * held (or loading) at once.
+ */
+
+typedef struct label_cache *label_cache_t;
+
+typedef struct {
+  uint16_t width, height; // source image size
+  const ql_packed_image_t *packed; // NULL if image too large for printer
+} label_cache_entry_t;
+
+label_cache_t label_cache_create(unsigned max_entries);
+void label_cache_destroy(label_cache_t cache);
+
+// NULL on error, with errno EBUSY if every entry is held
+const label_cache_entry_t *label_cache_get(label_cache_t cache, const char *path, uint16_t line_bytes, const ql_pack_opts_t *opts);
+void label_cache_put(label_cache_t cache, const label_cache_entry_t *entry);
+
+void label_cache_stats(label_cache_t cache, unsigned *hits, unsigned *misses);
+
+#endif
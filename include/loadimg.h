@@ -0,0 +1,59 @@
+/*
+ * Copyright 2017 DiUS Computing Pty Ltd. All rights reserved.
+ *
+ * Released under GPLv3, see LICENSE for details.
+ *
+ * @author Johny Mattsson <jmattsson@dius.com.au>
+ */
+#ifndef _LOADIMG_H_
+#define _LOADIMG_H_
+
+#include "raster.h"
+
+/* Image files in any of the formats below, told apart by their first bytes
+ * rather than by name. The file is mapped, and rows are handed to the
+ * packer straight from the mapping where the format allows, so only PNG
+ * goes through a decoder:
+ *
+ *   PNG        via loadpng
+ *   PBM (P4)   binary, 1 = black; rows are already packed as the packer
+ *              takes them
+ *   PGM (P5)   binary, 8 or 16 bits; at a maxval of 255 rows go to the
+ *              packer as they are
+ *   QL raster  raster lines already packed for the print head, taken as
+ *              they are: no thresholding, rotating or scaling applies
+ *
+ * A QL raster file is a 16-byte header, then the lines as held in
+ * ql_packed_image_t data (line after line, planes black then red):
+ *
+ *   "QLPR"               magic
+ *   uint8_t planes       1, or 2 for black/red
+ *   uint8_t rsvd[3]
+ *   uint16_t lines       little-endian, as are the rest
+ *   uint16_t line_bytes  must match the printer's
+ *   uint32_t length      of the lines that follow, lines * planes * line_bytes
+ */
+typedef struct {
+  const char *name;
+  // Whether data, from its first bytes, looks like one
+  bool (*probe)(const uint8_t *data, size_t len);
+  // As for loadimg_packed_mem()
+  ql_packed_image_t *(*load)(const uint8_t *data, size_t len, uint16_t line_bytes, const ql_pack_opts_t *opts, ql_arena_t arena, uint16_t *width, uint16_t *height);
+} loadimg_format_t;
+
+// All known formats, in the order they are probed
+const loadimg_format_t *loadimg_formats(unsigned *num);
+// The format of data, or NULL if none knows it
+const loadimg_format_t *loadimg_probe(const uint8_t *data, size_t len);
+
+/* Loads and packs as for loadpng_packed_arena(), whatever the format. Width
+ * and height are set whenever the header could be read, so a NULL return
+ * with a non-zero size means the image was too large for line_bytes (or
+ * out-of-memory); for QL raster, that its lines are not line_bytes long.
+ * Unknown formats fail with errno EINVAL.
+ */
+ql_packed_image_t *loadimg_packed(const char *path, uint16_t line_bytes, const ql_pack_opts_t *opts, ql_arena_t arena, uint16_t *width, uint16_t *height);
+// An image already in memory, e.g. as received by the job server
+ql_packed_image_t *loadimg_packed_mem(const void *data, size_t len, uint16_t line_bytes, const ql_pack_opts_t *opts, ql_arena_t arena, uint16_t *width, uint16_t *height);
+
+#endif
@@ -8,8 +8,51 @@
 #ifndef _LOADPNG_H_
 #define _LOADPNG_H_
 
-#include "ql.h"
+#include "raster.h"
 
 ql_raster_image_t *loadpng(const char *path);
 
+/* Decodes row by row straight into the rasteriser, without ever holding
+ * the full 8-bit image (interlaced images excepted), packing as per opts
+ * (see ql_packer_create_opts()). Width and height are set whenever the PNG
+ * header could be read, so a NULL return with a non-zero size means the
+ * image was too large for line_bytes (or out-of-memory).
+ */
+ql_packed_image_t *loadpng_packed(const char *path, uint16_t line_bytes, const ql_pack_opts_t *opts, uint16_t *width, uint16_t *height);
+
+/* Versions taking an arena, from which everything needed for the load
+ * (libpng's own memory included) and the result are taken; with NULL,
+ * the same as the above. The result is released by resetting the arena.
+ */
+ql_raster_image_t *loadpng_arena(const char *path, ql_arena_t arena);
+ql_packed_image_t *loadpng_packed_arena(const char *path, uint16_t line_bytes, const ql_pack_opts_t *opts, ql_arena_t arena, uint16_t *width, uint16_t *height);
+// A PNG already in memory, e.g. as received by the job server
+ql_packed_image_t *loadpng_packed_mem(const void *data, size_t len, uint16_t line_bytes, const ql_pack_opts_t *opts, ql_arena_t arena, uint16_t *width, uint16_t *height);
+
+/* A stream of images on a file descriptor (stdin, a pipe), one after the
+ * other: PNGs, or raw frames, in any mix. It is read in large blocks into
+ * a buffer that libpng and the packer take from directly, not via stdio.
+ * A raw frame is a 16-byte header, then its rows top to bottom:
+ *
+ *   "QLRF"             magic
+ *   uint8_t bpp        1 (packed MSB first, 1 = black) or 8 (gray)
+ *   uint8_t rsvd[3]
+ *   uint16_t width     little-endian, as are the rest
+ *   uint16_t height
+ *   uint32_t length    of the rows that follow, height * row bytes
+ */
+typedef struct loadpng_stream *loadpng_stream_t;
+
+loadpng_stream_t loadpng_stream_open(int fd); // fd is not closed with it
+void loadpng_stream_close(loadpng_stream_t s);
+/* The next image, packed as for loadpng_packed(); NULL at the end of the
+ * stream, or on error (errno EINVAL for bad data), after which the rest of
+ * the stream can't be made sense of.
+ */
+ql_packed_image_t *loadpng_stream_next(loadpng_stream_t s, uint16_t line_bytes, const ql_pack_opts_t *opts, ql_arena_t arena, uint16_t *width, uint16_t *height);
+bool loadpng_stream_ended(loadpng_stream_t s); // cleanly, between images
+// Whether some of the next image (or the end) is read already, so that
+// reading it won't wait on fd before getting started
+bool loadpng_stream_buffered(loadpng_stream_t s);
+
 #endif
@@ -19,6 +19,7 @@
  *     http://download.brother.com/welcome/docp000678/cv_qlseries_eng_raster_600.pdf
  * - Software Developer's Manual Raster Command Reference   QL-710W/720NW 
  *    http://download.brother.com/welcome/docp000698/cv_ql710720_eng_raster_100.pdf
+ * - Software Developer's Manual Raster Command Reference QL-800/810W/820NWB
  * - Actual experience communicating with a QL-570
  *
  */
@@ -100,6 +101,7 @@ typedef struct
 // Flags for expanded mode
 #define QL_EXPANDED_MODE_CUT_AT_END     0x10  /* Gah, 710 doc claims 0x08! */
 #define QL_EXPANDED_MODE_HIGH_RES       0x40  /* QL-570/580N/700 */
+#define QL_EXPANDED_MODE_TWO_COLOUR     0x01  /* QL-800 series */
 
 typedef struct {
   uint16_t width;
@@ -107,6 +109,18 @@ typedef struct {
   uint8_t data[];
 } ql_raster_image_t;
 
+/* Image already thresholded and transposed into printer raster lines. A
+ * two-colour image has two planes per line, black then red, in the order
+ * the printer takes them.
+ */
+typedef struct {
+  uint16_t lines;      // number of raster lines (source image width)
+  uint16_t line_bytes; // bytes per raster line (print head dots / 8)
+  uint8_t planes;      // 1, or 2 for black/red
+  uint8_t *ink;        // per line, non-zero if it has any ink; NULL=unknown
+  uint8_t data[];      // lines * planes * line_bytes, line after line
+} ql_packed_image_t;
+
 typedef struct {
   uint8_t threshold; // pixel values below threshold deemed black
   uint8_t flags; // QL_PRINT_CFG_xxx flags, indicating which other fields valid
@@ -114,6 +128,11 @@ typedef struct {
   uint8_t media_width;
   uint8_t media_length;
   bool first_page; // used for autocut pagination
+  bool compress; // PackBits raster compression, ignored if model lacks it
+  uint8_t dither; // QL_DITHER_xxx, how gray turns into black and white
+  bool two_colour; // black and red, for QL-800 series with black/red media
+  uint8_t rotate; // QL_ROTATE_xxx
+  bool fit; // scale to the loaded media's printable width
 } ql_print_cfg_t;
 
 #define QL_PRINT_CFG_MEDIA_TYPE     0x02
@@ -121,14 +140,87 @@ typedef struct {
 #define QL_PRINT_CFG_MEDIA_LENGTH   0x08
 #define QL_PRINT_CFG_QUALITY_PRIO   0x40
 
+#define QL_DITHER_NONE            0 // plain threshold
+#define QL_DITHER_ORDERED         1 // 8x8 Bayer matrix
+#define QL_DITHER_FLOYD_STEINBERG 2
+#define QL_DITHER_ATKINSON        3
+
+// Quarter turns clockwise, or whichever way round fits
+#define QL_ROTATE_0     0
+#define QL_ROTATE_90    1
+#define QL_ROTATE_180   2
+#define QL_ROTATE_270   3
+#define QL_ROTATE_AUTO  4
+
+// Raster compression mode, sent as 'M' n
+#define QL_COMPRESSION_NONE     0x00
+#define QL_COMPRESSION_PACKBITS 0x02  /* a.k.a. TIFF */
+
+// Raster transfer statistics for the most recently printed image
+typedef struct {
+  uint32_t lines;        // raster lines in the image
+  uint32_t raster_bytes; // raster blocks as they'd be sent uncompressed
+  uint32_t sent_bytes;   // raster blocks as actually sent
+  uint32_t blank_lines;  // lines sent as a single 'Z' byte
+  uint32_t reused_lines; // lines sent as encoded for the label before
+} ql_print_stats_t;
+
+// Device I/O counters, cumulative since ql_open()
+typedef struct {
+  uint64_t syscalls; // writev() calls, including retries
+  uint64_t bytes;
+  uint64_t flushes;
+} ql_io_stats_t;
+
 typedef struct ql_ctx *ql_ctx_t;
 
 ql_ctx_t ql_open(const char *printer);
 void ql_close(ql_ctx_t ctx);
 
+/* Writes the command stream to a file (stdout for "-") instead of a printer,
+ * e.g. for testing, or for sending to a printer elsewhere later. Status
+ * replies are made up from as_printer: a status request gets a reply, and
+ * each printed image reports printing, printing done and receiving again.
+ * There is no fd to poll for those, ql_status_fd() returns -1.
+ */
+ql_ctx_t ql_open_output(const char *path, const ql_status_t *as_printer);
+// Fills in a status as the given model with the given media would report it
+void ql_emulated_status(ql_status_t *status, uint8_t model_code, uint8_t media_type, uint8_t media_width_mm, uint8_t media_length_mm);
+
+/* Output to the printer is gathered into chunks of (by default) 8k and
+ * written with writev(). Buffered output is flushed automatically when
+ * an image has been sent and before reading status; 0 disables buffering.
+ */
+bool ql_set_output_chunk(ql_ctx_t ctx, size_t bytes);
+bool ql_flush(ql_ctx_t ctx);
+const ql_io_stats_t *ql_io_stats(ql_ctx_t ctx);
+
+/* For runs of labels differing in a few places (serial numbers, say), each
+ * raster line found the same as in the label sent before is sent as it was
+ * encoded then, rather than encoded again; the output is the same. This
+ * keeps a copy of the last label, raw and encoded. Off by default.
+ */
+void ql_set_delta(ql_ctx_t ctx, bool enabled);
+
 bool ql_init(ql_ctx_t ctx); // also cancel
 bool ql_request_status(ql_ctx_t ctx);
+// Waits for status until the deadline if one is armed, else a short while
 bool ql_read_status(ql_ctx_t ctx, ql_status_t *status);
+// Waits for status for up to timeout seconds, or indefinitely if 0
+bool ql_wait_status(ql_ctx_t ctx, ql_status_t *status, unsigned timeout);
+
+/* Non-blocking status, for poll()/epoll loops driving several printers.
+ * Wait for ql_status_fd() to become readable (POLLIN) or for
+ * ql_status_timeout_ms() to run out, then call ql_poll_status(). It returns
+ * true once a whole 32-byte reply has arrived, however many reads that took,
+ * otherwise false with errno EAGAIN (not yet), ETIME (deadline passed) or
+ * some other error. The deadline is per context, and is disarmed when a
+ * status arrives. A timeout of 0 disarms it, to wait indefinitely.
+ */
+int ql_status_fd(ql_ctx_t ctx);
+void ql_set_status_timeout(ql_ctx_t ctx, unsigned timeout_ms);
+int ql_status_timeout_ms(ql_ctx_t ctx); // -1 if no deadline armed
+bool ql_poll_status(ql_ctx_t ctx, ql_status_t *status);
 
 bool ql_needs_mode_switch(const ql_status_t *status);
 bool ql_switch_to_raster_mode(ql_ctx_t ctx);
@@ -137,19 +229,104 @@ bool ql_set_mode(ql_ctx_t ctx, unsigned mode);
 bool ql_set_expanded_mode(ql_ctx_t ctx, unsigned mode);
 bool ql_set_autocut_every_n(ql_ctx_t ctx, uint8_t n);
 bool ql_set_margin(ql_ctx_t ctx, uint16_t dots);
+bool ql_set_compression(ql_ctx_t ctx, unsigned mode);
+
+bool ql_supports_compression(const ql_status_t *status);
+bool ql_supports_zero_lines(const ql_status_t *status);
+bool ql_supports_two_colour(const ql_status_t *status);
 
-// Note: status needed for 1050/1060N detection to adjust command format
+// Raster line size in bytes; 90 for most models, 162 for 1050/1060N
+unsigned ql_raster_line_bytes(const ql_status_t *status);
+// Printable dots across the loaded media, 0 if not known for its width
+unsigned ql_media_dots(const ql_status_t *status);
+
+/* Note: status needed for 1050/1060N detection to adjust command format.
+ * Two-colour images need a printer for which ql_supports_two_colour(),
+ * and fail with ENOTSUP otherwise.
+ */
 bool ql_print_raster_image(ql_ctx_t ctx, const ql_status_t *status, const ql_raster_image_t *img, const ql_print_cfg_t *cfg);
+bool ql_print_packed_image(ql_ctx_t ctx, const ql_status_t *status, const ql_packed_image_t *img, const ql_print_cfg_t *cfg);
+const ql_print_stats_t *ql_last_print_stats(ql_ctx_t ctx);
+
+/* Raster lines encoded ahead of time, just as ql_print_packed_image() would
+ * send them: 'g' blocks (or black and red 'w' blocks), PackBits compressed
+ * if asked for and supported, and 'Z' for blank lines where supported.
+ * They can be kept (e.g. in a job spool) and sent later to any printer
+ * taking them the same way, without packing or encoding again.
+ */
+typedef struct {
+  uint16_t lines;
+  uint16_t line_bytes;
+  uint8_t planes;
+  bool compressed;  // blocks are PackBits compressed
+  bool zero_lines;  // blank lines are sent as 'Z'
+  uint32_t blank_lines;
+  size_t len;
+  const uint8_t *data;
+} ql_encoded_image_t;
 
-// Caution: ql_decode_*() are *not* multi-thread safe
+// The most ql_encode_packed_image() may take for img
+size_t ql_encoded_max(const ql_packed_image_t *img);
+/* Encodes img for the printer, into buf (with data pointing at it); fails
+ * as ql_print_packed_image() would
+ */
+bool ql_encode_packed_image(const ql_status_t *status, const ql_packed_image_t *img, const ql_print_cfg_t *cfg, uint8_t *buf, ql_encoded_image_t *enc);
+/* The raster lines are written straight from img->data (mapped from a
+ * file, say), not copied. Fails with errno EINVAL if encoded for a
+ * different print head, or using compression or 'Z' where not supported.
+ */
+bool ql_print_encoded_image(ql_ctx_t ctx, const ql_status_t *status, const ql_encoded_image_t *img, const ql_print_cfg_t *cfg);
+
+/* The decoders return constant strings, or for the _r() variants the text
+ * written into the caller's buffer when there is any to build (unknown
+ * codes, error lists). The plain variants use per-thread buffers, valid
+ * until the next call from the same thread.
+ */
+#define QL_DECODE_BUF_LEN 256 // fits every error at once
 const char *ql_decode_mode(const ql_status_t *status);
 const char *ql_decode_errors(const ql_status_t *status);
 const char *ql_decode_model(const ql_status_t *status);
 const char *ql_decode_media_type(const ql_status_t *status);
+const char *ql_decode_errors_r(const ql_status_t *status, char *buf, size_t len);
+const char *ql_decode_model_r(const ql_status_t *status, char *buf, size_t len);
+const char *ql_decode_media_type_r(const ql_status_t *status, char *buf, size_t len);
 #define QL_DECODE_MODEL  0x01
 #define QL_DECODE_ERROR  0x02
 #define QL_DECODE_MEDIA  0x04
 #define QL_DECODE_MODE   0x08
+#define QL_DECODE_JSON   0x10 // one JSON object per line, not text
 void ql_decode_print_status(FILE *out, const ql_status_t *status, unsigned flags);
 
+/* The parts of a status that describe the printer's state, for telling
+ * cheaply whether anything changed between polls. The alternative media
+ * type codes are folded into the usual ones.
+ */
+typedef struct {
+  uint8_t model; // QL_MODEL_xxx
+  uint8_t mode;
+  uint16_t errors; // err_info_1 | err_info_2 << 8, QL_ERR_x_xxx bits
+  uint8_t media_type;
+  uint8_t media_width_mm;
+  uint8_t media_length_mm;
+  uint8_t phase_type;
+} ql_status_summary_t;
+
+#define QL_MODEL_UNKNOWN     0
+#define QL_MODEL_QL500_550   1
+#define QL_MODEL_QL560       2
+#define QL_MODEL_QL570       3
+#define QL_MODEL_QL580N      4
+#define QL_MODEL_QL650TD     5
+#define QL_MODEL_QL700       6
+#define QL_MODEL_QL710W      7
+#define QL_MODEL_QL720NW     8
+#define QL_MODEL_QL800       9
+#define QL_MODEL_QL810W     10
+#define QL_MODEL_QL820NWB   11
+#define QL_MODEL_QL1050     12
+#define QL_MODEL_QL1060N    13
+
+void ql_status_summarise(ql_status_summary_t *sum, const ql_status_t *status);
+bool ql_status_summary_equal(const ql_status_summary_t *a, const ql_status_summary_t *b);
+
 #endif
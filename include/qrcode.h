@@ -0,0 +1,44 @@
+/*
+ * Copyright 2017 DiUS Computing Pty Ltd. All rights reserved.
+ *
+ * Released under GPLv3, see LICENSE for details.
+ *
+ * @author Johny Mattsson <jmattsson@dius.com.au>
+ */
+#ifndef _QRCODE_H_
+#define _QRCODE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* QR code encoder (ISO/IEC 18004), for the label composer. Data is always
+ * encoded in byte mode, in the smallest version (1 to 40) that holds it at
+ * the error correction level asked for, with the mask that scores lowest
+ * on the standard's penalty rules.
+ */
+
+#define QL_QR_ECC_L 0 // ~7% of codewords can be restored
+#define QL_QR_ECC_M 1 // ~15%
+#define QL_QR_ECC_Q 2 // ~25%
+#define QL_QR_ECC_H 3 // ~30%
+
+#define QL_QR_MAX_SIZE      177 // modules per side, version 40
+#define QL_QR_MAX_CODEWORDS 3706
+
+// Workspace and result; big, so best kept around rather than on the stack
+typedef struct {
+  uint8_t size; // modules per side, 17 + 4 * version
+  uint8_t modules[QL_QR_MAX_SIZE][QL_QR_MAX_SIZE]; // [y][x], 1 = dark
+  uint8_t function[QL_QR_MAX_SIZE][QL_QR_MAX_SIZE]; // not data, not masked
+  uint8_t data[QL_QR_MAX_CODEWORDS];
+  uint8_t codewords[QL_QR_MAX_CODEWORDS];
+} ql_qr_t;
+
+// Names as taken by templates: "L", "M", "Q" or "H"
+bool ql_qr_ecc_by_name(const char *name, uint8_t *ecc);
+
+// False with errno EMSGSIZE if too long for any version, EINVAL on bad ecc
+bool ql_qr_encode(ql_qr_t *qr, const uint8_t *data, size_t len, uint8_t ecc);
+
+#endif
@@ -0,0 +1,119 @@
+/*
+ * Copyright 2017 DiUS Computing Pty Ltd. All rights reserved.
+ *
+ * Released under GPLv3, see LICENSE for details.
+ *
+ * @author Johny Mattsson <jmattsson@dius.com.au>
+ */
+#ifndef _RASTER_H_
+#define _RASTER_H_
+
+#include "ql.h"
+#include "arena.h"
+
+/* The rasteriser converts an 8-bit grayscale image into printer raster lines.
+ *
+ * The printer wants the image column by column (one raster line per image
+ * column, MSB first from the top row), while images are stored row by row.
+ * Rather than walking each column down the full image, the rasteriser
+ * makes a single row-major pass: eight rows at a time are thresholded into
+ * packed row bitmaps, and each 8x8 block of bits is then transposed into
+ * one byte of each of eight raster lines.
+ */
+
+/* The thresholding step is done by one of several kernels; vectorised
+ * ones are compiled in where the target architecture has them, and the
+ * best one the running CPU supports is picked automatically unless another
+ * is selected explicitly. All kernels produce identical output.
+ */
+typedef void (*ql_threshold_fn)(uint8_t *bits, const uint8_t *gray, unsigned width, uint8_t black_below_v);
+// Same, but with a limit per pixel, repeating every eight (ordered dithering)
+typedef void (*ql_ordered_fn)(uint8_t *bits, const uint8_t *gray, unsigned width, const uint8_t limits[8]);
+
+typedef struct {
+  const char *name;
+  ql_threshold_fn threshold_row;
+  ql_ordered_fn ordered_row;
+  bool (*supported)(void); // whether the running CPU can use this kernel
+} ql_pack_kernel_t;
+
+// All compiled-in kernels, whether supported by this CPU or not
+const ql_pack_kernel_t *ql_pack_kernels(unsigned *num);
+// Selects by name, or "auto"/NULL for the best supported one
+bool ql_pack_select_kernel(const char *name);
+const ql_pack_kernel_t *ql_pack_kernel(void);
+
+/* Instead of plain thresholding, rows can be dithered (QL_DITHER_xxx), with
+ * the threshold then setting the mid-gray point. Ordered dithering costs
+ * about the same as thresholding; error diffusion takes a few more
+ * nanoseconds per pixel. Names are as given to qlprint -H.
+ */
+bool ql_dither_by_name(const char *name, uint8_t *dither);
+
+/* Streaming interface: rows are fed in top to bottom as they become
+ * available (e.g. straight out of a decoder), so the full 8-bit image
+ * never needs to exist. Only the packed result and one band of eight
+ * packed rows are held. Rows not added by the time of finishing are white.
+ * Create returns NULL if the image is too tall for line_bytes (after any
+ * rotating and scaling), or on out-of-memory.
+ */
+typedef struct ql_packer *ql_packer_t;
+
+ql_packer_t ql_packer_create(uint16_t width, uint16_t height, uint16_t line_bytes, uint8_t threshold, uint8_t dither);
+
+/* The general form. Rotation costs next to nothing: it only changes where
+ * each packed row goes, and a quarter turn even saves the transpose, as
+ * each image row then makes a raster line. Scaling (see resample.h) keeps
+ * the aspect ratio, and makes the side that runs across the print head
+ * fit_dots dots; it happens on the way in, so the packer only ever sees
+ * rows of the scaled size. QL_ROTATE_AUTO turns the image a quarter when
+ * it would only fit across the print head that way or, when scaling, when
+ * it is taller than it is wide.
+ */
+typedef struct {
+  uint8_t threshold;
+  uint8_t dither;    // QL_DITHER_xxx, not for two-colour
+  bool two_colour;   // see ql_packer_create_two_colour()
+  uint8_t rotate;    // QL_ROTATE_xxx
+  uint16_t fit_dots; // 0 for no scaling
+} ql_pack_opts_t;
+
+// Options for printing as configured, on the printer and media in status
+void ql_pack_opts(ql_pack_opts_t *opts, const ql_print_cfg_t *cfg, const ql_status_t *status);
+ql_packer_t ql_packer_create_opts(uint16_t width, uint16_t height, uint16_t line_bytes, const ql_pack_opts_t *opts);
+// With the packer and packed image from arena, or the heap if NULL
+ql_packer_t ql_packer_create_arena(uint16_t width, uint16_t height, uint16_t line_bytes, const ql_pack_opts_t *opts, ql_arena_t arena);
+// Names as given to qlprint -r: "0", "90", "180", "270" or "auto"
+bool ql_rotate_by_name(const char *name, uint8_t *rotate);
+void ql_packer_add_row(ql_packer_t p, const uint8_t *gray);
+// Row already packed MSB first, 1 = black; skips thresholding and dithering
+void ql_packer_add_bits(ql_packer_t p, const uint8_t *bits);
+
+/* Two-colour packing, for black/red media. The packed image has a red
+ * plane after the black one in each line. RGB rows (three bytes a pixel)
+ * are classified in a single pass: red where the red channel stands well
+ * clear of green and blue and those are below the threshold, otherwise
+ * black where the gray value is. Gray and packed rows may still be added,
+ * and only ever give black. There is no dithering in two-colour mode.
+ * Added to a single-colour packer, red in RGB rows prints black.
+ */
+ql_packer_t ql_packer_create_two_colour(uint16_t width, uint16_t height, uint16_t line_bytes, uint8_t threshold);
+void ql_packer_add_rgb_row(ql_packer_t p, const uint8_t *rgb);
+ql_packed_image_t *ql_packer_finish(ql_packer_t p); // also frees packer
+void ql_packer_destroy(ql_packer_t p); // abandons packing
+
+// Packs a whole image; NULL if too tall for line_bytes, or on out-of-memory
+ql_packed_image_t *ql_pack_image(const ql_raster_image_t *img, uint16_t line_bytes, uint8_t threshold, uint8_t dither);
+ql_packed_image_t *ql_pack_image_opts(const ql_raster_image_t *img, uint16_t line_bytes, const ql_pack_opts_t *opts);
+ql_packed_image_t *ql_pack_image_arena(const ql_raster_image_t *img, uint16_t line_bytes, const ql_pack_opts_t *opts, ql_arena_t arena);
+
+/* Whole images long enough to be worth it are packed in stripes of raster
+ * lines (i.e. of image columns) on up to this many threads, one by default.
+ * The result is the same either way. Only unrotated, unscaled images can
+ * be split, and not with error diffusion, which runs the length of a row.
+ * The stripes are packed into the same arena as the result, so packing in
+ * stripes makes no more allocations than packing whole does.
+ */
+void ql_pack_set_threads(unsigned threads);
+
+#endif
@@ -0,0 +1,37 @@
+/*
+ * Copyright 2017 DiUS Computing Pty Ltd. All rights reserved.
+ *
+ * Released under GPLv3, see LICENSE for details.
+ *
+ * @author Johny Mattsson <jmattsson@dius.com.au>
+ */
+#ifndef _RASTERPOOL_H_
+#define _RASTERPOOL_H_
+
+#include "labelcache.h"
+
+/* A pool of threads loading and rasterising labels ahead of printing, for
+ * batches of labels. Label n of the run is paths[n % num_paths], so copies
+ * of a set of files are just a longer run. The threads take labels in
+ * order, each as soon as it is free, but never more than 'ahead' labels
+ * past the one last taken; labels are then taken by a single caller (the
+ * one writing to the printer) strictly in order, so the output is the
+ * same as rasterising one after another. Labels come from (and copies are
+ * found in) the given cache, which needs at least ahead + 1 entries: up to
+ * ahead held by the pool, and one by the caller.
+ */
+
+typedef struct raster_pool *raster_pool_t;
+
+// NULL on out-of-memory or failure to start any threads
+raster_pool_t raster_pool_start(label_cache_t cache, unsigned threads, unsigned ahead, char *const paths[], unsigned num_paths, unsigned total, uint16_t line_bytes, const ql_pack_opts_t *opts);
+
+/* Waits for the next label; NULL if it failed to load (or past the end).
+ * The entry is held in the cache until given back with label_cache_put().
+ */
+const label_cache_entry_t *raster_pool_next(raster_pool_t pool);
+
+// Stops the threads, giving back any labels not taken
+void raster_pool_stop(raster_pool_t pool);
+
+#endif
@@ -0,0 +1,33 @@
+/*
+ * Copyright 2017 DiUS Computing Pty Ltd. All rights reserved.
+ *
+ * Released under GPLv3, see LICENSE for details.
+ *
+ * @author Johny Mattsson <jmattsson@dius.com.au>
+ */
+#ifndef _RESAMPLE_H_
+#define _RESAMPLE_H_
+
+#include "arena.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Streaming image resampler, for scaling labels to the media as they are
+ * decoded. Source rows go in top to bottom, and each resampled row is
+ * handed on as soon as the source rows it depends on have arrived, so
+ * only a couple of rows are ever held. Each axis is scaled on its own:
+ * shrinking averages the box of source pixels behind each output pixel,
+ * enlarging interpolates bilinearly. All in integers, with 8-bit weights.
+ * Pixels are one or more 8-bit channels (e.g. gray, or RGB).
+ */
+
+typedef void (*ql_resample_row_fn)(const uint8_t *row, void *arg);
+
+typedef struct ql_resampler *ql_resampler_t;
+
+// From arena, or the heap if NULL; NULL on out-of-memory, or if any dimension is zero
+ql_resampler_t ql_resampler_create(uint16_t src_width, uint16_t src_height, uint16_t dst_width, uint16_t dst_height, unsigned channels, ql_resample_row_fn emit, void *arg, ql_arena_t arena);
+void ql_resampler_add_row(ql_resampler_t rs, const uint8_t *row);
+void ql_resampler_destroy(ql_resampler_t rs);
+
+#endif
@@ -0,0 +1,62 @@
+/*
+ * Copyright 2017 DiUS Computing Pty Ltd. All rights reserved.
+ *
+ * Released under GPLv3, see LICENSE for details.
+ *
+ * @author Johny Mattsson <jmattsson@dius.com.au>
+ */
+#ifndef _SPOOL_H_
+#define _SPOOL_H_
+
+#include "ql.h"
+
+/* Job spools: a run of labels rasterised and encoded ahead of time for a
+ * printer, with each label's print config, in a file that is mapped and
+ * sent from as it is. A journal in the file records each label as printed
+ * once the printer says so, so a run that stopped part way (the process
+ * killed, the printer out of labels) picks up where it left off, without
+ * loading or rasterising anything again. Labels sent but not yet reported
+ * printed when the run stopped are sent again.
+ *
+ * The file, in host byte order:
+ *   header   magic "QLSPOOL1", label count, index and journal offsets, and
+ *            the status of the printer spooled for
+ *   data     each label's encoded raster lines, then its name
+ *   index    per label, where its data is, how it is encoded, its config
+ *   journal  a byte per label, non-zero once printed
+ * A spool is written under a temporary name and renamed into place once
+ * complete, so it is either all there or not at all.
+ */
+
+typedef struct spool_writer *spool_writer_t;
+
+// NULL on error, with errno set
+spool_writer_t spool_create(const char *path, const ql_status_t *status);
+/* Encodes the label for the printer spooled for; only cfg's media
+ * request, quality, first page and compression matter. False on error,
+ * with errno set, as for ql_encode_packed_image() or a write failing.
+ */
+bool spool_add(spool_writer_t sw, const char *name, const ql_packed_image_t *img, const ql_print_cfg_t *cfg);
+// Writes out the index and journal and puts the spool in place; frees sw
+bool spool_finish(spool_writer_t sw);
+// Drops an unfinished spool
+void spool_abort(spool_writer_t sw);
+
+
+typedef struct spool *spool_t;
+
+// NULL on error, with errno EINVAL if not a (whole) spool
+spool_t spool_open(const char *path);
+void spool_close(spool_t sp);
+
+const ql_status_t *spool_status(spool_t sp); // of the printer spooled for
+unsigned spool_labels(spool_t sp);
+unsigned spool_done(spool_t sp); // how many are marked printed
+
+// The i'th label: its raster lines, in the mapped file, and print config
+void spool_label(spool_t sp, unsigned i, ql_encoded_image_t *img, ql_print_cfg_t *cfg, const char **name);
+bool spool_is_done(spool_t sp, unsigned i);
+// Records the label as printed, on disk before returning
+bool spool_mark_done(spool_t sp, unsigned i);
+
+#endif
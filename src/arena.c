@@ -0,0 +1,161 @@
+/*
+ * Copyright 2017 DiUS Computing Pty Ltd. All rights reserved.
+ *
+ * Released under GPLv3, see LICENSE for details.
+ *
+ * @author Johny Mattsson <jmattsson@dius.com.au>
+ */
+#include "arena.h"
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_BLOCK (64 * 1024)
+#define ALIGN alignof(max_align_t)
+
+typedef struct block
+{
+  struct block *next;
+  size_t size, used;
+  alignas(max_align_t) uint8_t data[];
+} block_t;
+
+struct ql_arena
+{
+  block_t *blocks; // the one being used first
+  size_t used;     // in all blocks since the last reset
+};
+
+static atomic_uint_fast64_t allocs;
+
+
+void *ql_malloc(size_t size)
+{
+  atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+  return malloc(size);
+}
+
+
+void *ql_calloc(size_t num, size_t size)
+{
+  atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+  return calloc(num, size);
+}
+
+
+void *ql_realloc(void *ptr, size_t size)
+{
+  atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+  return realloc(ptr, size);
+}
+
+
+char *ql_strdup(const char *s)
+{
+  atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+  return strdup(s);
+}
+
+
+void ql_free(void *ptr)
+{
+  free(ptr);
+}
+
+
+uint64_t ql_alloc_count(void)
+{
+  return atomic_load_explicit(&allocs, memory_order_relaxed);
+}
+
+
+static block_t *new_block(size_t size)
+{
+  block_t *b = ql_malloc(sizeof(block_t) + size);
+  if (b)
+  {
+    b->next = NULL;
+    b->size = size;
+    b->used = 0;
+  }
+  return b;
+}
+
+
+static void free_blocks(ql_arena_t arena)
+{
+  for (block_t *b = arena->blocks, *next; b; b = next)
+  {
+    next = b->next;
+    ql_free(b);
+  }
+  arena->blocks = NULL;
+}
+
+
+ql_arena_t ql_arena_create(void)
+{
+  return ql_calloc(1, sizeof(struct ql_arena));
+}
+
+
+void ql_arena_destroy(ql_arena_t arena)
+{
+  if (!arena)
+    return;
+  free_blocks(arena);
+  ql_free(arena);
+}
+
+
+void ql_arena_reset(ql_arena_t arena)
+{
+  if (arena->blocks && arena->blocks->next)
+  {
+    // Outgrew the first block; one to hold the lot next time
+    free_blocks(arena);
+    arena->blocks = new_block(arena->used);
+  }
+  else if (arena->blocks)
+    arena->blocks->used = 0;
+  arena->used = 0;
+}
+
+
+void *ql_arena_alloc(ql_arena_t arena, size_t size)
+{
+  size = (size + ALIGN - 1) & ~(ALIGN - 1);
+  block_t *b = arena->blocks;
+  if (!b || b->size - b->used < size)
+  {
+    size_t grow = b ? 2 * b->size : MIN_BLOCK;
+    b = new_block(size > grow ? size : grow);
+    if (!b)
+      return NULL;
+    b->next = arena->blocks;
+    arena->blocks = b;
+  }
+  void *ptr = b->data + b->used;
+  b->used += size;
+  arena->used += size;
+  return ptr;
+}
+
+
+void *ql_arena_calloc(ql_arena_t arena, size_t size)
+{
+  if (!arena)
+    return ql_calloc(1, size);
+  void *ptr = ql_arena_alloc(arena, size);
+  if (ptr)
+    memset(ptr, 0, size);
+  return ptr;
+}
+
+
+void ql_arena_free(ql_arena_t arena, void *ptr)
+{
+  if (!arena)
+    ql_free(ptr);
+}
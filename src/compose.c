@@ -0,0 +1,782 @@
+/*
+ * Copyright 2017 DiUS Computing Pty Ltd. All rights reserved.
+ *
+ * Released under GPLv3, see LICENSE for details.
+ *
+ * @author Johny Mattsson <jmattsson@dius.com.au>
+ */
+#include "compose.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_CODE128 128 // characters
+#define MAX_TEXT    4096 // expanded template text, or record
+#define MAX_FIELDS  9
+
+// 5x7, printable ASCII from ' ', a byte per column with the top row in bit 0
+static const uint8_t font[95][5] = {
+  { 0x00, 0x00, 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x5f, 0x00, 0x00 },
+  { 0x00, 0x07, 0x00, 0x07, 0x00 }, { 0x14, 0x7f, 0x14, 0x7f, 0x14 },
+  { 0x24, 0x2a, 0x7f, 0x2a, 0x12 }, { 0x23, 0x13, 0x08, 0x64, 0x62 },
+  { 0x36, 0x49, 0x56, 0x20, 0x50 }, { 0x00, 0x00, 0x07, 0x00, 0x00 },
+  { 0x00, 0x1c, 0x22, 0x41, 0x00 }, { 0x00, 0x41, 0x22, 0x1c, 0x00 },
+  { 0x14, 0x08, 0x3e, 0x08, 0x14 }, { 0x08, 0x08, 0x3e, 0x08, 0x08 },
+  { 0x00, 0x50, 0x30, 0x00, 0x00 }, { 0x08, 0x08, 0x08, 0x08, 0x08 },
+  { 0x00, 0x60, 0x60, 0x00, 0x00 }, { 0x20, 0x10, 0x08, 0x04, 0x02 },
+  { 0x3e, 0x51, 0x49, 0x45, 0x3e }, { 0x00, 0x42, 0x7f, 0x40, 0x00 }, // 0 1
+  { 0x42, 0x61, 0x51, 0x49, 0x46 }, { 0x21, 0x41, 0x45, 0x4b, 0x31 },
+  { 0x18, 0x14, 0x12, 0x7f, 0x10 }, { 0x27, 0x45, 0x45, 0x45, 0x39 },
+  { 0x3c, 0x4a, 0x49, 0x49, 0x30 }, { 0x01, 0x71, 0x09, 0x05, 0x03 },
+  { 0x36, 0x49, 0x49, 0x49, 0x36 }, { 0x06, 0x49, 0x49, 0x29, 0x1e },
+  { 0x00, 0x36, 0x36, 0x00, 0x00 }, { 0x00, 0x56, 0x36, 0x00, 0x00 },
+  { 0x08, 0x14, 0x22, 0x41, 0x00 }, { 0x14, 0x14, 0x14, 0x14, 0x14 },
+  { 0x00, 0x41, 0x22, 0x14, 0x08 }, { 0x02, 0x01, 0x51, 0x09, 0x06 },
+  { 0x32, 0x49, 0x79, 0x41, 0x3e }, { 0x7e, 0x11, 0x11, 0x11, 0x7e }, // @ A
+  { 0x7f, 0x49, 0x49, 0x49, 0x36 }, { 0x3e, 0x41, 0x41, 0x41, 0x22 },
+  { 0x7f, 0x41, 0x41, 0x22, 0x1c }, { 0x7f, 0x49, 0x49, 0x49, 0x41 },
+  { 0x7f, 0x09, 0x09, 0x09, 0x01 }, { 0x3e, 0x41, 0x49, 0x49, 0x7a },
+  { 0x7f, 0x08, 0x08, 0x08, 0x7f }, { 0x00, 0x41, 0x7f, 0x41, 0x00 },
+  { 0x20, 0x40, 0x41, 0x3f, 0x01 }, { 0x7f, 0x08, 0x14, 0x22, 0x41 },
+  { 0x7f, 0x40, 0x40, 0x40, 0x40 }, { 0x7f, 0x02, 0x0c, 0x02, 0x7f },
+  { 0x7f, 0x04, 0x08, 0x10, 0x7f }, { 0x3e, 0x41, 0x41, 0x41, 0x3e },
+  { 0x7f, 0x09, 0x09, 0x09, 0x06 }, { 0x3e, 0x41, 0x51, 0x21, 0x5e },
+  { 0x7f, 0x09, 0x19, 0x29, 0x46 }, { 0x46, 0x49, 0x49, 0x49, 0x31 },
+  { 0x01, 0x01, 0x7f, 0x01, 0x01 }, { 0x3f, 0x40, 0x40, 0x40, 0x3f },
+  { 0x1f, 0x20, 0x40, 0x20, 0x1f }, { 0x3f, 0x40, 0x38, 0x40, 0x3f },
+  { 0x63, 0x14, 0x08, 0x14, 0x63 }, { 0x07, 0x08, 0x70, 0x08, 0x07 },
+  { 0x61, 0x51, 0x49, 0x45, 0x43 }, { 0x00, 0x7f, 0x41, 0x41, 0x00 },
+  { 0x02, 0x04, 0x08, 0x10, 0x20 }, { 0x00, 0x41, 0x41, 0x7f, 0x00 },
+  { 0x04, 0x02, 0x01, 0x02, 0x04 }, { 0x40, 0x40, 0x40, 0x40, 0x40 },
+  { 0x00, 0x01, 0x02, 0x04, 0x00 }, { 0x20, 0x54, 0x54, 0x54, 0x78 }, // ` a
+  { 0x7f, 0x48, 0x44, 0x44, 0x38 }, { 0x38, 0x44, 0x44, 0x44, 0x20 },
+  { 0x38, 0x44, 0x44, 0x48, 0x7f }, { 0x38, 0x54, 0x54, 0x54, 0x18 },
+  { 0x08, 0x7e, 0x09, 0x01, 0x02 }, { 0x0c, 0x52, 0x52, 0x52, 0x3e },
+  { 0x7f, 0x08, 0x04, 0x04, 0x78 }, { 0x00, 0x44, 0x7d, 0x40, 0x00 },
+  { 0x20, 0x40, 0x44, 0x3d, 0x00 }, { 0x7f, 0x10, 0x28, 0x44, 0x00 },
+  { 0x00, 0x41, 0x7f, 0x40, 0x00 }, { 0x7c, 0x04, 0x18, 0x04, 0x78 },
+  { 0x7c, 0x08, 0x04, 0x04, 0x78 }, { 0x38, 0x44, 0x44, 0x44, 0x38 },
+  { 0x7c, 0x14, 0x14, 0x14, 0x08 }, { 0x08, 0x14, 0x14, 0x18, 0x7c },
+  { 0x7c, 0x08, 0x04, 0x04, 0x08 }, { 0x48, 0x54, 0x54, 0x54, 0x20 },
+  { 0x04, 0x3f, 0x44, 0x40, 0x20 }, { 0x3c, 0x40, 0x40, 0x20, 0x7c },
+  { 0x1c, 0x20, 0x40, 0x20, 0x1c }, { 0x3c, 0x40, 0x30, 0x40, 0x3c },
+  { 0x44, 0x28, 0x10, 0x28, 0x44 }, { 0x0c, 0x50, 0x50, 0x50, 0x3c },
+  { 0x44, 0x64, 0x54, 0x4c, 0x44 }, { 0x00, 0x08, 0x36, 0x41, 0x00 },
+  { 0x00, 0x00, 0x7f, 0x00, 0x00 }, { 0x00, 0x41, 0x36, 0x08, 0x00 },
+  { 0x08, 0x04, 0x08, 0x10, 0x08 },
+};
+
+/* Code 128 symbols as bar, space, bar... widths in modules; 103-105 are
+ * start codes A, B and C, and 106 the stop
+ */
+static const char code128[107][8] = {
+  "212222", "222122", "222221", "121223", "121322", "131222", "122213",
+  "122312", "132212", "221213", "221312", "231212", "112232", "122132",
+  "122231", "113222", "123122", "123221", "223211", "221132", "221231",
+  "213212", "223112", "312131", "311222", "321122", "321221", "312212",
+  "322112", "322211", "212123", "212321", "232121", "111323", "131123",
+  "131321", "112313", "132113", "132311", "211313", "231113", "231311",
+  "112133", "112331", "132131", "113123", "113321", "133121", "313121",
+  "211331", "231131", "213113", "213311", "213131", "311123", "311321",
+  "331121", "312113", "312311", "332111", "314111", "221411", "431111",
+  "111224", "111422", "121124", "121421", "141122", "141221", "112214",
+  "112412", "122114", "122411", "142112", "142211", "241211", "221114",
+  "413111", "241112", "134111", "111242", "121142", "121241", "114212",
+  "124112", "124211", "411212", "421112", "421211", "212141", "214121",
+  "412121", "111143", "111341", "131141", "114113", "114311", "411113",
+  "411311", "113141", "114131", "311141", "411131", "211412", "211214",
+  "211232", "2331112",
+};
+#define CODE128_CODE_C  99
+#define CODE128_CODE_B  100
+#define CODE128_START_B 104
+#define CODE128_START_C 105
+#define CODE128_STOP    106
+
+// EAN digit patterns, seven modules MSB first, 1 = bar
+static const uint8_t ean_l[10] = {
+  0x0d, 0x19, 0x13, 0x3d, 0x23, 0x31, 0x2f, 0x3b, 0x37, 0x0b };
+// Which of the first six EAN-13 digits use the G set, by the leading digit
+static const uint8_t ean_parity[10] = {
+  0x00, 0x0b, 0x0d, 0x0e, 0x13, 0x19, 0x1c, 0x15, 0x16, 0x1a };
+
+
+ql_packed_image_t *ql_compose_create(uint16_t lines, uint16_t line_bytes, ql_arena_t arena)
+{
+  const size_t data_bytes = (size_t)lines * line_bytes;
+  ql_packed_image_t *img = ql_arena_calloc(arena,
+    sizeof(ql_packed_image_t) + data_bytes + lines);
+  if (!img)
+    return NULL;
+  img->lines = lines;
+  img->line_bytes = line_bytes;
+  img->planes = 1;
+  img->ink = img->data + data_bytes;
+  return img;
+}
+
+
+void ql_draw_fill(ql_packed_image_t *img, int x, int y, unsigned w, unsigned h)
+{
+  int x1 = x + (int)w, y1 = y + (int)h;
+  const int dots = img->line_bytes * 8;
+  if (x < 0)
+    x = 0;
+  if (y < 0)
+    y = 0;
+  if (x1 > img->lines)
+    x1 = img->lines;
+  if (y1 > dots)
+    y1 = dots;
+  if (x >= x1 || y >= y1)
+    return;
+
+  const unsigned first = y / 8, last = (y1 - 1) / 8;
+  const uint8_t head = 0xff >> (y % 8);
+  const uint8_t tail = 0xff << (7 - (y1 - 1) % 8);
+  const size_t stride = (size_t)img->planes * img->line_bytes;
+  for (int l = x; l < x1; ++l)
+  {
+    uint8_t *line = img->data + l * stride;
+    if (first == last)
+      line[first] |= head & tail;
+    else
+    {
+      line[first] |= head;
+      memset(line + first + 1, 0xff, last - first - 1);
+      line[last] |= tail;
+    }
+    if (img->ink)
+      img->ink[l] = 1;
+  }
+}
+
+
+void ql_draw_box(ql_packed_image_t *img, int x, int y, unsigned w, unsigned h, unsigned thickness)
+{
+  if (2 * thickness >= w || 2 * thickness >= h)
+  {
+    ql_draw_fill(img, x, y, w, h);
+    return;
+  }
+  ql_draw_fill(img, x, y, w, thickness);
+  ql_draw_fill(img, x, y + h - thickness, w, thickness);
+  ql_draw_fill(img, x, y + thickness, thickness, h - 2 * thickness);
+  ql_draw_fill(img, x + w - thickness, y + thickness, thickness,
+    h - 2 * thickness);
+}
+
+
+unsigned ql_text_width(const char *text, unsigned scale)
+{
+  return strlen(text) * 6 * scale;
+}
+
+
+void ql_draw_text(ql_packed_image_t *img, int x, int y, unsigned scale, const char *text)
+{
+  for (; *text; ++text, x += 6 * scale)
+  {
+    const unsigned char c = *text;
+    const uint8_t *glyph = font[(c >= ' ' && c <= '~' ? c : '?') - ' '];
+    for (unsigned col = 0; col < 5; ++col)
+    {
+      // Each run of dots down the column in one go
+      uint8_t bits = glyph[col];
+      for (unsigned row = 0; bits; )
+      {
+        if (!(bits & 1))
+        {
+          bits >>= 1;
+          ++row;
+          continue;
+        }
+        unsigned run = 0;
+        while (bits & 1)
+        {
+          bits >>= 1;
+          ++run;
+        }
+        ql_draw_fill(img, x + col * scale, y + row * scale, scale,
+          run * scale);
+        row += run;
+      }
+    }
+  }
+}
+
+
+static unsigned digits_at(const char *s)
+{
+  unsigned n = 0;
+  while (isdigit((unsigned char)s[n]))
+    ++n;
+  return n;
+}
+
+
+// Symbol values including start and check, but not stop; 0 if not possible
+static unsigned code128_encode(const char *text, uint8_t *vals)
+{
+  const size_t len = strlen(text);
+  if (!len || len > MAX_CODE128)
+    return 0;
+
+  unsigned n = 0;
+  size_t i = 0;
+  bool set_c = digits_at(text) >= 4 && digits_at(text) % 2 == 0;
+  vals[n++] = set_c ? CODE128_START_C : CODE128_START_B;
+  while (i < len)
+  {
+    if (set_c)
+    {
+      if (digits_at(text + i) >= 2)
+      {
+        vals[n++] = (text[i] - '0') * 10 + (text[i + 1] - '0');
+        i += 2;
+      }
+      else
+      {
+        vals[n++] = CODE128_CODE_B;
+        set_c = false;
+      }
+      continue;
+    }
+    unsigned d = digits_at(text + i);
+    if (d >= 4)
+    {
+      if (d % 2) // the odd one out goes in set B
+        vals[n++] = text[i++] - ' ';
+      vals[n++] = CODE128_CODE_C;
+      set_c = true;
+      continue;
+    }
+    const unsigned char c = text[i++];
+    if (c < ' ' || c > '~')
+      return 0;
+    vals[n++] = c - ' ';
+  }
+
+  unsigned sum = vals[0];
+  for (unsigned k = 1; k < n; ++k)
+    sum += k * vals[k];
+  vals[n++] = sum % 103;
+  return n;
+}
+
+
+static int draw_widths(ql_packed_image_t *img, int x, int y, unsigned module, unsigned height, const char *widths)
+{
+  for (unsigned i = 0; widths[i]; ++i)
+  {
+    const unsigned w = (widths[i] - '0') * module;
+    if (i % 2 == 0)
+      ql_draw_fill(img, x, y, w, height);
+    x += w;
+  }
+  return x;
+}
+
+
+bool ql_draw_code128(ql_packed_image_t *img, int x, int y, unsigned module, unsigned height, const char *text, unsigned *width)
+{
+  uint8_t vals[2 * MAX_CODE128 + 3];
+  const unsigned n = code128_encode(text, vals);
+  if (!n)
+  {
+    errno = EINVAL;
+    return false;
+  }
+  const int x0 = x;
+  for (unsigned i = 0; i < n; ++i)
+    x = draw_widths(img, x, y, module, height, code128[vals[i]]);
+  x = draw_widths(img, x, y, module, height, code128[CODE128_STOP]);
+  if (width)
+    *width = x - x0;
+  return true;
+}
+
+
+// Appends the low 'count' bits of pattern, MSB first, a module each
+static void put_modules(uint8_t *mods, unsigned *n, uint8_t pattern, unsigned count)
+{
+  while (count--)
+    mods[(*n)++] = (pattern >> count) & 1;
+}
+
+
+static uint8_t reverse7(uint8_t v)
+{
+  uint8_t r = 0;
+  for (unsigned b = 0; b < 7; ++b)
+    r |= ((v >> b) & 1) << (6 - b);
+  return r;
+}
+
+
+bool ql_draw_ean(ql_packed_image_t *img, int x, int y, unsigned module, unsigned height, const char *digits, unsigned *width)
+{
+  const size_t len = strlen(digits);
+  if (digits_at(digits) != len ||
+      (len != 7 && len != 8 && len != 12 && len != 13))
+  {
+    errno = EINVAL;
+    return false;
+  }
+  const unsigned total = len < 12 ? 8 : 13;
+  uint8_t d[13];
+  unsigned sum = 0;
+  for (unsigned i = 0; i < total - 1; ++i)
+  {
+    d[i] = digits[i] - '0';
+    sum += d[i] * ((total - 1 - i) % 2 ? 3 : 1);
+  }
+  d[total - 1] = (10 - sum % 10) % 10;
+  if (len == total && digits[total - 1] - '0' != d[total - 1])
+  {
+    errno = EINVAL;
+    return false;
+  }
+
+  // EAN-13 carries its first digit in the parity of the next six
+  const unsigned half = total / 2, first = total - 2 * half;
+  const uint8_t parity = total == 13 ? ean_parity[d[0]] : 0;
+  uint8_t mods[95];
+  unsigned n = 0;
+  put_modules(mods, &n, 0x5, 3);
+  for (unsigned i = 0; i < half; ++i)
+  {
+    const uint8_t l = ean_l[d[first + i]];
+    put_modules(mods, &n,
+      (parity >> (half - 1 - i)) & 1 ? reverse7(l ^ 0x7f) : l, 7);
+  }
+  put_modules(mods, &n, 0x0a, 5);
+  for (unsigned i = 0; i < half; ++i)
+    put_modules(mods, &n, ean_l[d[first + half + i]] ^ 0x7f, 7);
+  put_modules(mods, &n, 0x5, 3);
+
+  unsigned run = 0;
+  for (unsigned i = 0; i <= n; ++i)
+  {
+    if (i < n && mods[i])
+    {
+      ++run;
+      continue;
+    }
+    if (run)
+      ql_draw_fill(img, x + (i - run) * module, y, run * module, height);
+    run = 0;
+  }
+  if (width)
+    *width = n * module;
+  return true;
+}
+
+
+bool ql_draw_qr(ql_packed_image_t *img, int x, int y, unsigned module, uint8_t ecc, const char *text, ql_qr_t *work, unsigned *size)
+{
+  ql_qr_t *qr = work ? work : ql_malloc(sizeof(ql_qr_t));
+  if (!qr)
+    return false;
+  const bool ok = ql_qr_encode(qr, (const uint8_t *)text, strlen(text), ecc);
+  if (ok)
+  {
+    // Down each column of modules, a run of dark ones at a time
+    for (unsigned qx = 0; qx < qr->size; ++qx)
+      for (unsigned qy = 0; qy < qr->size; )
+      {
+        unsigned run = 0;
+        while (qy + run < qr->size && qr->modules[qy + run][qx])
+          ++run;
+        if (run)
+          ql_draw_fill(img, x + qx * module, y + qy * module, module,
+            run * module);
+        qy += run ? run : 1;
+      }
+    if (size)
+      *size = qr->size * module;
+  }
+  if (!work)
+    ql_free(qr);
+  return ok;
+}
+
+
+typedef enum { EL_TEXT, EL_CODE128, EL_EAN, EL_QR, EL_LINE, EL_BOX } kind_t;
+
+typedef struct {
+  kind_t kind;
+  int x, y;
+  unsigned arg[3]; // as they come after x and y in the template
+  const char *text; // in the template's source
+  unsigned line; // in the template, for errors
+  bool variable;
+  int from, to; // lines covered when last drawn
+} element_t;
+
+struct ql_template
+{
+  char *source; // as loaded, with the lines split
+  element_t *elements;
+  unsigned num_elements;
+  uint16_t lines;
+  ql_packed_image_t *background; // static elements only
+  ql_packed_image_t *label;
+  ql_qr_t *qr; // if there are any to draw
+  char record[MAX_TEXT];
+  char expanded[MAX_TEXT];
+};
+
+static const struct {
+  const char *name;
+  kind_t kind;
+  unsigned args; // numbers after x and y
+  bool text;
+} kinds[] = {
+  { "text",    EL_TEXT,    1, true },
+  { "code128", EL_CODE128, 2, true },
+  { "ean",     EL_EAN,     2, true },
+  { "qr",      EL_QR,      2, true }, // the level is taken as a number
+  { "line",    EL_LINE,    2, false },
+  { "box",     EL_BOX,     3, false },
+};
+
+
+void ql_template_destroy(ql_template_t tpl)
+{
+  if (!tpl)
+    return;
+  ql_free(tpl->qr);
+  ql_free(tpl->label);
+  ql_free(tpl->background);
+  ql_free(tpl->elements);
+  ql_free(tpl->source);
+  ql_free(tpl);
+}
+
+
+static bool draw_element(ql_template_t tpl, ql_packed_image_t *img, element_t *el, const char *text)
+{
+  unsigned w = 0;
+  bool ok = true;
+  switch (el->kind)
+  {
+    case EL_TEXT:
+      ql_draw_text(img, el->x, el->y, el->arg[0], text);
+      w = ql_text_width(text, el->arg[0]);
+      break;
+    case EL_CODE128:
+      ok = ql_draw_code128(img, el->x, el->y, el->arg[0], el->arg[1], text,
+        &w);
+      break;
+    case EL_EAN:
+      ok = ql_draw_ean(img, el->x, el->y, el->arg[0], el->arg[1], text, &w);
+      break;
+    case EL_QR:
+      ok = ql_draw_qr(img, el->x, el->y, el->arg[0], el->arg[1], text,
+        tpl->qr, &w);
+      break;
+    case EL_LINE:
+      ql_draw_fill(img, el->x, el->y, el->arg[0], el->arg[1]);
+      w = el->arg[0];
+      break;
+    case EL_BOX:
+      ql_draw_box(img, el->x, el->y, el->arg[0], el->arg[1], el->arg[2]);
+      w = el->arg[0];
+      break;
+  }
+  el->from = el->x < 0 ? 0 : el->x;
+  el->to = el->x + (int)w > tpl->lines ? tpl->lines : el->x + (int)w;
+  return ok;
+}
+
+
+static bool is_variable(const char *text)
+{
+  for (const char *p = strchr(text, '{'); p; p = strchr(p + 1, '{'))
+    if ((p[1] == 'n' || (p[1] >= '1' && p[1] <= '9')) && p[2] == '}')
+      return true;
+  return false;
+}
+
+
+// Parses "<int>..." off the front of *p
+static bool parse_int(char **p, int *val)
+{
+  char *end;
+  long v = strtol(*p, &end, 10);
+  if (end == *p || (*end && !isspace((unsigned char)*end)) ||
+      v < -32768 || v > 32767)
+    return false;
+  *val = v;
+  *p = end;
+  return true;
+}
+
+
+static bool parse_element(ql_template_t tpl, char *line, unsigned lineno)
+{
+  while (isspace((unsigned char)*line))
+    ++line;
+  if (!*line || *line == '#')
+    return true;
+
+  char *word = line;
+  while (*line && !isspace((unsigned char)*line))
+    ++line;
+  const size_t wlen = line - word;
+  int val;
+  if (wlen == 4 && strncmp(word, "size", 4) == 0)
+  {
+    if (!parse_int(&line, &val) || val <= 0)
+      return false;
+    tpl->lines = val;
+    return true;
+  }
+
+  for (unsigned k = 0; k < sizeof(kinds)/sizeof(kinds[0]); ++k)
+  {
+    if (strlen(kinds[k].name) != wlen || strncmp(word, kinds[k].name, wlen))
+      continue;
+    element_t *el = &tpl->elements[tpl->num_elements];
+    memset(el, 0, sizeof(*el));
+    el->kind = kinds[k].kind;
+    el->line = lineno;
+    if (!parse_int(&line, &el->x) || !parse_int(&line, &el->y))
+      return false;
+    for (unsigned a = 0; a < kinds[k].args; ++a)
+    {
+      if (el->kind == EL_QR && a == 1)
+      {
+        while (isspace((unsigned char)*line))
+          ++line;
+        const char level[2] = { *line, 0 };
+        uint8_t ecc;
+        if (!*line || !isspace((unsigned char)line[1]) ||
+            !ql_qr_ecc_by_name(level, &ecc))
+          return false;
+        el->arg[a] = ecc;
+        ++line;
+        continue;
+      }
+      if (!parse_int(&line, &val) || val <= 0)
+        return false;
+      el->arg[a] = val;
+    }
+    while (isspace((unsigned char)*line))
+      ++line;
+    if (kinds[k].text)
+    {
+      if (!*line)
+        return false;
+      el->text = line;
+      el->variable = is_variable(line);
+    }
+    else if (*line)
+      return false;
+    ++tpl->num_elements;
+    return true;
+  }
+  return false;
+}
+
+
+static ql_template_t parse(char *source, uint16_t line_bytes, unsigned *bad_line)
+{
+  ql_template_t tpl = ql_calloc(1, sizeof(struct ql_template));
+  if (!tpl)
+  {
+    ql_free(source);
+    return NULL;
+  }
+  tpl->source = source;
+
+  unsigned num_lines = 1;
+  for (const char *p = source; *p; ++p)
+    num_lines += *p == '\n';
+  tpl->elements = ql_calloc(num_lines, sizeof(element_t));
+  if (!tpl->elements)
+    goto fail;
+
+  unsigned lineno = 0;
+  *bad_line = 0;
+  for (char *line = source; line; )
+  {
+    char *next = strchr(line, '\n');
+    if (next)
+      *next++ = 0;
+    const size_t len = strlen(line);
+    if (len && line[len - 1] == '\r')
+      line[len - 1] = 0;
+    ++lineno;
+    if (!parse_element(tpl, line, lineno))
+    {
+      *bad_line = lineno;
+      errno = EINVAL;
+      goto fail;
+    }
+    line = next;
+  }
+  if (!tpl->lines)
+  {
+    errno = EINVAL;
+    goto fail;
+  }
+
+  tpl->background = ql_compose_create(tpl->lines, line_bytes, NULL);
+  tpl->label = ql_compose_create(tpl->lines, line_bytes, NULL);
+  if (!tpl->background || !tpl->label)
+    goto fail;
+  for (unsigned i = 0; i < tpl->num_elements; ++i)
+    if (tpl->elements[i].kind == EL_QR && !tpl->qr &&
+        !(tpl->qr = ql_malloc(sizeof(ql_qr_t))))
+      goto fail;
+
+  for (unsigned i = 0; i < tpl->num_elements; ++i)
+  {
+    element_t *el = &tpl->elements[i];
+    if (el->variable)
+      continue;
+    if (!draw_element(tpl, tpl->background, el, el->text))
+    {
+      *bad_line = el->line;
+      errno = EINVAL;
+      goto fail;
+    }
+  }
+  const ql_packed_image_t *bg = tpl->background;
+  memcpy(tpl->label->data, bg->data,
+    (size_t)bg->lines * bg->line_bytes + bg->lines); // ink too
+  return tpl;
+
+fail:
+  {
+    const int err = errno;
+    ql_template_destroy(tpl);
+    errno = err;
+  }
+  return NULL;
+}
+
+
+ql_template_t ql_template_parse(const char *text, uint16_t line_bytes, unsigned *bad_line)
+{
+  char *source = ql_strdup(text);
+  return source ? parse(source, line_bytes, bad_line) : NULL;
+}
+
+
+ql_template_t ql_template_load(const char *path, uint16_t line_bytes, unsigned *bad_line)
+{
+  *bad_line = 0;
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return NULL;
+  char *source = NULL;
+  long len;
+  if (fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 0 ||
+      fseek(f, 0, SEEK_SET) != 0 || !(source = ql_malloc(len + 1)) ||
+      fread(source, 1, len, f) != (size_t)len)
+  {
+    ql_free(source);
+    fclose(f);
+    return NULL;
+  }
+  fclose(f);
+  source[len] = 0;
+  return parse(source, line_bytes, bad_line);
+}
+
+
+// Fills in the fields and number; false if it doesn't fit
+static bool expand(char *out, const char *text, char *const *fields, unsigned num_fields, unsigned number)
+{
+  char *const end = out + MAX_TEXT - 1;
+  while (*text)
+  {
+    const char *sub = NULL;
+    char num[12];
+    if (text[0] == '{' && text[1] && text[2] == '}')
+    {
+      if (text[1] == 'n')
+      {
+        snprintf(num, sizeof(num), "%u", number);
+        sub = num;
+      }
+      else if (text[1] >= '1' && text[1] <= '9')
+        sub = (unsigned)(text[1] - '1') < num_fields ?
+          fields[text[1] - '1'] : "";
+    }
+    if (!sub)
+    {
+      if (out == end)
+        return false;
+      *out++ = *text++;
+      continue;
+    }
+    const size_t len = strlen(sub);
+    if (len > (size_t)(end - out))
+      return false;
+    memcpy(out, sub, len);
+    out += len;
+    text += 3;
+  }
+  *out = 0;
+  return true;
+}
+
+
+const ql_packed_image_t *ql_template_stamp(ql_template_t tpl, const char *record, unsigned number)
+{
+  if (strlen(record) >= MAX_TEXT)
+  {
+    errno = EMSGSIZE;
+    return NULL;
+  }
+  strcpy(tpl->record, record);
+  char *fields[MAX_FIELDS];
+  unsigned num_fields = 0;
+  for (char *p = tpl->record; num_fields < MAX_FIELDS; )
+  {
+    fields[num_fields++] = p;
+    if (!(p = strchr(p, ',')))
+      break;
+    *p++ = 0;
+  }
+
+  // Back to the background where the last label's data went
+  ql_packed_image_t *img = tpl->label;
+  const ql_packed_image_t *bg = tpl->background;
+  const size_t stride = img->line_bytes;
+  for (unsigned i = 0; i < tpl->num_elements; ++i)
+  {
+    const element_t *el = &tpl->elements[i];
+    if (!el->variable || el->from >= el->to)
+      continue;
+    memcpy(img->data + el->from * stride, bg->data + el->from * stride,
+      (el->to - el->from) * stride);
+    memcpy(img->ink + el->from, bg->ink + el->from, el->to - el->from);
+  }
+
+  for (unsigned i = 0; i < tpl->num_elements; ++i)
+  {
+    element_t *el = &tpl->elements[i];
+    if (!el->variable)
+      continue;
+    if (!expand(tpl->expanded, el->text, fields, num_fields, number))
+    {
+      errno = EMSGSIZE;
+      return NULL;
+    }
+    if (!draw_element(tpl, img, el, tpl->expanded))
+    {
+      const int err = errno;
+      el->from = 0; // in case it drew anything, next time restore it all
+      el->to = tpl->lines;
+      errno = err;
+      return NULL;
+    }
+  }
+  return img;
+}
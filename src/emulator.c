@@ -0,0 +1,496 @@
+/*
+ * Copyright 2017 DiUS Computing Pty Ltd. All rights reserved.
+ *
+ * Released under GPLv3, see LICENSE for details.
+ *
+ * @author Johny Mattsson <jmattsson@dius.com.au>
+ */
+#define _XOPEN_SOURCE 700 // for posix_openpt() and friends
+#include "emulator.h"
+#include "arena.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ESC 0x1b
+
+#define MAX_PENDING 64 // status replies not yet due
+#define STOP_CHECK_MS 200 // how often emulator_run() looks at *stop
+
+typedef struct {
+  uint64_t due_us;
+  uint8_t status_type, phase_type;
+  uint8_t err_info_1, err_info_2;
+} pending_t;
+
+struct emulator
+{
+  emulator_cfg_t cfg;
+  emulator_page_fn on_page;
+  void *arg;
+
+  ql_status_t status; // what every reply is based on
+  unsigned line_bytes;
+  bool compress;
+  bool two_colour; // expanded mode, lines come as 'w' black then 'w' red
+  bool page_ok; // false once the page has been refused, e.g. wrong media
+
+  ql_packed_image_t *page; // room for two planes, whether used or not
+  unsigned page_cap; // lines
+  uint8_t *black; // black plane of a two-colour line, waiting for the red
+
+  uint8_t *in; // incomplete command carried over to the next feed
+  size_t in_len, in_cap;
+
+  pending_t pending[MAX_PENDING]; // in order of due time
+  unsigned num_pending;
+  uint64_t busy_until_us; // print mechanism
+
+  emulator_stats_t stats;
+};
+
+
+static uint64_t now_us(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000ull + now.tv_nsec / 1000;
+}
+
+
+static void queue_status(emulator_t emu, uint64_t due_us, uint8_t status_type, uint8_t phase_type, uint8_t err_info_1, uint8_t err_info_2)
+{
+  if (emu->num_pending == MAX_PENDING)
+    return; // nobody's reading them
+  unsigned i = emu->num_pending++;
+  for (; i > 0 && emu->pending[i - 1].due_us > due_us; --i)
+    emu->pending[i] = emu->pending[i - 1];
+  emu->pending[i] = (pending_t){
+    due_us, status_type, phase_type, err_info_1, err_info_2 };
+}
+
+
+static void report_error(emulator_t emu, uint8_t err_info_1, uint8_t err_info_2)
+{
+  ++emu->stats.errors;
+  queue_status(emu, now_us(), QL_STATUS_TYPE_ERROR_OCCURRED,
+    QL_PHASE_TYPE_RECEIVING, err_info_1, err_info_2);
+}
+
+
+static void start_page(emulator_t emu)
+{
+  emu->page->lines = 0;
+  emu->page->planes = 0; // decided by the first line
+  emu->page_ok = true;
+}
+
+
+// Adds a raster line to the page; NULL for a blank one (or blank red plane)
+static bool add_line(emulator_t emu, const uint8_t *black, const uint8_t *red)
+{
+  ql_packed_image_t *page = emu->page;
+  if (page->lines == UINT16_MAX)
+    return false;
+  if (!page->planes)
+    page->planes = emu->two_colour ? 2 : 1;
+  if (page->lines == emu->page_cap)
+  {
+    unsigned cap = emu->page_cap * 2 > UINT16_MAX ? UINT16_MAX : emu->page_cap * 2;
+    page = ql_realloc(page, sizeof(ql_packed_image_t) + cap * 2 * emu->line_bytes);
+    if (!page)
+      return false;
+    emu->page = page;
+    emu->page_cap = cap;
+  }
+  const unsigned lb = emu->line_bytes;
+  uint8_t *out = page->data + page->lines++ * page->planes * lb;
+  const uint8_t *planes[2] = { black, red };
+  for (unsigned i = 0; i < page->planes; ++i, out += lb)
+  {
+    if (planes[i])
+      memcpy(out, planes[i], lb);
+    else
+      memset(out, 0, lb);
+  }
+  return true;
+}
+
+
+// PackBits decoding; false if the data doesn't make exactly one line
+static bool unpackbits(uint8_t *out, unsigned out_len, const uint8_t *in, unsigned len)
+{
+  unsigned o = 0, i = 0;
+  while (i < len)
+  {
+    int8_t n = in[i++];
+    if (n >= 0)
+    {
+      if (i + n + 1 > len || o + n + 1 > out_len)
+        return false;
+      memcpy(out + o, in + i, n + 1);
+      o += n + 1;
+      i += n + 1;
+    }
+    else if (n != -128)
+    {
+      if (i >= len || o + 1 - n > out_len)
+        return false;
+      memset(out + o, in[i++], 1 - n);
+      o += 1 - n;
+    }
+  }
+  return o == out_len;
+}
+
+
+// Unpacks a 'g' or 'w' block's data into line
+static bool decode_line(emulator_t emu, uint8_t *line, const uint8_t *data, unsigned len)
+{
+  if (emu->compress)
+    return unpackbits(line, emu->line_bytes, data, len);
+  if (len > emu->line_bytes)
+    return false;
+  memcpy(line, data, len);
+  memset(line + len, 0, emu->line_bytes - len);
+  return true;
+}
+
+
+// A 'g' line, or a 'w' plane; plane is 0 for 'g', 1 for black, 2 for red
+static void raster_line(emulator_t emu, uint8_t plane, const uint8_t *data, unsigned len)
+{
+  uint8_t line[emu->line_bytes];
+  if (plane > 2 || (plane && !ql_supports_two_colour(&emu->status)) ||
+      !decode_line(emu, line, data, len))
+  {
+    report_error(emu, 0, QL_ERR_2_COMMUNICATION_ERROR);
+    return;
+  }
+
+  if (plane == 1) // hold on to it until the red arrives
+  {
+    memcpy(emu->black, line, emu->line_bytes);
+    return;
+  }
+  bool ok = plane == 2 ?
+    add_line(emu, emu->black, line) : add_line(emu, line, NULL);
+  memset(emu->black, 0, emu->line_bytes);
+  if (!ok)
+    report_error(emu, 0, QL_ERR_2_EXPANSION_BUFFER_FULL);
+}
+
+
+static void print_info(emulator_t emu, const uint8_t *n)
+{
+  start_page(emu);
+  if (((n[0] & QL_PRINT_CFG_MEDIA_TYPE) && n[1] != emu->status.media_type) ||
+      ((n[0] & QL_PRINT_CFG_MEDIA_WIDTH) && n[2] != emu->status.media_width_mm) ||
+      ((n[0] & QL_PRINT_CFG_MEDIA_LENGTH) && n[3] != emu->status.media_length_mm))
+  {
+    emu->page_ok = false;
+    report_error(emu, 0, QL_ERR_2_REPLACE_MEDIA);
+  }
+}
+
+
+static void print_page(emulator_t emu)
+{
+  if (emu->page_ok)
+  {
+    ++emu->stats.pages;
+    emu->stats.lines += emu->page->lines;
+    if (emu->on_page)
+      emu->on_page(emu->page, emu->arg);
+
+    uint64_t now = now_us();
+    uint64_t start = emu->busy_until_us > now ? emu->busy_until_us : now;
+    uint64_t took = emu->cfg.print_lines_per_s ?
+      emu->page->lines * 1000000ull / emu->cfg.print_lines_per_s : 0;
+    emu->busy_until_us = start + took;
+    queue_status(emu, start,
+      QL_STATUS_TYPE_PHASE_CHANGE, QL_PHASE_TYPE_PRINTING, 0, 0);
+    queue_status(emu, emu->busy_until_us,
+      QL_STATUS_TYPE_PRINTING_DONE, QL_PHASE_TYPE_PRINTING, 0, 0);
+    queue_status(emu, emu->busy_until_us,
+      QL_STATUS_TYPE_PHASE_CHANGE, QL_PHASE_TYPE_RECEIVING, 0, 0);
+  }
+  start_page(emu);
+}
+
+
+/* Handles the command at the start of buf, returning its length, or 0 if
+ * it isn't all there yet.
+ */
+static size_t command(emulator_t emu, const uint8_t *buf, size_t len)
+{
+  #define NEED(n) if (len < (n)) return 0
+  switch (buf[0])
+  {
+    case 0x00: return 1; // clearing the print buffer
+    case ESC:
+      NEED(2);
+      if (buf[1] == '@')
+      {
+        emu->compress = false;
+        emu->two_colour = false;
+        start_page(emu);
+        return 2;
+      }
+      if (buf[1] != 'i')
+        break;
+      NEED(3);
+      switch (buf[2])
+      {
+        case 'S':
+          queue_status(emu, now_us(),
+            QL_STATUS_TYPE_REPLY, QL_PHASE_TYPE_RECEIVING, 0, 0);
+          return 3;
+        case 'z': NEED(13); print_info(emu, buf + 3); return 13;
+        case 'M': NEED(4); emu->status.mode = buf[3]; return 4;
+        case 'K':
+          NEED(4);
+          emu->two_colour = buf[3] & QL_EXPANDED_MODE_TWO_COLOUR;
+          return 4;
+        case 'A': case 'a': NEED(4); return 4;
+        case 'd': NEED(5); return 5;
+        default: break;
+      }
+      break;
+    case 'M': NEED(2); emu->compress = buf[1] == QL_COMPRESSION_PACKBITS; return 2;
+    case 'g': case 'w':
+      NEED(3);
+      NEED(3u + buf[2]);
+      raster_line(emu, buf[0] == 'w' ? buf[1] : 0, buf + 3, buf[2]);
+      return 3 + buf[2];
+    case 'Z':
+      ++emu->stats.blank_lines;
+      if (!add_line(emu, NULL, NULL))
+        report_error(emu, 0, QL_ERR_2_EXPANSION_BUFFER_FULL);
+      return 1;
+    case 0x0c: case 0x1a: print_page(emu); return 1;
+    default: break;
+  }
+  #undef NEED
+  report_error(emu, 0, QL_ERR_2_COMMUNICATION_ERROR);
+  return 1; // skip it, and hope to get back in sync
+}
+
+
+emulator_t emulator_create(const emulator_cfg_t *cfg, emulator_page_fn on_page, void *arg)
+{
+  emulator_t emu = ql_calloc(1, sizeof(struct emulator));
+  if (!emu)
+    return NULL;
+  emu->cfg = *cfg;
+  emu->on_page = on_page;
+  emu->arg = arg;
+  ql_emulated_status(&emu->status, cfg->model_code, cfg->media_type,
+    cfg->media_width_mm, cfg->media_length_mm);
+  emu->line_bytes = ql_raster_line_bytes(&emu->status);
+
+  emu->page_cap = 1024;
+  emu->page =
+    ql_malloc(sizeof(ql_packed_image_t) + emu->page_cap * 2 * emu->line_bytes);
+  emu->black = ql_calloc(1, emu->line_bytes);
+  if (!emu->page || !emu->black)
+  {
+    ql_free(emu->page);
+    ql_free(emu->black);
+    ql_free(emu);
+    return NULL;
+  }
+  emu->page->line_bytes = emu->line_bytes;
+  emu->page->ink = NULL;
+  start_page(emu);
+  return emu;
+}
+
+
+void emulator_destroy(emulator_t emu)
+{
+  if (!emu)
+    return;
+  ql_free(emu->in);
+  ql_free(emu->black);
+  ql_free(emu->page);
+  ql_free(emu);
+}
+
+
+bool emulator_feed(emulator_t emu, const uint8_t *buf, size_t len)
+{
+  emu->stats.bytes += len;
+  const uint8_t *p = buf;
+  if (emu->in_len) // finish off what we had first
+  {
+    if (emu->in_len + len > emu->in_cap)
+    {
+      size_t cap = emu->in_len + len;
+      uint8_t *in = ql_realloc(emu->in, cap);
+      if (!in)
+        return false;
+      emu->in = in;
+      emu->in_cap = cap;
+    }
+    memcpy(emu->in + emu->in_len, buf, len);
+    p = emu->in;
+    len += emu->in_len;
+  }
+
+  size_t n;
+  while (len && (n = command(emu, p, len)) != 0)
+  {
+    p += n;
+    len -= n;
+  }
+
+  // Hang on to an incomplete command until the rest of it turns up
+  if (len > emu->in_cap)
+  {
+    uint8_t *in = ql_realloc(emu->in, len);
+    if (!in)
+      return false;
+    emu->in = in;
+    emu->in_cap = len;
+  }
+  if (len)
+    memmove(emu->in, p, len);
+  emu->in_len = len;
+  return true;
+}
+
+
+bool emulator_next_status(emulator_t emu, ql_status_t *status, int *wait_ms)
+{
+  if (!emu->num_pending)
+  {
+    *wait_ms = -1;
+    return false;
+  }
+
+  const pending_t *next = &emu->pending[0];
+  uint64_t now = now_us();
+  if (next->due_us > now)
+  {
+    *wait_ms = (next->due_us - now + 999) / 1000;
+    return false;
+  }
+
+  *status = emu->status;
+  status->status_type = next->status_type;
+  status->phase_type = next->phase_type;
+  status->err_info_1 = next->err_info_1;
+  status->err_info_2 = next->err_info_2;
+  memmove(emu->pending, emu->pending + 1, --emu->num_pending * sizeof(pending_t));
+  return true;
+}
+
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+  while (len)
+  {
+    ssize_t n = write(fd, buf, len);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+      continue;
+    if (n == -1)
+      return false;
+    buf = (const uint8_t *)buf + n;
+    len -= n;
+  }
+  return true;
+}
+
+
+bool emulator_run(emulator_t emu, int in_fd, int out_fd, volatile bool *stop)
+{
+  uint8_t buf[4096];
+  uint64_t link_free_us = 0; // when the link can take more
+  const uint32_t rate = emu->cfg.link_bytes_per_s;
+  while (!stop || !*stop)
+  {
+    int timeout;
+    ql_status_t status;
+    while (emulator_next_status(emu, &status, &timeout))
+      if (!write_all(out_fd, &status, sizeof(status)))
+        return false;
+
+    uint64_t now = now_us();
+    bool can_read = now >= link_free_us;
+    if (!can_read)
+    {
+      int link_ms = (link_free_us - now + 999) / 1000;
+      if (timeout < 0 || link_ms < timeout)
+        timeout = link_ms;
+    }
+    if (stop && (timeout < 0 || timeout > STOP_CHECK_MS))
+      timeout = STOP_CHECK_MS;
+
+    struct pollfd pfd = { .fd = in_fd, .events = can_read ? POLLIN : 0 };
+    int ret = poll(&pfd, 1, timeout);
+    if (ret == -1 && errno == EINTR)
+      continue;
+    if (ret == -1)
+      return false;
+
+    if (pfd.revents & POLLIN)
+    {
+      size_t want = sizeof(buf);
+      if (rate && rate / 200 < want) // about 5ms worth at a time
+        want = rate / 200 ? rate / 200 : 1;
+      ssize_t n = read(in_fd, buf, want);
+      if (n == -1 && (errno == EAGAIN || errno == EINTR))
+        continue;
+      if (n == 0 || (n == -1 && errno == EIO)) // EIO: pty hung up
+        return true;
+      if (n == -1 || !emulator_feed(emu, buf, n))
+        return false;
+      if (rate)
+        link_free_us = (link_free_us > now ? link_free_us : now) +
+          n * 1000000ull / rate;
+    }
+    else if (can_read && (pfd.revents & (POLLHUP | POLLERR)))
+      return true;
+  }
+  return true;
+}
+
+
+const emulator_stats_t *emulator_stats(emulator_t emu)
+{
+  return &emu->stats;
+}
+
+
+bool emulator_open_pty(int *master, int *slave, const char **port)
+{
+  *master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (*master < 0)
+    return false;
+  if (grantpt(*master) != 0 || unlockpt(*master) != 0 ||
+      !(*port = ptsname(*master)))
+    goto close_out;
+
+  *slave = open(*port, O_RDWR | O_NOCTTY);
+  if (*slave < 0)
+    goto close_out;
+  struct termios tio;
+  if (tcgetattr(*slave, &tio) != 0)
+    goto close_both_out;
+  cfmakeraw(&tio); // the command stream is binary
+  if (tcsetattr(*slave, TCSANOW, &tio) != 0)
+    goto close_both_out;
+  return true;
+
+close_both_out:
+  close(*slave);
+close_out:
+  close(*master);
+  return false;
+}
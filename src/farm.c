@@ -0,0 +1,328 @@
+/*
+ * Copyright 2017 DiUS Computing Pty Ltd. All rights reserved.
+ *
+ * Released under GPLv3, see LICENSE for details.
+ *
+ * @author Johny Mattsson <jmattsson@dius.com.au>
+ */
+#include "farm.h"
+#include "arena.h"
+#include "loadimg.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct job
+{
+  char *path;
+  ql_print_cfg_t cfg;
+  struct job *next;
+} job_t;
+
+typedef struct
+{
+  struct farm *farm;
+  const char *name;
+  ql_ctx_t ctx;
+  ql_status_t status; // only touched by the worker
+  ql_arena_t arena; // the worker's, for the label being printed (or NULL)
+  ql_status_t media; // snapshot of status for routing, guarded by farm lock
+  bool in_rotation;
+  bool started;
+  pthread_t thread;
+} printer_t;
+
+struct farm
+{
+  pthread_mutex_t lock;
+  pthread_cond_t changed; // queue, printer or completion state changed
+  job_t *head, *tail;
+  unsigned pending; // queued or being printed
+  unsigned failed;
+  bool stopping;
+  unsigned timeout;
+  unsigned num_printers;
+  printer_t printers[];
+};
+
+
+static uint8_t base_media_type(uint8_t type)
+{
+  switch(type)
+  {
+    case QL_MEDIA_TYPE_CONTINUOUS_ALT: return QL_MEDIA_TYPE_CONTINUOUS;
+    case QL_MEDIA_TYPE_DIECUT_LABELS_ALT: return QL_MEDIA_TYPE_DIECUT_LABELS;
+    default: return type;
+  }
+}
+
+
+static bool media_matches(const ql_status_t *status, const ql_print_cfg_t *cfg)
+{
+  if ((cfg->flags & QL_PRINT_CFG_MEDIA_TYPE) &&
+      base_media_type(status->media_type) != base_media_type(cfg->media_type))
+    return false;
+  if ((cfg->flags & QL_PRINT_CFG_MEDIA_WIDTH) &&
+      status->media_width_mm != cfg->media_width)
+    return false;
+  if ((cfg->flags & QL_PRINT_CFG_MEDIA_LENGTH) &&
+      status->media_length_mm != cfg->media_length)
+    return false;
+  return true;
+}
+
+
+// Unlinks and returns the oldest job p can print; lock must be held
+static job_t *take_job(struct farm *farm, const printer_t *p)
+{
+  for (job_t **jp = &farm->head, *prev = NULL; *jp; prev = *jp, jp = &(*jp)->next)
+  {
+    job_t *job = *jp;
+    if (!media_matches(&p->media, &job->cfg))
+      continue;
+    *jp = job->next;
+    if (farm->tail == job)
+      farm->tail = prev;
+    job->next = NULL;
+    return job;
+  }
+  return NULL;
+}
+
+
+static void queue_job(struct farm *farm, job_t *job)
+{
+  job->next = NULL;
+  if (farm->tail)
+    farm->tail->next = job;
+  else
+    farm->head = job;
+  farm->tail = job;
+}
+
+
+static void free_job(job_t *job)
+{
+  ql_free(job->path);
+  ql_free(job);
+}
+
+
+typedef enum { PRINTED, BAD_JOB, BAD_PRINTER } outcome_t;
+
+// Called without the lock held; err is only set on failure
+static outcome_t print_job(printer_t *p, const job_t *job, uint16_t *w, uint16_t *h, char *err, size_t errlen)
+{
+  ql_pack_opts_t opts;
+  ql_pack_opts(&opts, &job->cfg, &p->status);
+  if (p->arena)
+    ql_arena_reset(p->arena);
+  ql_packed_image_t *img = loadimg_packed(job->path,
+    ql_raster_line_bytes(&p->status), &opts, p->arena, w, h);
+  if (!img)
+  {
+    snprintf(err, errlen, "%s", *w ? "too large for printer" : "failed to load");
+    return BAD_JOB;
+  }
+
+  ql_print_cfg_t cfg = job->cfg;
+  cfg.first_page = true;
+  outcome_t ret = PRINTED;
+  if (!ql_print_packed_image(p->ctx, &p->status, img, &cfg))
+  {
+    snprintf(err, errlen, "%s", strerror(errno));
+    ret = BAD_PRINTER;
+  }
+  else do {
+    if (!ql_wait_status(p->ctx, &p->status, p->farm->timeout))
+    {
+      snprintf(err, errlen, "printer stopped responding");
+      ret = BAD_PRINTER;
+    }
+    else if (p->status.err_info_1 || p->status.err_info_2)
+    {
+      snprintf(err, errlen, "%s", ql_decode_errors(&p->status));
+      ret = BAD_PRINTER;
+    }
+  } while (ret == PRINTED &&
+           p->status.status_type != QL_STATUS_TYPE_PRINTING_DONE);
+
+  ql_arena_free(p->arena, img);
+  return ret;
+}
+
+
+static void *worker(void *arg)
+{
+  printer_t *p = arg;
+  struct farm *farm = p->farm;
+  p->arena = ql_arena_create(); // or make do with the heap
+
+  pthread_mutex_lock(&farm->lock);
+  while (!farm->stopping)
+  {
+    job_t *job = take_job(farm, p);
+    if (!job)
+    {
+      pthread_cond_wait(&farm->changed, &farm->lock);
+      continue;
+    }
+    pthread_mutex_unlock(&farm->lock);
+
+    uint16_t w = 0, h = 0;
+    char err[128];
+    outcome_t outcome = print_job(p, job, &w, &h, err, sizeof(err));
+
+    pthread_mutex_lock(&farm->lock);
+    p->media = p->status;
+    switch(outcome)
+    {
+      case PRINTED:
+        printf("%s (%ux%u) OK on %s\n", job->path, w, h, p->name);
+        fflush(stdout);
+        --farm->pending;
+        free_job(job);
+        break;
+      case BAD_JOB:
+        fprintf(stderr, "Failed to print '%s': %s\n", job->path, err);
+        --farm->pending;
+        ++farm->failed;
+        free_job(job);
+        break;
+      case BAD_PRINTER:
+        fprintf(stderr, "Printer %s failed (%s), taking it out of rotation\n",
+          p->name, err);
+        queue_job(farm, job); // let another printer have a go
+        p->in_rotation = false;
+        break;
+    }
+    pthread_cond_broadcast(&farm->changed);
+    if (!p->in_rotation)
+      break;
+  }
+  pthread_mutex_unlock(&farm->lock);
+  ql_arena_destroy(p->arena);
+  p->arena = NULL;
+  return NULL;
+}
+
+
+farm_t farm_start(char *const printers[], unsigned num_printers, unsigned timeout, farm_open_fn open, void *open_arg)
+{
+  struct farm *farm =
+    ql_calloc(1, sizeof(struct farm) + num_printers * sizeof(printer_t));
+  if (!farm)
+    return NULL;
+  pthread_mutex_init(&farm->lock, NULL);
+  pthread_cond_init(&farm->changed, NULL);
+  farm->timeout = timeout;
+  farm->num_printers = num_printers;
+
+  unsigned running = 0;
+  for (unsigned i = 0; i < num_printers; ++i)
+  {
+    printer_t *p = &farm->printers[i];
+    p->farm = farm;
+    p->name = printers[i];
+    p->ctx = open(printers[i], &p->status, open_arg);
+    if (!p->ctx)
+    {
+      fprintf(stderr, "Leaving %s out of rotation\n", p->name);
+      continue;
+    }
+    p->media = p->status;
+    p->in_rotation = true;
+    p->started = pthread_create(&p->thread, NULL, worker, p) == 0;
+    if (p->started)
+      ++running;
+    else
+      p->in_rotation = false;
+  }
+
+  if (!running)
+  {
+    (void)farm_finish(farm);
+    return NULL;
+  }
+  return farm;
+}
+
+
+bool farm_submit(farm_t farm, const char *path, const ql_print_cfg_t *cfg)
+{
+  job_t *job = ql_calloc(1, sizeof(job_t));
+  if (!job || !(job->path = ql_strdup(path)))
+  {
+    ql_free(job);
+    return false;
+  }
+  job->cfg = *cfg;
+
+  pthread_mutex_lock(&farm->lock);
+  queue_job(farm, job);
+  ++farm->pending;
+  pthread_cond_broadcast(&farm->changed);
+  pthread_mutex_unlock(&farm->lock);
+  return true;
+}
+
+
+// Fails queued jobs which no printer left in rotation can take; lock held
+static void fail_orphans(struct farm *farm)
+{
+  for (job_t **jp = &farm->head, *prev = NULL; *jp; )
+  {
+    job_t *job = *jp;
+    bool takeable = false;
+    for (unsigned i = 0; i < farm->num_printers && !takeable; ++i)
+      takeable = farm->printers[i].in_rotation &&
+        media_matches(&farm->printers[i].media, &job->cfg);
+    if (takeable)
+    {
+      prev = job;
+      jp = &job->next;
+      continue;
+    }
+    fprintf(stderr, "Failed to print '%s': no suitable printer available\n",
+      job->path);
+    *jp = job->next;
+    if (farm->tail == job)
+      farm->tail = prev;
+    free_job(job);
+    --farm->pending;
+    ++farm->failed;
+  }
+}
+
+
+int farm_finish(farm_t farm)
+{
+  pthread_mutex_lock(&farm->lock);
+  for (;;)
+  {
+    fail_orphans(farm);
+    if (!farm->pending)
+      break;
+    pthread_cond_wait(&farm->changed, &farm->lock);
+  }
+  farm->stopping = true;
+  pthread_cond_broadcast(&farm->changed);
+  pthread_mutex_unlock(&farm->lock);
+
+  for (unsigned i = 0; i < farm->num_printers; ++i)
+  {
+    printer_t *p = &farm->printers[i];
+    if (p->started)
+      pthread_join(p->thread, NULL);
+    if (p->ctx)
+      ql_close(p->ctx);
+  }
+
+  int ret = farm->failed ? EXIT_FAILURE : EXIT_SUCCESS;
+  pthread_cond_destroy(&farm->changed);
+  pthread_mutex_destroy(&farm->lock);
+  ql_free(farm);
+  return ret;
+}
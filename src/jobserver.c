@@ -0,0 +1,399 @@
+/*
+ * Copyright 2017 DiUS Computing Pty Ltd. All rights reserved.
+ *
+ * Released under GPLv3, see LICENSE for details.
+ *
+ * @author Johny Mattsson <jmattsson@dius.com.au>
+ */
+#include "jobserver.h"
+#include "arena.h"
+#include "loadimg.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define CLIENT_IO_TIMEOUT 30 // seconds, so a stuck client can't hold us up
+
+static bool read_full(int fd, void *buf, size_t len)
+{
+  size_t got = 0;
+  while (got != len)
+  {
+    ssize_t n = read(fd, (char *)buf + got, len - got);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    got += n;
+  }
+  return true;
+}
+
+
+static bool write_full(int fd, const void *buf, size_t len)
+{
+  size_t done = 0;
+  while (done != len)
+  {
+    ssize_t n = write(fd, (const char *)buf + done, len - done);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    done += n;
+  }
+  return true;
+}
+
+
+static bool make_sockaddr(struct sockaddr_un *addr, const char *path)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path))
+  {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  strcpy(addr->sun_path, path);
+  return true;
+}
+
+
+const char *jobserver_default_socket(void)
+{
+  static char path[256]; // too long for a socket is caught on binding
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  snprintf(path, sizeof(path), "%s/" JOBSERVER_SOCKET_NAME,
+    dir && *dir ? dir : "/run");
+  return path;
+}
+
+
+// Whether a server is listening there; if not, errno says why not
+static bool socket_in_use(const struct sockaddr_un *addr)
+{
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0)
+    return false;
+  bool live = connect(sock, (const struct sockaddr *)addr, sizeof(*addr)) == 0;
+  int err = errno;
+  close(sock);
+  errno = err;
+  return live;
+}
+
+
+// One reply line, as formatted; cut short if it doesn't fit
+static void reply(int fd, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void reply(int fd, const char *fmt, ...)
+{
+  char line[256];
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(line, sizeof(line), fmt, args);
+  va_end(args);
+  if (len < 0)
+    return;
+  if (len > (int)sizeof(line) - 1)
+    len = sizeof(line) - 1;
+  (void)write_full(fd, line, len);
+}
+
+
+static void job_cfg(ql_print_cfg_t *cfg, const jobserver_job_t *job)
+{
+  *cfg = (ql_print_cfg_t){
+    .threshold = job->threshold,
+    .flags = job->flags,
+    .media_type = job->media_type,
+    .media_width = job->media_width,
+    .media_length = job->media_length,
+    .compress = job->compress,
+    .dither = job->dither,
+    .two_colour = job->two_colour,
+    .rotate = job->rotate,
+    .fit = job->fit,
+  };
+}
+
+
+// Prints all copies of one job, stop-and-wait; false on printer error
+static bool print_job(ql_ctx_t ctx, ql_status_t *status, const ql_packed_image_t *img, const jobserver_job_t *job, ql_print_cfg_t cfg, unsigned timeout, const char **err)
+{
+  for (unsigned copy = 0; copy < job->copies; ++copy)
+  {
+    cfg.first_page = (copy == 0);
+    if (!ql_print_packed_image(ctx, status, img, &cfg))
+    {
+      *err = strerror(errno);
+      return false;
+    }
+    do {
+      if (!ql_wait_status(ctx, status, timeout))
+      {
+        *err = "printer stopped responding";
+        return false;
+      }
+      if (status->err_info_1 || status->err_info_2)
+      {
+        *err = ql_decode_errors(status);
+        return false;
+      }
+    } while (status->status_type != QL_STATUS_TYPE_PRINTING_DONE);
+  }
+  return true;
+}
+
+
+/* Serves jobs on one connection until the client hangs up. Each job's
+ * image and everything made from it lives in the arena until the next job,
+ * so once the largest label has been through, jobs don't allocate.
+ */
+static bool serve_client(int fd, ql_ctx_t ctx, ql_status_t *status, ql_arena_t arena, unsigned timeout, jobserver_reset_fn reset, void *reset_arg)
+{
+  jobserver_job_t job;
+  while (read_full(fd, &job, sizeof(job)))
+  {
+    if (job.magic != JOBSERVER_JOB_MAGIC || !job.copies ||
+        !job.image_bytes || job.image_bytes > JOBSERVER_MAX_IMAGE_BYTES ||
+        job.dither > QL_DITHER_ATKINSON || job.rotate > QL_ROTATE_AUTO)
+    {
+      reply(fd, "ERR bad job header\n");
+      return true; // can't resync the stream, drop the client
+    }
+
+    ql_arena_reset(arena);
+    uint8_t *data = ql_arena_alloc(arena, job.image_bytes);
+    if (!data || !read_full(fd, data, job.image_bytes))
+      return true;
+
+    ql_print_cfg_t cfg;
+    ql_pack_opts_t opts;
+    job_cfg(&cfg, &job);
+    ql_pack_opts(&opts, &cfg, status);
+    const char *err = NULL;
+    if (job.two_colour && !ql_supports_two_colour(status))
+      err = "printer can't print two-colour";
+    else if (job.fit && !opts.fit_dots)
+      err = "can't fit to media of unknown width";
+
+    uint16_t width = 0, height = 0;
+    ql_packed_image_t *img = err ? NULL :
+      loadimg_packed_mem(data, job.image_bytes, ql_raster_line_bytes(status),
+        &opts, arena, &width, &height);
+
+    if (err)
+      reply(fd, "ERR %s\n", err);
+    else if (!width)
+      reply(fd, "ERR failed to load image\n");
+    else if (!img)
+      reply(fd, "ERR image (%ux%u) too large for printer\n", width, height);
+    else if (!print_job(ctx, status, img, &job, cfg, timeout, &err))
+    {
+      reply(fd, "ERR %s\n", err);
+      fprintf(stderr, "Print failed (%s), resetting printer\n", err);
+      if (!reset(ctx, status, reset_arg))
+        return false;
+      continue;
+    }
+    else
+      reply(fd, "OK %ux%u\n", width, height);
+  }
+  return true;
+}
+
+
+int jobserver_run(ql_ctx_t ctx, ql_status_t *status, const char *socket_path, unsigned timeout, jobserver_reset_fn reset, void *reset_arg)
+{
+  struct sockaddr_un addr;
+  if (!make_sockaddr(&addr, socket_path))
+  {
+    fprintf(stderr, "Bad socket path '%s': %s\n", socket_path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0)
+  {
+    fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+  // Only a socket nobody answers on is left from a previous run
+  struct stat st;
+  if (socket_in_use(&addr))
+  {
+    fprintf(stderr, "A print server is already running on '%s'\n",
+      socket_path);
+    close(sock);
+    return EXIT_FAILURE;
+  }
+  if (errno == ECONNREFUSED && lstat(socket_path, &st) == 0 &&
+      S_ISSOCK(st.st_mode))
+    unlink(socket_path);
+
+  // Jobs carry label contents, so only this user may connect
+  const mode_t mask = umask(0077);
+  bool bound = bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+  umask(mask);
+  if (!bound || listen(sock, 16) != 0)
+  {
+    fprintf(stderr, "Failed to listen on '%s': %s\n",
+      socket_path, strerror(errno));
+    close(sock);
+    return EXIT_FAILURE;
+  }
+
+  ql_arena_t arena = ql_arena_create();
+  if (!arena)
+  {
+    fprintf(stderr, "Out of memory!\n");
+    close(sock);
+    return EXIT_FAILURE;
+  }
+
+  signal(SIGPIPE, SIG_IGN); // clients hanging up early must not kill us
+
+  const struct timeval tv = { .tv_sec = CLIENT_IO_TIMEOUT };
+  int ret = EXIT_SUCCESS;
+  for (;;)
+  {
+    int fd = accept(sock, NULL, NULL);
+    if (fd < 0)
+    {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      fprintf(stderr, "Failed to accept client: %s\n", strerror(errno));
+      ret = EXIT_FAILURE;
+      break;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    bool ok = serve_client(fd, ctx, status, arena, timeout, reset, reset_arg);
+    close(fd);
+    if (!ok)
+    {
+      fprintf(stderr, "Unable to recover printer, exiting\n");
+      ret = EXIT_FAILURE;
+      break;
+    }
+  }
+
+  ql_arena_destroy(arena);
+  close(sock);
+  unlink(socket_path);
+  return ret;
+}
+
+
+static uint8_t *read_file(const char *path, size_t *len)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return NULL;
+  uint8_t *buf = NULL;
+  if (fseek(f, 0, SEEK_END) == 0)
+  {
+    long size = ftell(f);
+    if (size >= 0 && (unsigned long)size <= JOBSERVER_MAX_IMAGE_BYTES &&
+        fseek(f, 0, SEEK_SET) == 0)
+    {
+      buf = ql_malloc(size ? size : 1);
+      if (buf && fread(buf, 1, size, f) != (size_t)size)
+      {
+        ql_free(buf);
+        buf = NULL;
+      }
+      *len = size;
+    }
+  }
+  fclose(f);
+  return buf;
+}
+
+
+int jobserver_submit(const char *socket_path, const ql_print_cfg_t *cfg, unsigned copies, char *const files[], int num_files)
+{
+  if (copies < 1 || copies > UINT16_MAX) // as the job header carries it
+  {
+    fprintf(stderr, "Can't send %u copies, the print server takes 1-%u\n",
+      copies, UINT16_MAX);
+    return EXIT_FAILURE;
+  }
+
+  struct sockaddr_un addr;
+  int sock = -1;
+  if (make_sockaddr(&addr, socket_path))
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+  {
+    fprintf(stderr, "Unable to connect to '%s': %s\n",
+      socket_path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  FILE *replies = fdopen(dup(sock), "r");
+  if (!replies)
+  {
+    fprintf(stderr, "Out of memory!\n");
+    return EXIT_FAILURE;
+  }
+
+  int ret = EXIT_SUCCESS;
+  for (int i = 0; i < num_files && ret == EXIT_SUCCESS; ++i)
+  {
+    size_t len = 0;
+    uint8_t *data = read_file(files[i], &len);
+    if (!data)
+    {
+      fprintf(stderr, "Failed to load image '%s'\n", files[i]);
+      ret = EXIT_FAILURE;
+      break;
+    }
+
+    jobserver_job_t job = {
+      .magic = JOBSERVER_JOB_MAGIC,
+      .image_bytes = len,
+      .copies = copies,
+      .threshold = cfg->threshold,
+      .flags = cfg->flags,
+      .media_type = cfg->media_type,
+      .media_width = cfg->media_width,
+      .media_length = cfg->media_length,
+      .compress = cfg->compress,
+      .dither = cfg->dither,
+      .two_colour = cfg->two_colour,
+      .rotate = cfg->rotate,
+      .fit = cfg->fit,
+    };
+    bool sent = write_full(sock, &job, sizeof(job)) &&
+      write_full(sock, data, len);
+    ql_free(data);
+
+    char line[256];
+    if (!sent || !fgets(line, sizeof(line), replies))
+    {
+      fprintf(stderr, "Lost connection to print server\n");
+      ret = EXIT_FAILURE;
+    }
+    else if (strncmp(line, "OK ", 3) == 0)
+      printf("%s (%.*s) OK\n", files[i], (int)strcspn(line + 3, "\n"), line + 3);
+    else
+    {
+      fprintf(stderr, "Failed to print '%s': %s", files[i],
+        strncmp(line, "ERR ", 4) == 0 ? line + 4 : line);
+      ret = EXIT_FAILURE;
+    }
+  }
+
+  fclose(replies);
+  close(sock);
+  return ret;
+}
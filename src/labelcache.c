@@ -0,0 +1,192 @@
+/*
+ * Copyright 2017 DiUS Computing Pty Ltd. All rights reserved.
+ *
+ * Released under GPLv3, see LICENSE for details.
+ *
+ * @author Johny Mattsson <jmattsson@dius.com.au>
+ */
+#include "labelcache.h"
+#include "arena.h"
+#include "loadimg.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+typedef struct {
+  char *path;
+  struct timespec mtime;
+  off_t size;
+  uint16_t line_bytes;
+  ql_pack_opts_t opts;
+  label_cache_entry_t label;
+  unsigned held;
+  bool loading;
+} slot_t;
+
+struct label_cache
+{
+  pthread_mutex_t lock;
+  pthread_cond_t loaded; // a slot finished loading
+  slot_t *slots;
+  unsigned num_slots;
+  unsigned next_victim; // round-robin replacement
+  unsigned hits, misses;
+};
+
+
+label_cache_t label_cache_create(unsigned max_entries)
+{
+  if (!max_entries)
+    max_entries = 1;
+  label_cache_t cache = ql_calloc(1, sizeof(struct label_cache));
+  if (!cache)
+    return NULL;
+  cache->slots = ql_calloc(max_entries, sizeof(slot_t));
+  if (!cache->slots)
+  {
+    ql_free(cache);
+    return NULL;
+  }
+  cache->num_slots = max_entries;
+  pthread_mutex_init(&cache->lock, NULL);
+  pthread_cond_init(&cache->loaded, NULL);
+  return cache;
+}
+
+
+static void clear_slot(slot_t *slot)
+{
+  ql_free(slot->path);
+  ql_free((void *)slot->label.packed);
+  memset(slot, 0, sizeof(*slot));
+}
+
+
+void label_cache_destroy(label_cache_t cache)
+{
+  for (unsigned i = 0; i < cache->num_slots; ++i)
+    clear_slot(&cache->slots[i]);
+  pthread_cond_destroy(&cache->loaded);
+  pthread_mutex_destroy(&cache->lock);
+  ql_free(cache->slots);
+  ql_free(cache);
+}
+
+
+static bool same_opts(const ql_pack_opts_t *a, const ql_pack_opts_t *b)
+{
+  return a->threshold == b->threshold && a->dither == b->dither &&
+    a->two_colour == b->two_colour && a->rotate == b->rotate &&
+    a->fit_dots == b->fit_dots;
+}
+
+
+// Lock must be held
+static slot_t *find_slot(label_cache_t cache, const char *path, const struct stat *st, uint16_t line_bytes, const ql_pack_opts_t *opts)
+{
+  for (unsigned i = 0; i < cache->num_slots; ++i)
+  {
+    slot_t *slot = &cache->slots[i];
+    if (slot->path && strcmp(slot->path, path) == 0 &&
+        slot->mtime.tv_sec == st->st_mtim.tv_sec &&
+        slot->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+        slot->size == st->st_size &&
+        slot->line_bytes == line_bytes && same_opts(&slot->opts, opts))
+      return slot;
+  }
+  return NULL;
+}
+
+
+// Lock must be held; round-robin over the slots not in use
+static slot_t *victim_slot(label_cache_t cache)
+{
+  for (unsigned n = 0; n < cache->num_slots; ++n)
+  {
+    slot_t *slot = &cache->slots[cache->next_victim];
+    cache->next_victim = (cache->next_victim + 1) % cache->num_slots;
+    if (!slot->held && !slot->loading)
+      return slot;
+  }
+  return NULL;
+}
+
+
+const label_cache_entry_t *label_cache_get(label_cache_t cache, const char *path, uint16_t line_bytes, const ql_pack_opts_t *opts)
+{
+  struct stat st;
+  if (stat(path, &st) != 0)
+    return NULL;
+
+  pthread_mutex_lock(&cache->lock);
+  slot_t *slot;
+  while ((slot = find_slot(cache, path, &st, line_bytes, opts)) && slot->loading)
+    pthread_cond_wait(&cache->loaded, &cache->lock);
+  if (slot)
+  {
+    ++cache->hits;
+    ++slot->held;
+    pthread_mutex_unlock(&cache->lock);
+    return &slot->label;
+  }
+
+  ++cache->misses;
+  slot = victim_slot(cache);
+  char *copy = slot ? ql_strdup(path) : NULL;
+  if (!copy)
+  {
+    if (!slot)
+      errno = EBUSY;
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+  }
+  clear_slot(slot);
+  slot->path = copy;
+  slot->mtime = st.st_mtim;
+  slot->size = st.st_size;
+  slot->line_bytes = line_bytes;
+  slot->opts = *opts;
+  slot->loading = true;
+  pthread_mutex_unlock(&cache->lock);
+
+  // Loaded without the lock, so others can load (or find) other labels
+  label_cache_entry_t label;
+  label.packed = loadimg_packed(path, line_bytes, opts, NULL,
+    &label.width, &label.height);
+
+  pthread_mutex_lock(&cache->lock);
+  if (label.width)
+  {
+    slot->label = label;
+    slot->loading = false;
+    slot->held = 1;
+  }
+  else
+    clear_slot(slot);
+  pthread_cond_broadcast(&cache->loaded);
+  pthread_mutex_unlock(&cache->lock);
+  return label.width ? &slot->label : NULL;
+}
+
+
+void label_cache_put(label_cache_t cache, const label_cache_entry_t *entry)
+{
+  if (!entry)
+    return;
+  pthread_mutex_lock(&cache->lock);
+  for (unsigned i = 0; i < cache->num_slots; ++i)
+    if (&cache->slots[i].label == entry && cache->slots[i].held)
+      --cache->slots[i].held;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+
+void label_cache_stats(label_cache_t cache, unsigned *hits, unsigned *misses)
+{
+  pthread_mutex_lock(&cache->lock);
+  *hits = cache->hits;
+  *misses = cache->misses;
+  pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,296 @@
+/*
+ * Copyright 2017 DiUS Computing Pty Ltd. All rights reserved.
+ *
+ * Released under GPLv3, see LICENSE for details.
+ *
+ * @author Johny Mattsson <jmattsson@dius.com.au>
+ */
+#include "loadimg.h"
+#include "loadpng.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define QLPR_MAGIC "QLPR"
+#define QLPR_HEADER_LEN 16
+
+static const uint8_t png_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+
+static bool pnm_space(uint8_t c)
+{
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+
+// Skips whitespace and comments, then reads a decimal number up to max
+static bool pnm_number(const uint8_t *data, size_t len, size_t *pos, unsigned max, unsigned *val)
+{
+  size_t i = *pos;
+  for (;;)
+  {
+    if (i >= len)
+      return false;
+    if (data[i] == '#')
+      while (i < len && data[i] != '\n' && data[i] != '\r')
+        ++i;
+    else if (pnm_space(data[i]))
+      ++i;
+    else
+      break;
+  }
+  if (data[i] < '0' || data[i] > '9')
+    return false;
+  unsigned v = 0;
+  for (; i < len && data[i] >= '0' && data[i] <= '9'; ++i)
+  {
+    v = v * 10 + data[i] - '0';
+    if (v > max)
+      return false;
+  }
+  *pos = i;
+  *val = v;
+  return true;
+}
+
+
+typedef struct {
+  unsigned width, height;
+  unsigned maxval; // 1 for PBM
+  size_t row_bytes;
+  const uint8_t *rows;
+} pnm_t;
+
+// Header of a binary PBM or PGM, and that all its rows are there
+static bool pnm_header(const uint8_t *data, size_t len, pnm_t *pnm)
+{
+  const bool pgm = data[1] == '5';
+  size_t pos = 2;
+  pnm->maxval = 1;
+  if (!pnm_number(data, len, &pos, UINT16_MAX, &pnm->width) ||
+      !pnm_number(data, len, &pos, UINT16_MAX, &pnm->height) ||
+      (pgm && !pnm_number(data, len, &pos, UINT16_MAX, &pnm->maxval)) ||
+      pos >= len || !pnm_space(data[pos]))
+    return false;
+  ++pos; // a single whitespace byte, then the rows
+  if (!pnm->width || !pnm->height || !pnm->maxval)
+    return false;
+  pnm->row_bytes = !pgm ? (pnm->width + 7u) / 8 :
+    pnm->maxval > 255 ? 2u * pnm->width : pnm->width;
+  if ((len - pos) / pnm->row_bytes < pnm->height)
+    return false;
+  pnm->rows = data + pos;
+  return true;
+}
+
+
+static ql_packed_image_t *load_pnm(const uint8_t *data, size_t len, uint16_t line_bytes, const ql_pack_opts_t *opts, ql_arena_t arena, uint16_t *width, uint16_t *height)
+{
+  ql_packed_image_t *ret = NULL;
+  *width = *height = 0;
+  pnm_t pnm;
+  if (!pnm_header(data, len, &pnm))
+  {
+    errno = EINVAL;
+    goto out;
+  }
+  *width = pnm.width;
+  *height = pnm.height;
+
+  // Packed rows are taken as they are, as for a bilevel PNG, unless the
+  // options need gray; 8-bit gray rows are taken as they are
+  const bool pbm = data[1] == '4';
+  const uint8_t dither = opts->two_colour ? QL_DITHER_NONE : opts->dither;
+  const bool bits = pbm && dither != QL_DITHER_ORDERED && opts->threshold > 0;
+  const bool as_is = bits || pnm.maxval == 255;
+  ql_packer_t packer =
+    ql_packer_create_arena(pnm.width, pnm.height, line_bytes, opts, arena);
+  if (!packer)
+    goto out;
+  uint8_t *gray = as_is ? NULL : ql_arena_calloc(arena, pnm.width);
+  if (!as_is && !gray)
+    goto destroy_out;
+
+  const uint8_t *row = pnm.rows;
+  for (unsigned y = 0; y < pnm.height; ++y, row += pnm.row_bytes)
+  {
+    if (bits)
+      ql_packer_add_bits(packer, row);
+    else if (as_is)
+      ql_packer_add_row(packer, row);
+    else
+    {
+      if (pbm)
+        for (unsigned x = 0; x < pnm.width; ++x)
+          gray[x] = (row[x / 8] & (0x80 >> (x % 8))) ? 0 : 255;
+      else if (pnm.maxval > 255) // big-endian samples
+        for (unsigned x = 0; x < pnm.width; ++x)
+        {
+          const uint32_t v = row[2 * x] << 8 | row[2 * x + 1];
+          gray[x] = v >= pnm.maxval ? 255 : (v * 255 + pnm.maxval / 2) / pnm.maxval;
+        }
+      else
+        for (unsigned x = 0; x < pnm.width; ++x)
+        {
+          const uint32_t v = row[x];
+          gray[x] = v >= pnm.maxval ? 255 : (v * 255 + pnm.maxval / 2) / pnm.maxval;
+        }
+      ql_packer_add_row(packer, gray);
+    }
+  }
+  ret = ql_packer_finish(packer);
+  packer = NULL; // finish already freed it
+
+destroy_out:
+  ql_arena_free(arena, gray);
+  ql_packer_destroy(packer);
+out:
+  return ret;
+}
+
+
+static ql_packed_image_t *load_qlpr(const uint8_t *data, size_t len, uint16_t line_bytes, const ql_pack_opts_t *opts, ql_arena_t arena, uint16_t *width, uint16_t *height)
+{
+  (void)opts;
+  *width = *height = 0;
+  if (len < QLPR_HEADER_LEN)
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+  const uint8_t planes = data[4];
+  const uint16_t lines = data[8] | data[9] << 8;
+  const uint16_t lb = data[10] | data[11] << 8;
+  const uint32_t length =
+    data[12] | data[13] << 8 | data[14] << 16 | (uint32_t)data[15] << 24;
+  if ((planes != 1 && planes != 2) || !lines || !lb || lb > UINT16_MAX / 8 ||
+      length != (size_t)lines * planes * lb ||
+      length > len - QLPR_HEADER_LEN)
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+  *width = lines;
+  *height = lb * 8;
+  if (lb != line_bytes)
+    return NULL;
+
+  const size_t size = sizeof(ql_packed_image_t) + length;
+  ql_packed_image_t *out = arena ? ql_arena_alloc(arena, size) : ql_malloc(size);
+  if (!out)
+    return NULL;
+  out->lines = lines;
+  out->line_bytes = lb;
+  out->planes = planes;
+  out->ink = NULL; // blank lines are found when printing
+  memcpy(out->data, data + QLPR_HEADER_LEN, length);
+  return out;
+}
+
+
+static ql_packed_image_t *load_png(const uint8_t *data, size_t len, uint16_t line_bytes, const ql_pack_opts_t *opts, ql_arena_t arena, uint16_t *width, uint16_t *height)
+{
+  return loadpng_packed_mem(data, len, line_bytes, opts, arena, width, height);
+}
+
+
+static bool probe_png(const uint8_t *data, size_t len)
+{
+  return len >= sizeof(png_signature) &&
+    memcmp(data, png_signature, sizeof(png_signature)) == 0;
+}
+
+
+static bool probe_pbm(const uint8_t *data, size_t len)
+{
+  return len >= 3 && data[0] == 'P' && data[1] == '4' && pnm_space(data[2]);
+}
+
+
+static bool probe_pgm(const uint8_t *data, size_t len)
+{
+  return len >= 3 && data[0] == 'P' && data[1] == '5' && pnm_space(data[2]);
+}
+
+
+static bool probe_qlpr(const uint8_t *data, size_t len)
+{
+  return len >= 4 && memcmp(data, QLPR_MAGIC, 4) == 0;
+}
+
+
+static const loadimg_format_t formats[] = {
+  { "png", probe_png, load_png },
+  { "pbm", probe_pbm, load_pnm },
+  { "pgm", probe_pgm, load_pnm },
+  { "qlraster", probe_qlpr, load_qlpr },
+};
+
+
+const loadimg_format_t *loadimg_formats(unsigned *num)
+{
+  *num = sizeof(formats) / sizeof(formats[0]);
+  return formats;
+}
+
+
+const loadimg_format_t *loadimg_probe(const uint8_t *data, size_t len)
+{
+  for (unsigned i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i)
+    if (formats[i].probe(data, len))
+      return &formats[i];
+  return NULL;
+}
+
+
+ql_packed_image_t *loadimg_packed_mem(const void *data, size_t len, uint16_t line_bytes, const ql_pack_opts_t *opts, ql_arena_t arena, uint16_t *width, uint16_t *height)
+{
+  *width = *height = 0;
+  const loadimg_format_t *fmt = loadimg_probe(data, len);
+  if (!fmt)
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+  return fmt->load(data, len, line_bytes, opts, arena, width, height);
+}
+
+
+ql_packed_image_t *loadimg_packed(const char *path, uint16_t line_bytes, const ql_pack_opts_t *opts, ql_arena_t arena, uint16_t *width, uint16_t *height)
+{
+  ql_packed_image_t *ret = NULL;
+  *width = *height = 0;
+  int fd = path ? open(path, O_RDONLY) : -1;
+  if (fd < 0)
+    goto out;
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+    goto close_out;
+  if (st.st_size == 0)
+  {
+    errno = EINVAL;
+    goto close_out;
+  }
+  const size_t size = st.st_size;
+  void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    goto close_out;
+  (void)madvise(map, size, MADV_SEQUENTIAL);
+
+  ret = loadimg_packed_mem(map, size, line_bytes, opts, arena, width, height);
+  int err = errno;
+  munmap(map, size);
+  errno = err;
+
+close_out:
+  {
+    int err = errno;
+    close(fd);
+    errno = err;
+  }
+out:
+  return ret;
+}
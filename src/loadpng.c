@@ -6,99 +6,553 @@
  * @author Johny Mattsson <jmattsson@dius.com.au>
  */
 #include "loadpng.h"
+#include "arena.h"
+#include "raster.h"
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <unistd.h>
 #include <png.h>
 
 static_assert(sizeof(png_byte) == sizeof( ((ql_raster_image_t *)0)->data[0]), "Code relies on png_byte being compatible with ql_raster_image_t data ");
 
-ql_raster_image_t *loadpng(const char *path)
+#define STREAM_BUF_LEN (256 * 1024) // fits the longest raw row many times over
+
+#define FRAME_MAGIC "QLRF"
+#define FRAME_HEADER_LEN 16
+
+struct loadpng_stream
 {
-  ql_raster_image_t *ret = NULL;
+  int fd;
+  uint8_t *buf;
+  size_t len, pos; // bytes in buf, and how many of those used up
+  bool eof;   // nothing more to read
+  bool ended; // and all of it taken, at the end of an image
+};
 
-  if (!path)
-    goto out;
+// Where the PNG comes from: a file, a buffer already in memory, or a stream
+typedef struct {
+  FILE *f;
+  const uint8_t *data;
+  size_t len, pos;
+  loadpng_stream_t stream;
+} png_source_t;
 
-  FILE *f = fopen(path, "rb");
-  if (!f)
-    goto out;
+
+// Reads as much more as there is room for, after what's still unused
+static bool stream_fill(loadpng_stream_t s)
+{
+  if (s->pos)
+  {
+    memmove(s->buf, s->buf + s->pos, s->len - s->pos);
+    s->len -= s->pos;
+    s->pos = 0;
+  }
+  ssize_t n;
+  while ((n = read(s->fd, s->buf + s->len, STREAM_BUF_LEN - s->len)) == -1 &&
+    errno == EINTR)
+    ;
+  if (n == -1)
+    return false;
+  s->len += n;
+  s->eof = n == 0;
+  return true;
+}
+
+
+// True once len bytes (no more than the buffer holds) are there at pos
+static bool stream_need(loadpng_stream_t s, size_t len)
+{
+  while (s->len - s->pos < len)
+    if (s->eof || !stream_fill(s))
+      return false;
+  return true;
+}
+
+
+static size_t stream_read(loadpng_stream_t s, void *buf, size_t len)
+{
+  size_t got = 0;
+  while (got < len)
+  {
+    if (s->pos == s->len && (s->eof || !stream_fill(s) || s->pos == s->len))
+      break;
+    size_t n = s->len - s->pos;
+    if (n > len - got)
+      n = len - got;
+    memcpy((uint8_t *)buf + got, s->buf + s->pos, n);
+    s->pos += n;
+    got += n;
+  }
+  return got;
+}
+
+typedef struct {
+  png_structp png_ptr;
+  png_infop info_ptr, end_ptr;
+  png_uint_32 width, height;
+  int passes; // more than one if interlaced
+  size_t row_bytes;
+  bool bilevel; // rows are left packed at 1bpp, see black_and/black_xor
+  bool rgb; // rows are 8-bit RGB, for two-colour printing
+  uint8_t black_and, black_xor; // (packed & and) ^ xor gives 1 for black
+} png_reader_t;
+
+
+static size_t source_read(png_source_t *src, void *buf, size_t len)
+{
+  if (src->stream)
+    return stream_read(src->stream, buf, len);
+  if (src->f)
+    return fread(buf, 1, len, src->f);
+  if (len > src->len - src->pos)
+    len = src->len - src->pos;
+  memcpy(buf, src->data + src->pos, len);
+  src->pos += len;
+  return len;
+}
+
+
+static void png_source_read(png_structp png_ptr, png_bytep data, png_size_t len)
+{
+  if (source_read(png_get_io_ptr(png_ptr), data, len) != len)
+    png_error(png_ptr, "read error");
+}
+
+
+// libpng's own allocations go to the arena (if any) and are counted
+static png_voidp png_alloc(png_structp png_ptr, png_alloc_size_t size)
+{
+  ql_arena_t arena = png_get_mem_ptr(png_ptr);
+  return arena ? ql_arena_alloc(arena, size) : ql_malloc(size);
+}
+
+
+static void png_release(png_structp png_ptr, png_voidp ptr)
+{
+  ql_arena_free(png_get_mem_ptr(png_ptr), ptr);
+}
+
+
+static void reader_close(png_reader_t *rd)
+{
+  if (rd->png_ptr)
+    png_destroy_read_struct(&rd->png_ptr,
+      rd->info_ptr ? &rd->info_ptr : NULL, rd->end_ptr ? &rd->end_ptr : NULL);
+}
+
+
+// Gray value of a palette entry, the same way png_set_rgb_to_gray_fixed() does it
+static unsigned palette_gray(const png_color *c)
+{
+  if (c->red == c->green && c->green == c->blue)
+    return c->red;
+  return (6968 * c->red + 23434 * c->green + 2366 * c->blue) >> 15;
+}
+
+
+/* Works out whether a 1-bit image can be kept packed, and how to map its
+ * bits to printer polarity. Gray 0 is black; for two-entry palettes each
+ * entry is thresholded like the 8-bit path would do after expanding it.
+ * Error diffusion leaves pure black and white as they are, so only those
+ * can skip it; ordered dithering always goes the 8-bit way.
+ */
+static bool check_bilevel(png_reader_t *rd, int color_type, int bit_depth, uint8_t threshold, uint8_t dither)
+{
+  if (bit_depth != 1 || dither == QL_DITHER_ORDERED)
+    return false;
+
+  bool black[2] = { true, false };
+  if (color_type == PNG_COLOR_TYPE_PALETTE)
+  {
+    png_colorp palette;
+    int num_palette = 0;
+    png_get_PLTE(rd->png_ptr, rd->info_ptr, &palette, &num_palette);
+    if (num_palette < 1 || num_palette > 2)
+      return false;
+    for (int i = 0; i < 2; ++i)
+    {
+      unsigned gray = palette_gray(&palette[i < num_palette ? i : 0]);
+      if (dither != QL_DITHER_NONE && gray != 0 && gray != 255)
+        return false;
+      black[i] = gray < threshold;
+    }
+  }
+  else if (color_type == PNG_COLOR_TYPE_GRAY)
+  {
+    black[0] = threshold > 0;
+    black[1] = false; // nothing is below 255
+  }
+  else
+    return false;
+
+  rd->bilevel = true;
+  rd->black_and = (black[0] == black[1]) ? 0x00 : 0xff;
+  rd->black_xor = black[0] ? 0xff : 0x00;
+  return true;
+}
+
+
+/* Sets libpng up to deliver 8-bit grayscale rows from src, or if
+ * bilevel_threshold is given and the image is 1-bit bilevel, to leave
+ * the rows packed. With keep_colour, colour images give 8-bit RGB rows
+ * instead of grayscale. The decoder's memory comes from arena, if given.
+ */
+static bool reader_open(png_reader_t *rd, png_source_t *src, ql_arena_t arena, const uint8_t *bilevel_threshold, uint8_t dither, bool keep_colour)
+{
+  *rd = (png_reader_t){ 0, };
 
   uint8_t header[8];
-  if (fread(header, 1, sizeof(header), f) != 8)
+  if (source_read(src, header, sizeof(header)) != 8)
     goto close_out;
 
   if (!png_check_sig(header, sizeof(header)))
     goto close_out;
 
-  png_infop info_ptr = NULL, end_ptr = NULL;
-  png_structp png_ptr =
-    png_create_read_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-  if (!png_ptr)
+  rd->png_ptr = png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL,
+    NULL, arena, png_alloc, png_release);
+  if (!rd->png_ptr)
     goto close_out;
 
-  info_ptr = png_create_info_struct(png_ptr);
-  if (!info_ptr)
-    goto destroy_read_out;
+  rd->info_ptr = png_create_info_struct(rd->png_ptr);
+  if (!rd->info_ptr)
+    goto close_out;
 
-  end_ptr = png_create_info_struct(png_ptr);
-  if (!end_ptr)
-    goto destroy_read_out;
+  rd->end_ptr = png_create_info_struct(rd->png_ptr);
+  if (!rd->end_ptr)
+    goto close_out;
 
-  if (setjmp(png_jmpbuf(png_ptr)))
-    goto destroy_read_out;
+  if (setjmp(png_jmpbuf(rd->png_ptr)))
+    goto close_out;
 
-  png_init_io(png_ptr, f);
-  png_set_sig_bytes(png_ptr, sizeof(header));
+  png_set_read_fn(rd->png_ptr, src, png_source_read);
+  png_set_sig_bytes(rd->png_ptr, sizeof(header));
 
-  png_read_info(png_ptr, info_ptr);
+  png_read_info(rd->png_ptr, rd->info_ptr);
 
-  png_uint_32 width, height;
   int bit_depth, color_type;
-  png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth,
+  png_get_IHDR(rd->png_ptr, rd->info_ptr, &rd->width, &rd->height, &bit_depth,
     &color_type, NULL, NULL, NULL);
+  if (rd->width > UINT16_MAX || rd->height > UINT16_MAX)
+    goto close_out;
 
-  if (color_type & PNG_COLOR_MASK_ALPHA)
-    png_set_strip_alpha(png_ptr);
-  if (color_type & (PNG_COLOR_MASK_COLOR | PNG_COLOR_MASK_PALETTE))
-    png_set_rgb_to_gray_fixed(png_ptr, 1, -1, -1); // force into grayscale
+  rd->rgb = keep_colour &&
+    (color_type & (PNG_COLOR_MASK_COLOR | PNG_COLOR_MASK_PALETTE));
+
+  if (bilevel_threshold && !rd->rgb &&
+      check_bilevel(rd, color_type, bit_depth, *bilevel_threshold, dither))
+  {
+    rd->passes = png_set_interlace_handling(rd->png_ptr);
+    png_read_update_info(rd->png_ptr, rd->info_ptr);
+    rd->row_bytes = png_get_rowbytes(rd->png_ptr, rd->info_ptr);
+    if (rd->row_bytes != (rd->width + 7) / 8)
+      goto close_out;
+    return true;
+  }
+
+  if (color_type == PNG_COLOR_TYPE_PALETTE)
+    png_set_palette_to_rgb(rd->png_ptr);
+  if ((color_type & PNG_COLOR_MASK_ALPHA) ||
+      png_get_valid(rd->png_ptr, rd->info_ptr, PNG_INFO_tRNS))
+    png_set_strip_alpha(rd->png_ptr);
+  if ((color_type & (PNG_COLOR_MASK_COLOR | PNG_COLOR_MASK_PALETTE)) && !rd->rgb)
+    png_set_rgb_to_gray_fixed(rd->png_ptr, 1, -1, -1); // force into grayscale
   if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
-    png_set_expand_gray_1_2_4_to_8(png_ptr); // get us a known output format
+    png_set_expand_gray_1_2_4_to_8(rd->png_ptr); // get us a known output format
+  if (bit_depth == 16)
+    png_set_strip_16(rd->png_ptr);
+  rd->passes = png_set_interlace_handling(rd->png_ptr);
+
+  png_read_update_info(rd->png_ptr, rd->info_ptr);
+  rd->row_bytes = png_get_rowbytes(rd->png_ptr, rd->info_ptr);
+  if (rd->row_bytes != rd->width * (rd->rgb ? 3 : 1))
+    goto close_out; // not the 8-bit grayscale (or RGB) we asked for
 
-  png_read_update_info(png_ptr, info_ptr);
+  return true;
 
-  png_bytepp row_ptrs = calloc(height, sizeof(png_bytep));
+close_out:
+  reader_close(rd);
+  return false;
+}
+
+
+ql_raster_image_t *loadpng_arena(const char *path, ql_arena_t arena)
+{
+  ql_raster_image_t *volatile ret = NULL;
+
+  if (!path)
+    goto out;
+
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    goto out;
+
+  png_source_t src = { .f = f };
+  png_reader_t rd;
+  if (!reader_open(&rd, &src, arena, NULL, QL_DITHER_NONE, false))
+    goto close_out;
+
+  png_bytepp row_ptrs = ql_arena_calloc(arena, rd.height * sizeof(png_bytep));
   if (!row_ptrs)
     goto destroy_read_out;
 
-  const unsigned row_bytes = width * sizeof(png_byte);
-  ql_raster_image_t *img =
-    calloc(1, sizeof(ql_raster_image_t) + height * row_bytes);
+  const unsigned row_bytes = rd.width * sizeof(png_byte);
+  ql_raster_image_t *volatile img = ql_arena_calloc(arena,
+    sizeof(ql_raster_image_t) + rd.height * row_bytes);
   if (!img)
     goto free_image_out;
 
-  if (setjmp(png_jmpbuf(png_ptr)))
+  if (setjmp(png_jmpbuf(rd.png_ptr)))
     goto free_image_out;
 
-  for (png_uint_32 i = 0; i < height; ++i)
+  for (png_uint_32 i = 0; i < rd.height; ++i)
     row_ptrs[i] = (png_bytep)(img->data + (i * row_bytes));
 
-  png_read_image(png_ptr, row_ptrs);
-  png_read_end(png_ptr, end_ptr);
+  png_read_image(rd.png_ptr, row_ptrs);
+  png_read_end(rd.png_ptr, rd.end_ptr);
 
-  img->height = height;
-  img->width = width;
+  img->height = rd.height;
+  img->width = rd.width;
 
   ret = img;
   img = NULL; // don't free it, we're returning it now
 
 free_image_out:
-  free(img);
-  free(row_ptrs);
+  ql_arena_free(arena, img);
+  ql_arena_free(arena, row_ptrs);
 destroy_read_out:
-  png_destroy_read_struct(
-    &png_ptr, info_ptr ? &info_ptr : NULL, end_ptr ? &end_ptr : NULL);
+  reader_close(&rd);
 close_out:
   fclose(f);
 out:
   return ret;
 }
+
+
+ql_raster_image_t *loadpng(const char *path)
+{
+  return loadpng_arena(path, NULL);
+}
+
+
+static ql_packed_image_t *load_packed(png_source_t *src, uint16_t line_bytes, const ql_pack_opts_t *opts, ql_arena_t arena, uint16_t *width, uint16_t *height)
+{
+  ql_packed_image_t *volatile ret = NULL;
+  *width = *height = 0;
+
+  // Scaling needs gray, so only unscaled rows can stay packed
+  png_reader_t rd;
+  if (!reader_open(&rd, src, arena, opts->fit_dots ? NULL : &opts->threshold,
+      opts->two_colour ? QL_DITHER_NONE : opts->dither, opts->two_colour))
+    goto out;
+
+  *width = rd.width;
+  *height = rd.height;
+
+  volatile ql_packer_t packer =
+    ql_packer_create_arena(rd.width, rd.height, line_bytes, opts, arena);
+  if (!packer)
+    goto destroy_read_out;
+
+  // Rows of an interlaced image aren't final until the last pass
+  const bool interlaced = rd.passes > 1;
+  png_bytep volatile buf =
+    ql_arena_calloc(arena, rd.row_bytes * (interlaced ? rd.height : 1));
+  png_bytepp volatile row_ptrs = interlaced ?
+    ql_arena_calloc(arena, rd.height * sizeof(png_bytep)) : NULL;
+  if (!buf || (interlaced && !row_ptrs))
+    goto free_rows_out;
+
+  if (setjmp(png_jmpbuf(rd.png_ptr)))
+    goto free_rows_out;
+
+  if (interlaced)
+  {
+    for (png_uint_32 i = 0; i < rd.height; ++i)
+      row_ptrs[i] = buf + i * rd.row_bytes;
+    png_read_image(rd.png_ptr, row_ptrs);
+  }
+
+  for (png_uint_32 i = 0; i < rd.height; ++i)
+  {
+    png_bytep row = buf;
+    if (interlaced)
+      row = row_ptrs[i];
+    else
+      png_read_row(rd.png_ptr, row, NULL);
+
+    if (rd.bilevel)
+    {
+      // Already packed, MSB first, only needs mapping to printer polarity
+      for (unsigned n = 0; n < rd.row_bytes; ++n)
+        row[n] = (row[n] & rd.black_and) ^ rd.black_xor;
+      ql_packer_add_bits(packer, row);
+    }
+    else if (rd.rgb)
+      ql_packer_add_rgb_row(packer, row);
+    else
+      ql_packer_add_row(packer, row);
+  }
+  png_read_end(rd.png_ptr, rd.end_ptr);
+
+  ret = ql_packer_finish(packer);
+  packer = NULL; // finish already freed it
+
+free_rows_out:
+  ql_arena_free(arena, row_ptrs);
+  ql_arena_free(arena, buf);
+  ql_packer_destroy(packer);
+destroy_read_out:
+  reader_close(&rd);
+out:
+  return ret;
+}
+
+
+ql_packed_image_t *loadpng_packed_mem(const void *data, size_t len, uint16_t line_bytes, const ql_pack_opts_t *opts, ql_arena_t arena, uint16_t *width, uint16_t *height)
+{
+  png_source_t src = { .data = data, .len = len };
+  return load_packed(&src, line_bytes, opts, arena, width, height);
+}
+
+
+ql_packed_image_t *loadpng_packed_arena(const char *path, uint16_t line_bytes, const ql_pack_opts_t *opts, ql_arena_t arena, uint16_t *width, uint16_t *height)
+{
+  *width = *height = 0;
+  FILE *f = path ? fopen(path, "rb") : NULL;
+  if (!f)
+    return NULL;
+  png_source_t src = { .f = f };
+  ql_packed_image_t *ret =
+    load_packed(&src, line_bytes, opts, arena, width, height);
+  fclose(f);
+  return ret;
+}
+
+
+ql_packed_image_t *loadpng_packed(const char *path, uint16_t line_bytes, const ql_pack_opts_t *opts, uint16_t *width, uint16_t *height)
+{
+  return loadpng_packed_arena(path, line_bytes, opts, NULL, width, height);
+}
+
+
+loadpng_stream_t loadpng_stream_open(int fd)
+{
+  loadpng_stream_t s = ql_calloc(1, sizeof(struct loadpng_stream));
+  if (!s)
+    return NULL;
+  s->buf = ql_malloc(STREAM_BUF_LEN);
+  if (!s->buf)
+  {
+    ql_free(s);
+    return NULL;
+  }
+  s->fd = fd;
+  return s;
+}
+
+
+void loadpng_stream_close(loadpng_stream_t s)
+{
+  if (!s)
+    return;
+  ql_free(s->buf);
+  ql_free(s);
+}
+
+
+bool loadpng_stream_ended(loadpng_stream_t s)
+{
+  return s->ended;
+}
+
+
+bool loadpng_stream_buffered(loadpng_stream_t s)
+{
+  return s->pos < s->len || s->eof;
+}
+
+
+/* A raw frame: 1-bit rows go to the packer as they are (as a 1-bit PNG
+ * would), unless ordered dithering or a zero threshold needs them gray.
+ * Rows are packed straight out of the stream's buffer.
+ */
+static ql_packed_image_t *load_frame(loadpng_stream_t s, uint16_t line_bytes, const ql_pack_opts_t *opts, ql_arena_t arena, uint16_t *width, uint16_t *height)
+{
+  ql_packed_image_t *ret = NULL;
+  if (!stream_need(s, FRAME_HEADER_LEN))
+    goto out;
+  const uint8_t *hdr = s->buf + s->pos;
+  const unsigned bpp = hdr[4];
+  const uint16_t w = hdr[8] | hdr[9] << 8, h = hdr[10] | hdr[11] << 8;
+  const uint32_t len =
+    hdr[12] | hdr[13] << 8 | hdr[14] << 16 | (uint32_t)hdr[15] << 24;
+  const size_t row_bytes = bpp == 1 ? (w + 7u) / 8 : w;
+  if ((bpp != 1 && bpp != 8) || !w || !h || len != row_bytes * h)
+    goto out;
+  s->pos += FRAME_HEADER_LEN;
+  *width = w;
+  *height = h;
+
+  const uint8_t dither = opts->two_colour ? QL_DITHER_NONE : opts->dither;
+  const bool bits = bpp == 1 &&
+    dither != QL_DITHER_ORDERED && opts->threshold > 0;
+  ql_packer_t packer = ql_packer_create_arena(w, h, line_bytes, opts, arena);
+  if (!packer)
+    goto out;
+  uint8_t *gray = (bpp == 1 && !bits) ? ql_arena_calloc(arena, w) : NULL;
+  if (bpp == 1 && !bits && !gray)
+    goto destroy_out;
+
+  for (unsigned y = 0; y < h; ++y, s->pos += row_bytes)
+  {
+    if (!stream_need(s, row_bytes))
+    {
+      *width = *height = 0; // cut short, not too large
+      goto destroy_out;
+    }
+    const uint8_t *row = s->buf + s->pos;
+    if (bits)
+      ql_packer_add_bits(packer, row);
+    else if (gray)
+    {
+      for (unsigned x = 0; x < w; ++x)
+        gray[x] = (row[x / 8] & (0x80 >> (x % 8))) ? 0 : 255;
+      ql_packer_add_row(packer, gray);
+    }
+    else
+      ql_packer_add_row(packer, row);
+  }
+  ret = ql_packer_finish(packer);
+  packer = NULL; // finish already freed it
+
+destroy_out:
+  ql_arena_free(arena, gray);
+  ql_packer_destroy(packer);
+out:
+  return ret;
+}
+
+
+ql_packed_image_t *loadpng_stream_next(loadpng_stream_t s, uint16_t line_bytes, const ql_pack_opts_t *opts, ql_arena_t arena, uint16_t *width, uint16_t *height)
+{
+  *width = *height = 0;
+  errno = 0;
+  if (!stream_need(s, 1))
+  {
+    s->ended = s->eof; // else a read error
+    return NULL;
+  }
+  ql_packed_image_t *ret;
+  if (stream_need(s, 4) && memcmp(s->buf + s->pos, FRAME_MAGIC, 4) == 0)
+    ret = load_frame(s, line_bytes, opts, arena, width, height);
+  else
+  {
+    png_source_t src = { .stream = s };
+    ret = load_packed(&src, line_bytes, opts, arena, width, height);
+  }
+  if (!ret && !errno)
+    errno = EINVAL;
+  return ret;
+}
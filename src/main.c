@@ -6,20 +6,353 @@
  * @author Johny Mattsson <jmattsson@dius.com.au>
  */
 #include "ql.h"
+#include "labelcache.h"
+#include "rasterpool.h"
+#include "jobserver.h"
+#include "farm.h"
+#include "raster.h"
+#include "compose.h"
+#include "spool.h"
 #include "loadpng.h"
 #include <errno.h>
 #include <getopt.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <signal.h>
 
-static bool timed_out = false;
-void on_alarm(int ignored)
+#define MAX_IN_FLIGHT 4
+#define MAX_CACHED_LABELS 64
+#define MAX_PRINTERS 16
+#define MAX_THREADS 64
+#define LABELS_AHEAD_PER_THREAD 2
+
+typedef struct {
+  const char *path;
+  uint16_t width, height;
+  const label_cache_entry_t *entry; // held until sent
+  const ql_packed_image_t *packed; // owned by the label cache
+  unsigned spooled; // the label's index, if from a spool
+  ql_encoded_image_t encoded; // and its lines, as spooled
+  ql_print_cfg_t cfg;
+  char name[20]; // for labels from stdin
+  ql_print_stats_t stats;
+} label_t;
+
+// Where labels come from: the raster pool, a template, a spool or stdin
+typedef struct {
+  char **inputs; // image files, or template records
+  unsigned files;
+  raster_pool_t pool;
+  label_cache_t cache; // the pool's
+  ql_template_t tpl;
+  spool_t spool;
+  unsigned next; // in the spool, to be checked for having been printed
+  loadpng_stream_t stream;
+  ql_arena_t arena; // for the label last read from the stream
+  uint16_t line_bytes;
+  ql_pack_opts_t opts;
+  bool ended; // the stream, cleanly
+} label_source_t;
+
+/* Takes the next label from the pool, stamps it from the template with its
+ * record and number, takes the next one not yet printed from the spool, or
+ * reads the next one from stdin (replacing the one before); false if not
+ * loaded or drawn, or at the end of stdin, packed NULL if not printable
+ */
+static bool prepare_label(label_t *label, label_source_t *src, unsigned number)
 {
-  (void)ignored;
-  timed_out = true;
+  if (src->stream)
+  {
+    snprintf(label->name, sizeof(label->name), "stdin#%u", number);
+    label->path = label->name;
+    ql_arena_reset(src->arena);
+    label->packed = loadpng_stream_next(src->stream, src->line_bytes,
+      &src->opts, src->arena, &label->width, &label->height);
+    src->ended = !label->packed && loadpng_stream_ended(src->stream);
+    return label->packed || label->width; // else not loaded
+  }
+  if (src->spool)
+  {
+    while (spool_is_done(src->spool, src->next))
+      ++src->next;
+    label->spooled = src->next++;
+    spool_label(src->spool, label->spooled, &label->encoded, &label->cfg,
+      &label->path);
+    label->width = label->encoded.lines;
+    label->height = label->encoded.line_bytes * 8;
+    return true;
+  }
+  label->path = src->inputs[(number - 1) % src->files];
+  if (src->tpl)
+  {
+    label->packed = ql_template_stamp(src->tpl, label->path, number);
+    if (!label->packed)
+      return false;
+    label->width = label->packed->lines;
+    label->height = label->packed->line_bytes * 8;
+    return true;
+  }
+  label->entry = raster_pool_next(src->pool);
+  if (!label->entry)
+    return false;
+  label->width = label->entry->width;
+  label->height = label->entry->height;
+  label->packed = label->entry->packed;
+  return true;
+}
+
+
+static void report_label(const label_t *label, bool show_stats)
+{
+  printf("%s (%ux%u) OK", label->path, label->width, label->height);
+  if (show_stats)
+  {
+    const ql_print_stats_t *stats = &label->stats;
+    printf(", raster %u -> %u bytes (%u%% saved), %u blank lines, "
+      "%u reused", stats->raster_bytes, stats->sent_bytes,
+      100 - (unsigned)(100ull * stats->sent_bytes / stats->raster_bytes),
+      stats->blank_lines, stats->reused_lines);
+  }
+  printf("\n");
+  fflush(stdout);
+}
+
+
+/* Whether to read the next label from stdin now, rather than the status
+ * of one in flight: once some of it is there, unless a status is too. This
+ * doesn't wait for either; input turning up while waiting for the status
+ * is seen once that arrives, so it's only the status that can time out.
+ * Made up statuses (printing to a file) are all there already.
+ */
+static bool stream_ready(loadpng_stream_t stream, ql_ctx_t ctx)
+{
+  const int fd = ql_status_fd(ctx);
+  if (fd < 0)
+    return false;
+  struct pollfd pfd[2] = {
+    { .fd = fd, .events = POLLIN },
+    { .fd = STDIN_FILENO, .events = POLLIN },
+  };
+  if (poll(pfd, 2, 0) == -1 || (pfd[0].revents & POLLIN))
+    return false;
+  return loadpng_stream_buffered(stream) || pfd[1].revents;
+}
+
+
+// Waits for the next status, failing on timeout or printer error
+static bool wait_for_status(ql_ctx_t ctx, ql_status_t *status, unsigned timeout)
+{
+  if (!ql_wait_status(ctx, status, timeout))
+  {
+    fprintf(stderr, "Printer stopped responding!\n");
+    return false;
+  }
+
+  if (status->err_info_1 || status->err_info_2)
+  {
+    fprintf(stderr, "Printer reported error(s): %s\n",
+      ql_decode_errors(status));
+    return false;
+  }
+  return true;
+}
+
+
+// (Re)initialises the printer and reads its status
+static bool init_printer(ql_ctx_t ctx, ql_status_t *status)
+{
+  if (!ql_init(ctx))
+  {
+    fprintf(stderr, "Failed to send initialisation sequence to printer: %s\n",
+      strerror(errno));
+    return false;
+  }
+
+  if (!ql_request_status(ctx))
+  {
+    fprintf(stderr, "Failed to request status from printer: %s\n",
+      strerror(errno));
+    return false;
+  }
+
+  if (!ql_read_status(ctx, status))
+  {
+    fprintf(stderr, "Failed to read status from printer: %s\n",
+      strerror(errno));
+    return false;
+  }
+
+/*
+for (int i = 0; i < 32; ++i)
+  printf("%02hhx ", ((char *)status)[i]);
+printf("\n");
+*/
+  return true;
+}
+
+
+/* Opens a printer, or an output file pretending to be the offline printer,
+ * and reads its status; NULL (with error shown) on failure
+ */
+static ql_ctx_t open_printer(const char *printer, const ql_status_t *offline, ql_status_t *status, int chunk)
+{
+  ql_ctx_t ctx = offline ? ql_open_output(printer, offline) : ql_open(printer);
+  if (!ctx)
+  {
+    fprintf(stderr, "Unable to open '%s': %s\n", printer, strerror(errno));
+    return NULL;
+  }
+
+  if (chunk >= 0 && !ql_set_output_chunk(ctx, chunk))
+  {
+    fprintf(stderr, "Failed to set output chunk size: %s\n", strerror(errno));
+    ql_close(ctx);
+    return NULL;
+  }
+
+  if (!init_printer(ctx, status))
+  {
+    ql_close(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+
+typedef struct {
+  int32_t margin; // negative for printer default
+  bool autocut;
+  uint8_t autocut_every;
+  int chunk; // negative for default
+  bool two_colour; // printer must be able to
+  bool fit; // printable width of the media must be known
+  bool delta; // a run of labels, send only what changes anew
+} printer_setup_t;
+
+// Whether the printer can print labels as set up
+static bool check_printer(const ql_status_t *status, const printer_setup_t *setup)
+{
+  if (setup->two_colour && !ql_supports_two_colour(status))
+  {
+    fprintf(stderr, "Printer (%s) can't print two-colour\n",
+      ql_decode_model(status));
+    return false;
+  }
+  if (setup->fit && !ql_media_dots(status))
+  {
+    fprintf(stderr, "Unknown printable width for %umm media, can't fit\n",
+      status->media_width_mm);
+    return false;
+  }
+  return true;
+}
+
+
+static bool setup_printer(ql_ctx_t ctx, const ql_status_t *status, const printer_setup_t *setup)
+{
+  if (!check_printer(status, setup))
+    return false;
+  if (setup->margin >= 0 && !ql_set_margin(ctx, (uint16_t)setup->margin))
+  {
+    fprintf(stderr, "Failed to set margin: %s\n", strerror(errno));
+    return false;
+  }
+  if (setup->autocut &&
+      (!ql_set_mode(ctx, QL_MODE_AUTOCUT) ||
+       !ql_set_autocut_every_n(ctx, setup->autocut_every)))
+  {
+    fprintf(stderr, "Failed to set autocut: %s\n", strerror(errno));
+    return false;
+  }
+
+  ql_set_delta(ctx, setup->delta);
+
+  if (ql_needs_mode_switch(status) && !ql_switch_to_raster_mode(ctx))
+  {
+    fprintf(stderr, "Failed to set raster mode: %s\n", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+
+// Used by the job server to recover after a printer error
+static bool reset_printer(ql_ctx_t ctx, ql_status_t *status, void *arg)
+{
+  return init_printer(ctx, status) && setup_printer(ctx, status, arg);
+}
+
+
+// Used by the farm to bring up each of its printers
+static ql_ctx_t open_farm_printer(const char *printer, ql_status_t *status, void *arg)
+{
+  const printer_setup_t *setup = arg;
+  ql_ctx_t ctx = open_printer(printer, NULL, status, setup->chunk);
+  if (ctx && !setup_printer(ctx, status, setup))
+  {
+    ql_close(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+
+/* Writes the labels to a spool instead of printing them, encoded for the
+ * printer with the given status
+ */
+static int write_spool(const char *path, const ql_status_t *status, ql_print_cfg_t *cfg, label_source_t *src, unsigned total)
+{
+  spool_writer_t sw = spool_create(path, status);
+  if (!sw)
+  {
+    fprintf(stderr, "Unable to create spool '%s': %s\n", path,
+      strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  for (unsigned i = 0; i < total; ++i)
+  {
+    label_t label = { 0, };
+    if (!prepare_label(&label, src, i + 1))
+    {
+      if (src->ended)
+      {
+        total = i;
+        break;
+      }
+      if (src->tpl)
+        fprintf(stderr, "Failed to draw label '%s': %s\n", label.path,
+          strerror(errno));
+      else
+        fprintf(stderr, "Failed to load image '%s'\n", label.path);
+      spool_abort(sw);
+      return EXIT_FAILURE;
+    }
+
+    cfg->first_page = (i % src->files) == 0;
+    bool ok = label.packed && spool_add(sw, label.path, label.packed, cfg);
+    label_cache_put(src->cache, label.entry);
+    if (!ok)
+    {
+      fprintf(stderr, "Failed to spool '%s' (%ux%u): %s\n", label.path,
+        label.width, label.height,
+        label.packed ? strerror(errno) : "too large for the printer");
+      spool_abort(sw);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (!spool_finish(sw))
+  {
+    fprintf(stderr, "Failed to write spool '%s': %s\n", path,
+      strerror(errno));
+    return EXIT_FAILURE;
+  }
+  printf("%u labels spooled to '%s'\n", total, path);
+  return EXIT_SUCCESS;
 }
 
 
@@ -27,11 +360,26 @@ void syntax(void)
 {
   fprintf(stderr,
 "Syntax:\n"
-"  qlprint [-p lp] -i\n"
-"          [-p lp] [-m margin] [-a] [-C|-D] [-W width] [-L length] [-Q] [-n num] [-t threshold] [-x timeout] png...\n"
+"  qlprint [-p lp] -i|-J\n"
+"          [-p lp] [-m margin] [-a] [-C|-D] [-W width] [-L length] [-Q] [-c] [-s] [-n num] [-t threshold] [-H dither] [-R] [-r rotation] [-f] [-x timeout] [-k kernel] [-b bytes] [-j threads] image...\n"
+"          [-p lp] [-m margin] [-a] [-x timeout] [-k kernel] [-b bytes] [-S socket] -d\n"
+"          -S socket [-C|-D] [-W width] [-L length] [-Q] [-c] [-n num] [-t threshold] [-H dither] [-R] [-r rotation] [-f] image...\n"
+"          -o file [-m margin] [-a] [-C|-D] [-W width] [-L length] [-Q] [-c] [-s] [-n num] [-t threshold] [-H dither] [-R] [-r rotation] [-f] [-k kernel] [-b bytes] [-j threads] image...\n"
+"          [-p lp|-o file] [-m margin] [-a] [-C|-D] [-W width] [-L length] [-Q] [-c] [-s] [-n num] [-x timeout] [-b bytes] -T template [record...]\n"
+"          -w spool [-p lp] [-C|-D] [-W width] [-L length] [-Q] [-c] [-n num] [-t threshold] [-H dither] [-R] [-r rotation] [-f] [-k kernel] [-j threads] image...|-T template [record...]\n"
+"          [-p lp|-o file] [-m margin] [-a] [-s] [-x timeout] [-b bytes] -u spool\n"
 "Where:\n"
-"  -p lp         Printer port (default /dev/usb/lp0)\n"
+"  -p lp         Printer port (default /dev/usb/lp0); repeat to share the\n"
+"                labels out over several printers\n"
 "  -i            Print status information only, then exit\n"
+"  -J            As -i, but as a line of JSON\n"
+"  -d            Run as print server, taking jobs on a Unix socket\n"
+"  -S socket     Print server socket (default $XDG_RUNTIME_DIR/qlprint.sock,\n"
+"                or /run/qlprint.sock);\n"
+"                without -d, send the image files there instead of printing\n"
+"  -o file       Write the printer commands to file (- for stdout) instead,\n"
+"                as for a QL-570 (QL-800 with -R) with the media requested\n"
+"                (default 62mm roll)\n"
 "  -m margin     Margin (dots)\n"
 "  -a            Enable auto-cut\n"
 "  -C            Request continuous-length-tape when printing (error if not)\n"
@@ -39,10 +387,34 @@ void syntax(void)
 "  -W width      Request particular width media when printing (error if not)\n"
 "  -L length     Request particular length media when printing (error if not)\n"
 "  -Q            Prioritise quality of speed\n"
+"  -c            Compress raster data, if supported by printer\n"
+"  -s            Show raster transfer statistics for each label\n"
 "  -n num        Print num copies\n"
 "  -t threshold  Threshold for black-vs-white (default 128, i.e. 0-127=black)\n"
-"  -x timeout    Time to wait for successful print, in seconds (default 5)\n"
-"  png...        One or more png files to print\n"
+"  -H dither     Dither gray instead: ordered, floyd-steinberg or atkinson\n"
+"                (default none); the threshold then sets the mid-gray point\n"
+"  -R            Print red as well as black, on black/red media (QL-800\n"
+"                series); dithering is not available for this\n"
+"  -r rotation   Rotate by 0, 90, 180 or 270 degrees clockwise, or auto\n"
+"                to turn images that only fit across the media when turned\n"
+"  -f            Scale to fit across the loaded media, keeping aspect ratio\n"
+"                (with -r auto, portrait images are turned to fit lengthwise)\n"
+"  -x timeout    Time to wait for successful print, in seconds (default 5,\n"
+"                0 to wait indefinitely)\n"
+"  -k kernel     Rasterisation kernel (default auto, i.e. best available)\n"
+"  -b bytes      Output chunk size, 0 for unbuffered (default 8192)\n"
+"  -j threads    Threads to rasterise labels on (default one per CPU)\n"
+"  -T template   Draw the labels from a template instead of image files,\n"
+"                one for each record given (or -n labels if none), with\n"
+"                the record's comma-separated fields filled in\n"
+"  -w spool      Write the labels to a spool file instead of printing them,\n"
+"                ready to send to the printer given (or as for -o if none)\n"
+"  -u spool      Print the labels in a spool file not yet printed, marking\n"
+"                each in the file as printed once the printer says so (with\n"
+"                -o, as the printer the spool was written for)\n"
+"  image...      One or more image files to print (PNG, PBM, PGM or QL\n"
+"                raster), or - for a stream of PNGs (or of raw frames) on\n"
+"                stdin, each printed once\n"
 "\n");
 
   exit(EXIT_FAILURE);
@@ -51,6 +423,8 @@ void syntax(void)
 int main (int argc, char *argv[])
 {
   bool info_only = false;
+  unsigned info_flags =
+    QL_DECODE_MODEL | QL_DECODE_MEDIA | QL_DECODE_ERROR | QL_DECODE_MODE;
   int32_t margin = -1;
   bool autocut = false;
   int num = 1;
@@ -58,18 +432,34 @@ int main (int argc, char *argv[])
     .threshold = 0x80,
     .flags = 0
   };
-  const char *printer = "/dev/usb/lp0";
+  char *printers[MAX_PRINTERS] = { "/dev/usb/lp0", };
+  unsigned num_printers = 0;
   unsigned timeout = 5;
+  const char *kernel = "auto";
+  bool show_stats = false;
+  int chunk = -1;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  bool serve = false;
+  const char *socket_path = NULL;
+  const char *output = NULL;
+  const char *template_path = NULL;
+  const char *spool_out = NULL, *spool_in = NULL;
   int opt;
-  while ((opt = getopt(argc, argv, "ip:m:an:CDW:L:Qx:")) != -1)
+  while ((opt = getopt(argc, argv, "iJp:m:an:CDW:L:Qcst:H:Rr:fx:k:b:j:dS:o:T:w:u:")) != -1)
   {
     switch(opt)
     {
       case 'i': info_only = true; break;
-      case 'p': printer = optarg; break;
+      case 'J': info_only = true; info_flags |= QL_DECODE_JSON; break;
+      case 'p': if (num_printers == MAX_PRINTERS)
+                  syntax();
+                printers[num_printers++] = optarg; break;
       case 'm': margin = atoi(optarg); break;
       case 'a': autocut = true; break;
-      case 'n': num = atoi(optarg); break;
+      case 'n': num = atoi(optarg);
+                if (num < 1)
+                  syntax();
+                break;
       case 'C': cfg.media_type = QL_MEDIA_TYPE_CONTINUOUS;
                 cfg.flags |= QL_PRINT_CFG_MEDIA_TYPE; break;
       case 'D': cfg.media_type = QL_MEDIA_TYPE_DIECUT_LABELS;
@@ -79,128 +469,401 @@ int main (int argc, char *argv[])
       case 'L': cfg.media_length = atoi(optarg);
                 cfg.flags |= QL_PRINT_CFG_MEDIA_LENGTH; break;
       case 'Q': cfg.flags |= QL_PRINT_CFG_QUALITY_PRIO; break;
+      case 'c': cfg.compress = true; break;
+      case 's': show_stats = true; break;
+      case 't': cfg.threshold = atoi(optarg); break;
+      case 'H': if (!ql_dither_by_name(optarg, &cfg.dither))
+                  syntax();
+                break;
+      case 'R': cfg.two_colour = true; break;
+      case 'r': if (!ql_rotate_by_name(optarg, &cfg.rotate))
+                  syntax();
+                break;
+      case 'f': cfg.fit = true; break;
       case 'x': timeout = atoi(optarg); break;
+      case 'k': kernel = optarg; break;
+      case 'b': chunk = atoi(optarg); break;
+      case 'j': threads = atoi(optarg);
+                if (threads < 1)
+                  syntax();
+                break;
+      case 'd': serve = true; break;
+      case 'S': socket_path = optarg; break;
+      case 'o': output = optarg; break;
+      case 'T': template_path = optarg; break;
+      case 'w': spool_out = optarg; break;
+      case 'u': spool_in = optarg; break;
       default: syntax();
     }
   }
 
-  if (optind >= argc && !info_only)
+  if (optind >= argc && !info_only && !serve && !template_path && !spool_in)
+    syntax();
+  if ((template_path || spool_out || spool_in) &&
+      (serve || socket_path || num_printers > 1 || info_only))
+    syntax(); // only ever here, for the one printer
+  if ((spool_out && output) ||
+      (spool_in && (optind < argc || template_path || spool_out)))
+    syntax();
+  // A lone "-" reads a stream of images from stdin, each printed once
+  const bool stream_in = !template_path && argc - optind == 1 &&
+    strcmp(argv[optind], "-") == 0;
+  if (stream_in && (num > 1 || serve || socket_path || num_printers > 1))
     syntax();
 
-  ql_ctx_t ctx = ql_open(printer);
-  if (!ctx)
+  if (socket_path && !serve && !info_only)
+    return jobserver_submit(socket_path, &cfg, num, argv + optind,
+      argc - optind);
+  if (!socket_path)
+    socket_path = jobserver_default_socket();
+
+  if (!ql_pack_select_kernel(kernel))
   {
-    fprintf(stderr, "Unable to open '%s': %s\n", printer, strerror(errno));
+    unsigned num_kernels;
+    const ql_pack_kernel_t *kernels = ql_pack_kernels(&num_kernels);
+    fprintf(stderr, "Unsupported kernel '%s', available:", kernel);
+    for (unsigned i = 0; i < num_kernels; ++i)
+      if (kernels[i].supported())
+        fprintf(stderr, " %s", kernels[i].name);
+    fprintf(stderr, "\n");
     return EXIT_FAILURE;
   }
 
-  if (!ql_init(ctx))
+  if (threads < 1)
+    threads = 1;
+  else if (threads > MAX_THREADS)
+    threads = MAX_THREADS;
+  ql_pack_set_threads(threads);
+
+  const bool printer_given = num_printers;
+  if (!num_printers)
+    num_printers = 1; // the default one
+  else if (num_printers > 1 && (info_only || serve || output))
+    syntax(); // only printing can use more than one printer
+
+  char **inputs = argv + optind; // image files, or template records
+  unsigned files = argc - optind;
+  static char *no_record[] = { "" };
+  if (template_path && !files)
   {
-    fprintf(stderr, "Failed to send initialisation sequence to printer: %s\n",
-      strerror(errno));
-    return EXIT_FAILURE;
+    inputs = no_record;
+    files = 1;
+  }
+  spool_t spool = NULL;
+  if (spool_in)
+  {
+    spool = spool_open(spool_in);
+    if (!spool)
+    {
+      fprintf(stderr, "Unable to open spool '%s': %s\n", spool_in,
+        errno == EINVAL ? "not a spool, or incomplete" : strerror(errno));
+      return EXIT_FAILURE;
+    }
+    num = 1;
+    files = spool_labels(spool) - spool_done(spool);
+    if (!files)
+    {
+      printf("All %u labels in '%s' already printed\n", spool_labels(spool),
+        spool_in);
+      spool_close(spool);
+      return EXIT_SUCCESS;
+    }
   }
 
-  if (!ql_request_status(ctx))
+  printer_setup_t setup = {
+    .margin = margin,
+    .autocut = autocut,
+    .autocut_every = (serve || num_printers > 1) ? 1 : files,
+    .chunk = chunk,
+    .two_colour = cfg.two_colour && !serve,
+    .fit = cfg.fit && !serve,
+    .delta = !spool &&
+      (serve || num_printers > 1 || num * files > 1 || stream_in),
+  };
+
+  if (num_printers > 1)
   {
-    fprintf(stderr, "Failed to request status from printer: %s\n",
-      strerror(errno));
-    return EXIT_FAILURE;
+    farm_t farm = farm_start(printers, num_printers, timeout,
+      open_farm_printer, &setup);
+    if (!farm)
+      return EXIT_FAILURE;
+    bool queued = true;
+    for (int copy = 0; copy < num && queued; ++copy)
+      for (int i = optind; i < argc && queued; ++i)
+        queued = farm_submit(farm, argv[i], &cfg);
+    if (!queued)
+      fprintf(stderr, "Out of memory!\n");
+    int ret = farm_finish(farm);
+    return queued ? ret : EXIT_FAILURE;
   }
 
   ql_status_t status = { 0, };
-  if (!ql_read_status(ctx, &status))
+  ql_status_t offline;
+  const bool emulated = output || (spool_out && !printer_given);
+  if (spool && emulated)
+    offline = *spool_status(spool); // as the printer it was spooled for
+  else if (emulated)
   {
-    fprintf(stderr, "Failed to read status from printer: %s\n",
-      strerror(errno));
-    return EXIT_FAILURE;
+    ql_emulated_status(&offline, cfg.two_colour ? '8' : '2', // QL-800/570
+      (cfg.flags & QL_PRINT_CFG_MEDIA_TYPE) ?
+        cfg.media_type : QL_MEDIA_TYPE_CONTINUOUS,
+      (cfg.flags & QL_PRINT_CFG_MEDIA_WIDTH) ? cfg.media_width : 62,
+      (cfg.flags & QL_PRINT_CFG_MEDIA_LENGTH) ?
+        cfg.media_length : QL_MEDIA_LENGTH_CONTINUOUS);
+  }
+  ql_ctx_t ctx = NULL;
+  if (spool_out && emulated)
+    status = offline; // nothing to open, just spooling for it
+  else
+  {
+    ctx = output ?
+      open_printer(output, &offline, &status, chunk) :
+      open_printer(printers[0], NULL, &status, chunk);
+    if (!ctx)
+      return EXIT_FAILURE;
+  }
+  if (output && strcmp(output, "-") == 0)
+  {
+    fflush(stdout);
+    dup2(STDERR_FILENO, STDOUT_FILENO); // stdout is for the printer commands
   }
-
-/*
-for (int i = 0; i < 32; ++i)
-  printf("%02hhx ", ((char *)&status)[i]);
-printf("\n");
-*/
 
   if (info_only)
   {
-    ql_decode_print_status(stdout, &status,
-      QL_DECODE_MODEL | QL_DECODE_MEDIA | QL_DECODE_ERROR | QL_DECODE_MODE);
+    ql_decode_print_status(stdout, &status, info_flags);
     return EXIT_SUCCESS;
   }
 
-  if (margin >= 0 && !ql_set_margin(ctx, (uint16_t)margin))
-  {
-    fprintf(stderr, "Failed to set margin: %s\n", strerror(errno));
+  if (spool_out ? !check_printer(&status, &setup) :
+      !setup_printer(ctx, &status, &setup))
     return EXIT_FAILURE;
+
+  if (serve)
+  {
+    int ret = jobserver_run(ctx, &status, socket_path, timeout,
+      reset_printer, &setup);
+    ql_close(ctx);
+    return ret;
   }
-  if (autocut &&
-      (!ql_set_mode(ctx, QL_MODE_AUTOCUT) ||
-       !ql_set_autocut_every_n(ctx, argc - optind)))
+
+  /* Labels are pipelined: while one is printing, the following ones are
+   * loaded and rasterised in parallel, and each is sent as soon as the
+   * printer is ready to receive it. Completions are reported as the
+   * printer signals them. Template labels are instead drawn one at a
+   * time, each once the one before has been sent. Spooled labels are sent
+   * from the spool as they are, and marked in it as printed.
+   */
+  unsigned total = stream_in ? UINT_MAX : num * files; // till stdin ends
+  ql_template_t tpl = NULL;
+  label_cache_t cache = NULL;
+  raster_pool_t pool = NULL;
+  loadpng_stream_t stream = NULL;
+  ql_arena_t arena = NULL;
+  ql_pack_opts_t opts;
+  ql_pack_opts(&opts, &cfg, &status);
+  if (template_path)
   {
-    fprintf(stderr, "Failed to set autocut: %s\n", strerror(errno));
-    return EXIT_FAILURE;
+    unsigned bad_line;
+    tpl = ql_template_load(template_path, ql_raster_line_bytes(&status),
+      &bad_line);
+    if (!tpl)
+    {
+      if (bad_line)
+        fprintf(stderr, "Bad template '%s', at line %u\n", template_path,
+          bad_line);
+      else
+        fprintf(stderr, "Unable to load template '%s': %s\n", template_path,
+          errno == EINVAL ? "no size given" : strerror(errno));
+      return EXIT_FAILURE;
+    }
+  }
+  else if (stream_in)
+  {
+    stream = loadpng_stream_open(STDIN_FILENO);
+    arena = ql_arena_create();
+    if (!stream || !arena)
+    {
+      fprintf(stderr, "Out of memory!\n");
+      return EXIT_FAILURE;
+    }
+  }
+  else if (!spool)
+  {
+    const unsigned ahead = threads * LABELS_AHEAD_PER_THREAD;
+    // Only worth holding on to every file if there's more than one copy
+    unsigned cached = num > 1 ?
+      (files < MAX_CACHED_LABELS ? files : MAX_CACHED_LABELS) : 0;
+    if (cached < ahead + 1)
+      cached = ahead + 1; // as many as can be held at once
+    cache = label_cache_create(cached);
+    pool = cache ? raster_pool_start(cache, threads, ahead, inputs, files,
+      total, ql_raster_line_bytes(&status), &opts) : NULL;
+    if (!pool)
+    {
+      fprintf(stderr, "Out of memory!\n");
+      return EXIT_FAILURE;
+    }
   }
+  label_source_t src = {
+    .inputs = inputs,
+    .files = files,
+    .pool = pool,
+    .cache = cache,
+    .tpl = tpl,
+    .spool = spool,
+    .stream = stream,
+    .arena = arena,
+    .line_bytes = ql_raster_line_bytes(&status),
+    .opts = opts,
+  };
 
-  if (ql_needs_mode_switch(&status) && !ql_switch_to_raster_mode(ctx))
+  if (spool_out)
   {
-    fprintf(stderr, "Failed to set raster mode: %s\n", strerror(errno));
-    return EXIT_FAILURE;
+    int ret = write_spool(spool_out, &status, &cfg, &src, total);
+    if (pool)
+    {
+      raster_pool_stop(pool);
+      label_cache_destroy(cache);
+    }
+    ql_template_destroy(tpl);
+    loadpng_stream_close(stream);
+    ql_arena_destroy(arena);
+    if (ctx)
+      ql_close(ctx);
+    return ret;
   }
 
-  signal(SIGALRM, on_alarm);
-  while (num--)
+  label_t ring[MAX_IN_FLIGHT + 1] = { { 0, }, };
+  unsigned sent = 0, done = 0;
+  unsigned long long lines = 0, reused = 0;
+  bool can_send = true, printing = false;
+  bool to_read = false; // the next label from stdin, once it's there
+  bool loaded = prepare_label(&ring[0], &src, 1);
+  if (src.ended)
+    total = 0;
+  while (done < total)
   {
-    cfg.first_page = true;
-    for (int i = optind; i < argc; ++i)
+    if (to_read && (done == sent || stream_ready(stream, ctx)))
     {
-      ql_raster_image_t *img = loadpng(argv[i]);
-      if (!img)
+      loaded = prepare_label(&ring[sent % (MAX_IN_FLIGHT + 1)], &src,
+        sent + 1);
+      to_read = false;
+      if (src.ended)
+        total = sent;
+      continue;
+    }
+
+    if (!to_read && sent < total && can_send && sent - done < MAX_IN_FLIGHT)
+    {
+      label_t *label = &ring[sent % (MAX_IN_FLIGHT + 1)];
+      if (!loaded)
       {
-        fprintf(stderr, "Failed to load image '%s'\n", argv[i]);
-        return EXIT_FAILURE;
+        if (sent == done)
+        {
+          if (tpl)
+            fprintf(stderr, "Failed to draw label '%s': %s\n", label->path,
+              strerror(errno));
+          else
+            fprintf(stderr, "Failed to load image '%s'\n", label->path);
+          return EXIT_FAILURE;
+        }
+        can_send = false; // let the ones in flight finish first
+        continue;
       }
-/*
-for(int i = 0; i < img->height; ++i)
-{
-  for(int j = 0; j < img->width; ++j)
-    printf("%c", img->data[i*img->width + j] < cfg.threshold ? '#' : '.');
-  printf("\n");
-}
-*/
-      if (!ql_print_raster_image(ctx, &status, img, &cfg))
+
+      if (spool)
       {
-        fprintf(stderr, "Failed to print '%s' (%ux%u)\n",
-          argv[i], img->width, img->height);
-        return EXIT_FAILURE;
-      }
-      alarm(timeout);
-      do {
-        if (!ql_read_status(ctx, &status))
+        label->cfg.first_page |= sent == 0; // perhaps picking up part way
+        if (!ql_print_encoded_image(ctx, &status, &label->encoded,
+              &label->cfg))
         {
-          if (!timed_out) // try again, soon
-          {
-            usleep(50);
-            continue;
-          }
-          fprintf(stderr, "Printer stopped responding!\n");
+          fprintf(stderr, "Failed to print '%s' (%ux%u) from spool: %s\n",
+            label->path, label->width, label->height, errno == EINVAL ?
+              "spooled for a different printer" : strerror(errno));
           return EXIT_FAILURE;
         }
-        if (status.err_info_1 || status.err_info_2)
+      }
+      else
+      {
+        cfg.first_page = (sent % files) == 0;
+        if (!label->packed ||
+            !ql_print_packed_image(ctx, &status, label->packed, &cfg))
         {
-          fprintf(stderr, "Printer reported error(s): %s\n",
-            ql_decode_errors(&status));
+          fprintf(stderr, "Failed to print '%s' (%ux%u)\n",
+            label->path, label->width, label->height);
           return EXIT_FAILURE;
         }
-      } while (status.status_type != QL_STATUS_TYPE_PRINTING_DONE);
-      alarm(0);
+      }
+      label->stats = *ql_last_print_stats(ctx);
+      label_cache_put(cache, label->entry);
+      label->entry = NULL;
+      label->packed = NULL;
+      ++sent;
+      can_send = printing = false;
+
+      if (sent < total && stream)
+        to_read = true; // not waiting on stdin while there are statuses
+      else if (sent < total) // the next one, likely ready while this prints
+      {
+        loaded = prepare_label(&ring[sent % (MAX_IN_FLIGHT + 1)], &src,
+          sent + 1);
+        if (src.ended)
+          total = sent;
+      }
+      continue;
+    }
+
+    if (!wait_for_status(ctx, &status, timeout))
+      return EXIT_FAILURE;
 
-      printf("%s (%ux%u) OK\n", argv[i], img->width, img->height);
+    if (status.status_type == QL_STATUS_TYPE_PRINTING_DONE && done < sent)
+    {
+      const label_t *label = &ring[done % (MAX_IN_FLIGHT + 1)];
+      if (spool && !spool_mark_done(spool, label->spooled))
+      {
+        fprintf(stderr, "Failed to mark '%s' printed in spool: %s\n",
+          label->path, strerror(errno));
+        return EXIT_FAILURE;
+      }
+      report_label(label, show_stats);
+      lines += label->stats.lines;
+      reused += label->stats.reused_lines;
+      if (++done == sent)
+        can_send = true;
+    }
+    else if (status.status_type == QL_STATUS_TYPE_PHASE_CHANGE)
+    {
+      if (status.phase_type == QL_PHASE_TYPE_PRINTING)
+        printing = true;
+      else if (status.phase_type == QL_PHASE_TYPE_RECEIVING && printing)
+        can_send = true;
+    }
+  }
 
-      free(img);
-      cfg.first_page = false;
+  if (show_stats)
+  {
+    const ql_io_stats_t *io = ql_io_stats(ctx);
+    printf("I/O: %llu bytes in %llu flushes, %llu syscalls\n",
+      (unsigned long long)io->bytes, (unsigned long long)io->flushes,
+      (unsigned long long)io->syscalls);
+    printf("Lines: %llu sent, %llu reused from the label before (%u%%)\n",
+      lines, reused, lines ? (unsigned)(100 * reused / lines) : 0);
+    if (cache)
+    {
+      unsigned hits, misses;
+      label_cache_stats(cache, &hits, &misses);
+      printf("Labels: %u rasterised, %u reused\n", misses, hits);
     }
   }
+  if (pool)
+  {
+    raster_pool_stop(pool);
+    label_cache_destroy(cache);
+  }
+  ql_template_destroy(tpl);
+  spool_close(spool);
+  loadpng_stream_close(stream);
+  ql_arena_destroy(arena);
 
   ql_close(ctx);
 
@@ -6,41 +6,120 @@
  * @author Johny Mattsson <jmattsson@dius.com.au>
  */
 #include "ql.h"
+#include "arena.h"
+#include "raster.h"
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define OFFLINE_QUEUE_LEN 16
+
+// The last label sent, for delta sending
+typedef struct
+{
+  bool enabled;
+  uint16_t line_bytes;
+  uint8_t planes;
+  bool compress;
+  unsigned lines; // valid in raw[], enc[] and enc_len[]
+  size_t cap_lines, stride, slot; // as allocated
+  uint8_t *raw;      // the lines as packed
+  uint8_t *enc;      // the blocks sent for each, in slots; NULL if none
+  uint16_t *enc_len; // 0 for lines sent as 'Z'
+} delta_t;
 
 struct ql_ctx
 {
   char *printer;
   int fd;
+  ql_print_stats_t stats;
+  ql_io_stats_t io;
+  ql_arena_t arena; // for packing in ql_print_raster_image(), made on first use
+  uint8_t *obuf; // output gathered here until chunk size reached, or flush
+  size_t olen;
+  size_t ochunk;
+  uint8_t sbuf[32]; // status reply being reassembled
+  unsigned slen;
+  struct timespec deadline; // for the next status, if armed
+  bool deadline_armed;
+  bool offline; // writing to a file, status replies are made up
+  ql_status_t offline_status;
+  uint8_t offline_queue[OFFLINE_QUEUE_LEN][2]; // status type, phase type
+  unsigned offline_head, offline_len;
+  delta_t delta;
 };
 
 #define ESC 0x1b
 
-#define NUM_STATUS_READ_RETRIES 100
+#define STATUS_READ_TIMEOUT_MS 2000 // for ql_read_status() without a deadline
 
-#define full_write(fd, buf) (retry_write(fd, buf, sizeof(buf)) == (ssize_t)sizeof(buf))
+#define DEFAULT_OUTPUT_CHUNK 8192 // usblp hands at most this much to the device at once
 
-ssize_t retry_write(int fd, const char *buf, size_t len)
+#define full_write(ctx, buf) buffered_write(ctx, buf, sizeof(buf))
+
+// Writes all of iov[], retrying partial writes
+static bool retry_writev(ql_ctx_t ctx, struct iovec *iov, int iovcnt)
 {
-  size_t written = 0;
-  while (written != len)
+  while (iovcnt)
   {
-    ssize_t n = write(fd, buf + written, len - written);
+    ssize_t n = writev(ctx->fd, iov, iovcnt);
+    ++ctx->io.syscalls;
     if (n == -1)
     {
       if (errno == EAGAIN || errno == EINTR)
         continue;
       else
-        break;
+        return false;
     }
-    else
-      written += n;
+    ctx->io.bytes += n;
+    while (iovcnt && (size_t)n >= iov->iov_len)
+    {
+      n -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if (iovcnt)
+    {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return true;
+}
+
+
+// Sends whatever is buffered plus (optionally) buf, in one go
+static bool flush_with(ql_ctx_t ctx, const void *buf, size_t len)
+{
+  struct iovec iov[2];
+  int iovcnt = 0;
+  if (ctx->olen)
+    iov[iovcnt++] = (struct iovec){ .iov_base = ctx->obuf, .iov_len = ctx->olen };
+  if (len)
+    iov[iovcnt++] = (struct iovec){ .iov_base = (void *)buf, .iov_len = len };
+  if (!iovcnt)
+    return true;
+
+  ++ctx->io.flushes;
+  ctx->olen = 0;
+  return retry_writev(ctx, iov, iovcnt);
+}
+
+
+static bool buffered_write(ql_ctx_t ctx, const void *buf, size_t len)
+{
+  if (ctx->olen + len <= ctx->ochunk)
+  {
+    memcpy(ctx->obuf + ctx->olen, buf, len);
+    ctx->olen += len;
+    return true;
   }
-  return written;
+  return flush_with(ctx, buf, len);
 }
 
 
@@ -50,87 +129,331 @@ ql_ctx_t ql_open(const char *printer)
   if (fd < 0)
     return NULL;
 
-  ql_ctx_t ctx = malloc(sizeof(struct ql_ctx));
+  ql_ctx_t ctx = ql_calloc(1, sizeof(struct ql_ctx));
   if (!ctx)
     return NULL;
-  ctx->printer = strdup(printer);
+  ctx->printer = ql_strdup(printer);
   ctx->fd = fd;
 
+  if (!ql_set_output_chunk(ctx, DEFAULT_OUTPUT_CHUNK))
+  {
+    ql_close(ctx);
+    return NULL;
+  }
+
   const char clear[200] = { 0, };
-  (void)full_write(fd, clear); // recommended to clear old/errored jobs
+  (void)full_write(ctx, clear); // recommended to clear old/errored jobs
+  (void)ql_flush(ctx);
 
   return ctx;
 }
 
+ql_ctx_t ql_open_output(const char *path, const ql_status_t *as_printer)
+{
+  int fd = strcmp(path, "-") == 0 ?
+    dup(STDOUT_FILENO) : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    return NULL;
+
+  ql_ctx_t ctx = ql_calloc(1, sizeof(struct ql_ctx));
+  if (!ctx)
+  {
+    close(fd);
+    return NULL;
+  }
+  ctx->printer = ql_strdup(path);
+  ctx->fd = fd;
+  ctx->offline = true;
+  ctx->offline_status = *as_printer;
+  ctx->offline_status.status_type = QL_STATUS_TYPE_REPLY;
+  ctx->offline_status.phase_type = QL_PHASE_TYPE_RECEIVING;
+
+  if (!ql_set_output_chunk(ctx, DEFAULT_OUTPUT_CHUNK))
+  {
+    ql_close(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+
+void ql_emulated_status(ql_status_t *status, uint8_t model_code, uint8_t media_type, uint8_t media_width_mm, uint8_t media_length_mm)
+{
+  *status = (ql_status_t){
+    .print_head_mark = 0x80,
+    .sz = 0x20,
+    .rsvd_2 = 'B',
+    .model_class = '4',
+    .model_code = model_code,
+    .rsvd_5 = '0',
+    .rsvd_6 = '0',
+    .media_width_mm = media_width_mm,
+    .media_type = media_type,
+    .rsvd_14 = 0x3f,
+    .media_length_mm = media_length_mm,
+  };
+}
+
+
+// Queues a made-up status reply on an offline context
+static void offline_reply(ql_ctx_t ctx, uint8_t status_type, uint8_t phase_type)
+{
+  if (ctx->offline_len == OFFLINE_QUEUE_LEN)
+  {
+    ctx->offline_head = (ctx->offline_head + 1) % OFFLINE_QUEUE_LEN;
+    --ctx->offline_len; // nobody's reading them, drop the oldest
+  }
+  uint8_t *q = ctx->offline_queue[
+    (ctx->offline_head + ctx->offline_len++) % OFFLINE_QUEUE_LEN];
+  q[0] = status_type;
+  q[1] = phase_type;
+}
+
+
 void ql_close(ql_ctx_t ctx)
 {
-  free(ctx->printer);
+  (void)ql_flush(ctx);
+  ql_arena_destroy(ctx->arena);
+  ql_set_delta(ctx, false);
+  ql_free(ctx->obuf);
+  ql_free(ctx->printer);
   close(ctx->fd);
-  free(ctx);
+  ql_free(ctx);
+}
+
+
+bool ql_set_output_chunk(ql_ctx_t ctx, size_t bytes)
+{
+  if (!ql_flush(ctx))
+    return false;
+  uint8_t *obuf = bytes ? ql_malloc(bytes) : NULL;
+  if (bytes && !obuf)
+    return false;
+  ql_free(ctx->obuf);
+  ctx->obuf = obuf;
+  ctx->ochunk = bytes;
+  return true;
+}
+
+
+bool ql_flush(ql_ctx_t ctx)
+{
+  return flush_with(ctx, NULL, 0);
+}
+
+
+const ql_io_stats_t *ql_io_stats(ql_ctx_t ctx)
+{
+  return &ctx->io;
 }
 
 bool ql_init(ql_ctx_t ctx)
 {
   const char init[] = { ESC, '@' };
-  return full_write(ctx->fd, init);
+  return full_write(ctx, init);
 }
 
 
 bool ql_request_status(ql_ctx_t ctx)
 {
   const char status_req[] = { ESC, 'i', 'S' };
-  return full_write(ctx->fd, status_req);
+  if (ctx->offline)
+    offline_reply(ctx, QL_STATUS_TYPE_REPLY, QL_PHASE_TYPE_RECEIVING);
+  return full_write(ctx, status_req);
 }
 
 
-bool ql_read_status(ql_ctx_t ctx, ql_status_t *status)
+int ql_status_fd(ql_ctx_t ctx)
 {
-  for (int i = 0; i < NUM_STATUS_READ_RETRIES; ++i)
+  return ctx->offline ? -1 : ctx->fd;
+}
+
+
+void ql_set_status_timeout(ql_ctx_t ctx, unsigned timeout_ms)
+{
+  ctx->deadline_armed = timeout_ms != 0;
+  if (!timeout_ms)
+    return; // wait as long as it takes
+  clock_gettime(CLOCK_MONOTONIC, &ctx->deadline);
+  ctx->deadline.tv_sec += timeout_ms / 1000;
+  ctx->deadline.tv_nsec += (timeout_ms % 1000) * 1000000l;
+  if (ctx->deadline.tv_nsec >= 1000000000l)
   {
-    int ret = read(ctx->fd, status, sizeof(*status));
-    if (ret == 32)
-      return true;
-    else if ( (ret == 0) // "no data yet, too bad we just eof'd your fd, sucker"
-           || (ret == -1 && errno == EBADF)) // in case we messed up, somehow
+    ++ctx->deadline.tv_sec;
+    ctx->deadline.tv_nsec -= 1000000000l;
+  }
+}
+
+
+int ql_status_timeout_ms(ql_ctx_t ctx)
+{
+  if (!ctx->deadline_armed)
+    return -1;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long long ms = (ctx->deadline.tv_sec - now.tv_sec) * 1000ll +
+    (ctx->deadline.tv_nsec - now.tv_nsec + 999999l) / 1000000l;
+  return ms > 0 ? (ms < INT32_MAX ? (int)ms : INT32_MAX) : 0;
+}
+
+
+bool ql_poll_status(ql_ctx_t ctx, ql_status_t *status)
+{
+  if (!ql_flush(ctx))
+    return false;
+
+  if (ctx->offline)
+  {
+    if (!ctx->offline_len)
     {
-      close(ctx->fd);
-      ctx->fd = open(ctx->printer, O_RDWR);
-      if (ctx->fd < 0)
+      errno = ETIME; // nothing more is coming
+      return false;
+    }
+    const uint8_t *q = ctx->offline_queue[ctx->offline_head];
+    ctx->offline_head = (ctx->offline_head + 1) % OFFLINE_QUEUE_LEN;
+    --ctx->offline_len;
+    *status = ctx->offline_status;
+    status->status_type = q[0];
+    status->phase_type = q[1];
+    ctx->deadline_armed = false;
+    return true;
+  }
+
+  struct pollfd pfd = { .fd = ctx->fd, .events = POLLIN };
+  while (ctx->slen < sizeof(ctx->sbuf))
+  {
+    int ret = poll(&pfd, 1, 0);
+    if (ret == -1 && errno == EINTR)
+      continue;
+    if (ret == -1)
+      return false;
+    if (ret == 0 || !(pfd.revents & POLLIN))
+    {
+      if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+      {
+        errno = EPIPE;
         return false;
+      }
+      break; // nothing more for now
     }
-    else if (ret == -1 && (errno != EAGAIN || errno != EINTR))
-      return false; // non-recoverable
+
+    // Only ever take what's left of this reply, the next one may follow
+    ssize_t n = read(ctx->fd, ctx->sbuf + ctx->slen, sizeof(ctx->sbuf) - ctx->slen);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+      continue;
+    if (n == -1)
+      return false;
+    if (n == 0)
+      break; // usblp signals "no data yet" this way
+    ctx->slen += n;
   }
-  errno = ETIME;
+
+  if (ctx->slen == sizeof(ctx->sbuf))
+  {
+    memcpy(status, ctx->sbuf, sizeof(ctx->sbuf));
+    ctx->slen = 0;
+    ctx->deadline_armed = false;
+    return true;
+  }
+
+  errno = (ql_status_timeout_ms(ctx) == 0) ? ETIME : EAGAIN;
   return false;
 }
 
 
+// Waits (without spinning) until a status arrives or the deadline passes
+static bool wait_armed_status(ql_ctx_t ctx, ql_status_t *status)
+{
+  while (!ql_poll_status(ctx, status))
+  {
+    if (errno != EAGAIN)
+      return false;
+    struct pollfd pfd = { .fd = ctx->fd, .events = POLLIN };
+    if (poll(&pfd, 1, ql_status_timeout_ms(ctx)) == -1 && errno != EINTR)
+      return false;
+  }
+  return true;
+}
+
+
+bool ql_read_status(ql_ctx_t ctx, ql_status_t *status)
+{
+  if (!ctx->deadline_armed)
+    ql_set_status_timeout(ctx, STATUS_READ_TIMEOUT_MS);
+  return wait_armed_status(ctx, status);
+}
+
+
+bool ql_wait_status(ql_ctx_t ctx, ql_status_t *status, unsigned timeout)
+{
+  ql_set_status_timeout(ctx, timeout * 1000);
+  return wait_armed_status(ctx, status);
+}
+
+
 bool ql_set_mode(ql_ctx_t ctx, unsigned mode)
 {
   char cmd[] = { ESC, 'i', 'M', mode };
-  return full_write(ctx->fd, cmd);
+  return full_write(ctx, cmd);
 }
 
 
 bool ql_set_expanded_mode(ql_ctx_t ctx, unsigned mode)
 {
   char cmd[] = { ESC, 'i', 'K', mode };
-  return full_write(ctx->fd, cmd);
+  return full_write(ctx, cmd);
 }
 
 
 bool ql_set_autocut_every_n(ql_ctx_t ctx, uint8_t n)
 {
   char cmd[] = { ESC, 'i', 'A', n };
-  return full_write(ctx->fd, cmd);
+  return full_write(ctx, cmd);
 }
 
 
 bool ql_set_margin(ql_ctx_t ctx, uint16_t dots)
 {
   char cmd[] = { ESC, 'i', 'd', dots & 0xff, dots >> 8};
-  return full_write(ctx->fd, cmd);
+  return full_write(ctx, cmd);
+}
+
+
+bool ql_set_compression(ql_ctx_t ctx, unsigned mode)
+{
+  char cmd[] = { 'M', mode };
+  return full_write(ctx, cmd);
+}
+
+
+bool ql_supports_compression(const ql_status_t *status)
+{
+  switch(status->model_code)
+  {
+    case 'O': case '1': case 'Q': // QL-500/550, QL-560, QL-650TD
+      return false;
+    default: break;
+  }
+  return true;
+}
+
+
+bool ql_supports_zero_lines(const ql_status_t *status)
+{
+  // 'Z' is documented alongside compression, assume same model support
+  return ql_supports_compression(status);
+}
+
+
+bool ql_supports_two_colour(const ql_status_t *status)
+{
+  switch(status->model_code)
+  {
+    case '8': case '9': case 'A': // QL-800, QL-810W, QL-820NWB
+      return true;
+    default: break;
+  }
+  return false;
 }
 
 
@@ -140,6 +463,7 @@ bool ql_needs_mode_switch(const ql_status_t *status)
   {
     case '3': case '4':
     case 'P': case 'Q':
+    case '8': case '9': case 'A':
       return true;
     default: break;
   }
@@ -153,85 +477,452 @@ bool ql_switch_to_raster_mode(ql_ctx_t ctx)
   #define MODE_RASTER 1
   #define MODE_P_TOUCH_TEMPLATE 3
   char cmd[] = { ESC, 'i', 'a', MODE_RASTER };
-  return full_write(ctx->fd, cmd);
+  return full_write(ctx, cmd);
 }
 
 
-static void pack_column(uint8_t *out, uint16_t bytes, uint16_t colno, const ql_raster_image_t *img, uint8_t black_below_v)
+unsigned ql_raster_line_bytes(const ql_status_t *status)
 {
-  for (unsigned n = 0; n < bytes; ++n, ++out)
+  if (status->model_code == 'P' || status->model_code == '4')
+    return 162; // 1296 pixels
+  return 90; // default raster transmission block size (720 pixels)
+}
+
+
+unsigned ql_media_dots(const ql_status_t *status)
+{
+  // Die-cut round labels leave more unprintable
+  if (status->media_width_mm == 12 &&
+      (status->media_type == QL_MEDIA_TYPE_DIECUT_LABELS ||
+       status->media_type == QL_MEDIA_TYPE_DIECUT_LABELS_ALT))
+    return 94;
+
+  static const uint8_t widths[] =
+    { 12,  17,  23,  24,  29,  38,  50,  52,  54,  58,  62, 102 };
+  static const uint16_t dots[] =
+    { 106, 165, 202, 236, 306, 413, 554, 578, 590, 618, 696, 1164 };
+  for (unsigned i = 0; i < sizeof(widths); ++i)
+    if (widths[i] == status->media_width_mm)
+      return dots[i] <= ql_raster_line_bytes(status) * 8 ? dots[i] : 0;
+  return 0;
+}
+
+
+static bool line_is_blank(const uint8_t *line, unsigned len)
+{
+  for (unsigned i = 0; i < len; ++i)
+    if (line[i])
+      return false;
+  return true;
+}
+
+
+// PackBits encoding; out needs room for len + (len + 127) / 128 bytes
+static unsigned packbits(uint8_t *out, const uint8_t *in, unsigned len)
+{
+  uint8_t *o = out;
+  unsigned i = 0;
+  while (i < len)
   {
-    *out = 0;
-    for (unsigned i = 0; i < 8; ++i)
+    unsigned run = 1;
+    while (i + run < len && run < 128 && in[i + run] == in[i])
+      ++run;
+    if (run > 1)
+    {
+      *o++ = (uint8_t)(257 - run); // i.e. -(run - 1)
+      *o++ = in[i];
+      i += run;
+      continue;
+    }
+
+    // Literal, up until the next run worth breaking it for
+    unsigned start = i;
+    while (i < len && i - start < 128)
     {
-      unsigned img_row = n * 8 + i;
-      if (img_row < img->height)
-        if (img->data[img_row * img->width +  colno] < black_below_v)
-          *out |= 1 << (7 - i);
+      if (i + 2 < len && in[i] == in[i + 1] && in[i] == in[i + 2])
+        break;
+      ++i;
     }
-//for(int i = 7; i >= 0; --i) fprintf(stderr, "%c", (*out & (1<<i)) ? '#' : '.');
+    *o++ = i - start - 1;
+    memcpy(o, in + start, i - start);
+    o += i - start;
   }
-//fprintf(stderr,"\n");
+  return o - out;
+}
+
+
+// Widest print head, 1296 dots, and PackBits at its worst on that
+#define MAX_LINE_BYTES 162
+#define MAX_BLOCK (3 + MAX_LINE_BYTES + (MAX_LINE_BYTES + 127) / 128)
+
+// Encodes one raster line as a 'g' (or two-colour 'w') block; its length
+static unsigned raster_block(uint8_t *block, char cmd, uint8_t arg, const uint8_t *line, unsigned dn, bool compress)
+{
+  unsigned len = dn;
+  if (compress)
+    len = packbits(block + 3, line, dn);
+  else
+    memcpy(block + 3, line, dn);
+  block[0] = cmd; block[1] = arg; block[2] = len;
+  return len + 3;
+}
+
+
+static void delta_release(delta_t *d)
+{
+  ql_free(d->raw);
+  ql_free(d->enc);
+  ql_free(d->enc_len);
+  d->raw = d->enc = NULL;
+  d->enc_len = NULL;
+  d->lines = d->cap_lines = 0;
+}
+
+
+void ql_set_delta(ql_ctx_t ctx, bool enabled)
+{
+  if (!enabled)
+    delta_release(&ctx->delta);
+  ctx->delta.enabled = enabled;
+}
+
+
+/* Readies the copy of the last label for comparing with img, forgetting it
+ * if sent differently; NULL if delta sending is off (or out of memory)
+ */
+static delta_t *delta_begin(ql_ctx_t ctx, const ql_packed_image_t *img, bool compress)
+{
+  delta_t *d = &ctx->delta;
+  if (!d->enabled)
+    return NULL;
+  const size_t stride = (size_t)img->line_bytes * img->planes;
+  const size_t slot =
+    img->planes * (3 + img->line_bytes + (img->line_bytes + 127) / 128);
+  if (d->line_bytes != img->line_bytes || d->planes != img->planes ||
+      d->compress != compress)
+    d->lines = 0;
+  if (img->lines > d->cap_lines || stride != d->stride || slot != d->slot)
+  {
+    delta_release(d);
+    d->raw = ql_malloc(img->lines * stride);
+    d->enc = ql_malloc(img->lines * slot);
+    d->enc_len = ql_malloc(img->lines * sizeof(uint16_t));
+    if (!d->raw || !d->enc || !d->enc_len)
+    {
+      delta_release(d);
+      return NULL;
+    }
+    d->cap_lines = img->lines;
+    d->stride = stride;
+    d->slot = slot;
+  }
+  d->line_bytes = img->line_bytes;
+  d->planes = img->planes;
+  d->compress = compress;
+  return d;
 }
 
 
 bool ql_print_raster_image(ql_ctx_t ctx, const ql_status_t *status, const ql_raster_image_t *img, const ql_print_cfg_t *cfg)
 {
-  unsigned dn = 90; // default raster transmission block size (720 pixels)
-  if (status->model_code == 'P' || status->model_code == '4')
-    dn = 162; // 1296 pixels
+  ql_pack_opts_t opts;
+  ql_pack_opts(&opts, cfg, status);
+  if (!ctx->arena && !(ctx->arena = ql_arena_create()))
+    return false;
+  // Packed into the context's arena, reused from one image to the next
+  ql_packed_image_t *packed =
+    ql_pack_image_arena(img, ql_raster_line_bytes(status), &opts, ctx->arena);
+  bool ok = packed && ql_print_packed_image(ctx, status, packed, cfg);
+  ql_arena_reset(ctx->arena);
+  return ok; // if not packed, image too wide for printer (or out of memory)
+}
+
 
-  if (img->height > dn * 8)
-    return false; // image too wide for printer
+// Checks an image was packed for the printer's print head (and colours)
+static bool check_image(const ql_status_t *status, uint16_t line_bytes, uint8_t planes)
+{
+  if (line_bytes != ql_raster_line_bytes(status))
+  {
+    errno = EINVAL; // packed for a different print head
+    return false;
+  }
+  if (planes == 2 && !ql_supports_two_colour(status))
+  {
+    errno = ENOTSUP;
+    return false;
+  }
+  return true;
+}
 
+
+// The print information, and the modes the raster lines are sent in
+static bool send_print_info(ql_ctx_t ctx, uint16_t lines, bool two_colour, bool compress, const ql_print_cfg_t *cfg)
+{
   char print_info[] = { ESC, 'i', 'z',
     cfg->flags | 0x80,
     (cfg->flags & QL_PRINT_CFG_MEDIA_TYPE) ? cfg->media_type : 0,
     (cfg->flags & QL_PRINT_CFG_MEDIA_WIDTH) ? cfg->media_width : 0,
     (cfg->flags & QL_PRINT_CFG_MEDIA_LENGTH) ? cfg->media_length : 0,
-    img->width & 0xff, img->width >> 8, 0, 0,
+    lines & 0xff, lines >> 8, 0, 0,
     cfg->first_page ? 0 : 1, 0 };
-  if (!full_write(ctx->fd, print_info))
+  if (!full_write(ctx, print_info))
     return false;
 
-  for (unsigned w = 0; w < img->width; ++w)
+  if (two_colour && !ql_set_expanded_mode(ctx, QL_EXPANDED_MODE_TWO_COLOUR))
+    return false;
+
+  return !compress || ql_set_compression(ctx, QL_COMPRESSION_PACKBITS);
+}
+
+
+static bool send_print_end(ql_ctx_t ctx)
+{
+  char done[] = { 0x1a }; // print with feeding
+  if (!full_write(ctx, done) || !ql_flush(ctx))
+    return false;
+  if (ctx->offline)
   {
-    char block[dn + 3];
-    block[0] = 'g'; block[1] = 0; block[2] = dn;
-    pack_column((uint8_t *)block+3, dn, w, img, cfg->threshold);
-    if (!full_write(ctx->fd, block))
+    offline_reply(ctx, QL_STATUS_TYPE_PHASE_CHANGE, QL_PHASE_TYPE_PRINTING);
+    offline_reply(ctx, QL_STATUS_TYPE_PRINTING_DONE, QL_PHASE_TYPE_PRINTING);
+    offline_reply(ctx, QL_STATUS_TYPE_PHASE_CHANGE, QL_PHASE_TYPE_RECEIVING);
+  }
+  return true;
+}
+
+
+// A line's 'g' block, or black and red 'w' blocks; their length
+static unsigned encode_line(uint8_t *block, const uint8_t *line, unsigned dn, bool two_colour, bool compress)
+{
+  if (!two_colour)
+    return raster_block(block, 'g', 0, line, dn, compress);
+  // Black (high energy) first, then red
+  unsigned len = raster_block(block, 'w', 1, line, dn, compress);
+  return len + raster_block(block + len, 'w', 2, line + dn, dn, compress);
+}
+
+
+bool ql_print_packed_image(ql_ctx_t ctx, const ql_status_t *status, const ql_packed_image_t *img, const ql_print_cfg_t *cfg)
+{
+  if (!check_image(status, img->line_bytes, img->planes))
+    return false;
+  const unsigned dn = img->line_bytes;
+  const bool two_colour = img->planes == 2;
+  const bool compress = cfg->compress && ql_supports_compression(status);
+  if (!send_print_info(ctx, img->lines, two_colour, compress, cfg))
+    return false;
+
+  // Not documented for two-colour, where a blank line compresses well anyway
+  bool zero_lines = ql_supports_zero_lines(status) && !two_colour;
+
+  ctx->stats.lines = img->lines;
+  ctx->stats.raster_bytes = img->lines * img->planes * (dn + 3);
+  ctx->stats.sent_bytes = 0;
+  ctx->stats.blank_lines = 0;
+  ctx->stats.reused_lines = 0;
+
+  delta_t *d = delta_begin(ctx, img, compress);
+  const size_t stride = (size_t)dn * img->planes;
+  uint8_t blocks[2 * MAX_BLOCK];
+  const uint8_t *line = img->data;
+  for (unsigned w = 0; w < img->lines; ++w, line += stride)
+  {
+    bool same = false;
+    if (d)
+    {
+      uint8_t *prev = d->raw + w * stride;
+      same = w < d->lines && memcmp(prev, line, stride) == 0;
+      if (!same)
+        memcpy(prev, line, stride);
+    }
+
+    if (zero_lines && (img->ink ? !img->ink[w] : line_is_blank(line, dn)))
+    {
+      char zero[] = { 'Z' };
+      if (!full_write(ctx, zero))
+        return false;
+      ctx->stats.sent_bytes += sizeof(zero);
+      ++ctx->stats.blank_lines;
+      if (d)
+        d->enc_len[w] = 0;
+      continue;
+    }
+
+    uint8_t *block = d ? d->enc + w * d->slot : blocks;
+    unsigned len;
+    if (same && d->enc_len[w])
+    {
+      len = d->enc_len[w];
+      ++ctx->stats.reused_lines;
+    }
+    else
+    {
+      len = encode_line(block, line, dn, two_colour, compress);
+      if (d)
+        d->enc_len[w] = len;
+    }
+    if (!buffered_write(ctx, block, len))
       return false;
+    ctx->stats.sent_bytes += len;
   }
+  if (d)
+    d->lines = img->lines;
 
-  char done[] = { 0x1a }; // print with feeding
-  return full_write(ctx->fd, done);
+  return send_print_end(ctx);
 }
 
 
-const char *ql_decode_model(const ql_status_t *status)
+size_t ql_encoded_max(const ql_packed_image_t *img)
 {
-  switch(status->model_code)
+  const size_t dn = img->line_bytes;
+  return img->lines * img->planes * (3 + dn + (dn + 127) / 128);
+}
+
+
+bool ql_encode_packed_image(const ql_status_t *status, const ql_packed_image_t *img, const ql_print_cfg_t *cfg, uint8_t *buf, ql_encoded_image_t *enc)
+{
+  if (!check_image(status, img->line_bytes, img->planes))
+    return false;
+  const unsigned dn = img->line_bytes;
+  const bool two_colour = img->planes == 2;
+  *enc = (ql_encoded_image_t){
+    .lines = img->lines,
+    .line_bytes = dn,
+    .planes = img->planes,
+    .compressed = cfg->compress && ql_supports_compression(status),
+    .zero_lines = ql_supports_zero_lines(status) && !two_colour,
+    .data = buf,
+  };
+
+  uint8_t *out = buf;
+  const size_t stride = (size_t)dn * img->planes;
+  const uint8_t *line = img->data;
+  for (unsigned w = 0; w < img->lines; ++w, line += stride)
   {
-    case '1': return "QL-560";
-    case '2': return "QL-570";
-    case '3': return "QL-580N";
-    case '4': return "QL-1060N";
-    case '5': return "QL-700";
-    case '6': return "QL-710W";
-    case '7': return "QL-720NW";
-    case 'O': return "QL-500/550";
-    case 'P': return "QL-1050";
-    case 'Q': return "QL-650TD";
-    default:
+    if (enc->zero_lines &&
+        (img->ink ? !img->ink[w] : line_is_blank(line, dn)))
     {
-      static char buf[] = "unrecognised (type code 0x$$)";
-      char *q = strchr(buf, '$');
-      sprintf(q, "%02hhx)", status->model_code);
-      return buf;
+      *out++ = 'Z';
+      ++enc->blank_lines;
     }
+    else
+      out += encode_line(out, line, dn, two_colour, enc->compressed);
+  }
+  enc->len = out - buf;
+  return true;
+}
+
+
+bool ql_print_encoded_image(ql_ctx_t ctx, const ql_status_t *status, const ql_encoded_image_t *img, const ql_print_cfg_t *cfg)
+{
+  if (!check_image(status, img->line_bytes, img->planes))
+    return false;
+  if ((img->compressed && !ql_supports_compression(status)) ||
+      (img->zero_lines && !ql_supports_zero_lines(status)))
+  {
+    errno = EINVAL; // encoded for a printer taking more than this one
+    return false;
+  }
+  if (!send_print_info(ctx, img->lines, img->planes == 2, img->compressed, cfg))
+    return false;
+
+  ctx->stats = (ql_print_stats_t){
+    .lines = img->lines,
+    .raster_bytes = img->lines * img->planes * (img->line_bytes + 3),
+    .sent_bytes = img->len,
+    .blank_lines = img->blank_lines,
+  };
+  ctx->delta.lines = 0; // what was sent last is no longer the label before
+
+  // Straight from the caller's memory, along with whatever is buffered
+  return flush_with(ctx, img->data, img->len) && send_print_end(ctx);
+}
+
+
+const ql_print_stats_t *ql_last_print_stats(ql_ctx_t ctx)
+{
+  return &ctx->stats;
+}
+
+
+typedef struct {
+  uint8_t code;
+  uint8_t model;
+  const char *name;
+} model_map_t;
+
+static const model_map_t model_map[] = {
+  { '1', QL_MODEL_QL560,     "QL-560" },
+  { '2', QL_MODEL_QL570,     "QL-570" },
+  { '3', QL_MODEL_QL580N,    "QL-580N" },
+  { '4', QL_MODEL_QL1060N,   "QL-1060N" },
+  { '5', QL_MODEL_QL700,     "QL-700" },
+  { '6', QL_MODEL_QL710W,    "QL-710W" },
+  { '7', QL_MODEL_QL720NW,   "QL-720NW" },
+  { '8', QL_MODEL_QL800,     "QL-800" },
+  { '9', QL_MODEL_QL810W,    "QL-810W" },
+  { 'A', QL_MODEL_QL820NWB,  "QL-820NWB" },
+  { 'O', QL_MODEL_QL500_550, "QL-500/550" },
+  { 'P', QL_MODEL_QL1050,    "QL-1050" },
+  { 'Q', QL_MODEL_QL650TD,   "QL-650TD" },
+};
+
+static const model_map_t *find_model(uint8_t code)
+{
+  for (unsigned i = 0; i < (sizeof(model_map)/sizeof(model_map[0])); ++i)
+    if (model_map[i].code == code)
+      return &model_map[i];
+  return NULL;
+}
+
+#define ERR1(x) (x << 0)
+#define ERR2(x) (x << 8)
+static const struct {
+  uint16_t bit;
+  const char *str;
+} err_map[] = {
+  { ERR1(QL_ERR_1_NO_MEDIA),                  "no-media" },
+  { ERR1(QL_ERR_1_END_OF_MEDIA),              "end-of-media" },
+  { ERR1(QL_ERR_1_CUTTER_JAM),                "cutter-jam" },
+  { ERR1(QL_ERR_1_PRINTER_IN_USE),            "printer-in-use" },
+  { ERR1(QL_ERR_1_PRINTER_TURNED_OFF),        "printer-turned-off" },
+  { ERR1(QL_ERR_1_HIGH_VOLTAGE_ADAPTER),      "high-voltage-adapter" },
+  { ERR1(QL_ERR_1_FAN_MOTOR_ERROR),           "fan-motor-error" },
+
+  { ERR2(QL_ERR_2_REPLACE_MEDIA),             "replace-media" },
+  { ERR2(QL_ERR_2_EXPANSION_BUFFER_FULL),     "expansion-buffer-full" },
+  { ERR2(QL_ERR_2_COMMUNICATION_ERROR),       "communication-error" },
+  { ERR2(QL_ERR_2_COMMUNICATION_BUFFER_FULL), "communication-buffer-full" },
+  { ERR2(QL_ERR_2_COVER_OPEN),                "cover-open" },
+  { ERR2(QL_ERR_2_CANCEL_KEY),                "cancel-key-pressed" },
+  { ERR2(QL_ERR_2_MEDIA_CANNOT_BE_FED),       "media-cannot-be-fed" },
+  { ERR2(QL_ERR_2_SYSTEM_ERROR),              "system-error" }
+};
+
+static uint16_t error_bits(const ql_status_t *status)
+{
+  return ERR1(status->err_info_1) | ERR2(status->err_info_2);
+}
+
+static uint8_t media_type(uint8_t type)
+{
+  switch(type)
+  {
+    case QL_MEDIA_TYPE_CONTINUOUS_ALT: return QL_MEDIA_TYPE_CONTINUOUS;
+    case QL_MEDIA_TYPE_DIECUT_LABELS_ALT: return QL_MEDIA_TYPE_DIECUT_LABELS;
+    default: return type;
   }
 }
 
+
+const char *ql_decode_model_r(const ql_status_t *status, char *buf, size_t len)
+{
+  const model_map_t *m = find_model(status->model_code);
+  if (m)
+    return m->name;
+  snprintf(buf, len, "unrecognised (type code 0x%02hhx)", status->model_code);
+  return buf;
+}
+
 const char *ql_decode_mode(const ql_status_t *status)
 {
   if (status->mode & QL_MODE_AUTOCUT)
@@ -240,94 +931,145 @@ const char *ql_decode_mode(const ql_status_t *status)
     return "no-auto-cut";
 }
 
-const char *ql_decode_errors(const ql_status_t *status)
+const char *ql_decode_errors_r(const ql_status_t *status, char *buf, size_t len)
 {
-  typedef struct {
-    uint16_t bit;
-    const char *str;
-  } strmap_t;
-
-  #define ERR1(x) (x << 0)
-  #define ERR2(x) (x << 8)
-  const strmap_t strmap[] = {
-    { ERR1(QL_ERR_1_NO_MEDIA),                  "no-media " },
-    { ERR1(QL_ERR_1_END_OF_MEDIA),              "end-of-media " },
-    { ERR1(QL_ERR_1_CUTTER_JAM),                "cutter-jam " },
-    { ERR1(QL_ERR_1_PRINTER_IN_USE),            "printer-in-use " },
-    { ERR1(QL_ERR_1_PRINTER_TURNED_OFF),        "printer-turned-off " },
-    { ERR1(QL_ERR_1_HIGH_VOLTAGE_ADAPTER),      "high-voltage-adapter " },
-    { ERR1(QL_ERR_1_FAN_MOTOR_ERROR),           "fan-motor-error " },
-
-    { ERR2(QL_ERR_2_REPLACE_MEDIA),             "replace-media " },
-    { ERR2(QL_ERR_2_EXPANSION_BUFFER_FULL),     "expansion-buffer-full " },
-    { ERR2(QL_ERR_2_COMMUNICATION_ERROR),       "communication-error " },
-    { ERR2(QL_ERR_2_COMMUNICATION_BUFFER_FULL), "communication-buffer-full " },
-    { ERR2(QL_ERR_2_COVER_OPEN),                "cover-open " },
-    { ERR2(QL_ERR_2_CANCEL_KEY),                "cancel-key-pressed " },
-    { ERR2(QL_ERR_2_MEDIA_CANNOT_BE_FED),       "media-cannot-be-fed " },
-    { ERR2(QL_ERR_2_SYSTEM_ERROR),              "system-error " }
-  };
+  const uint16_t errs = error_bits(status);
+  if (!errs)
+    return "none";
 
-  static char *buf = 0;
-  if (!buf)
+  size_t used = 0;
+  buf[0] = 0;
+  for (unsigned i = 0; i < (sizeof(err_map)/sizeof(err_map[0])); ++i)
   {
-    int len = 0;
-    for (unsigned i = 0; i < (sizeof(strmap)/sizeof(strmap[0])); ++i)
-      len += strlen(strmap[i].str);
-    buf = malloc(len + 1);
-    if (!buf)
-      return "<host-out-of-memory>";
+    if (!(errs & err_map[i].bit))
+      continue;
+    int n = snprintf(buf + used, len - used, "%s ", err_map[i].str);
+    if (n < 0 || (size_t)n >= len - used)
+      break; // truncated, but terminated
+    used += n;
   }
+  return buf;
+}
 
-  uint16_t errs = ERR1(status->err_info_1) | ERR2(status->err_info_2);
-  buf[0] = 0;
-  for (unsigned i = 0; i < (sizeof(strmap)/sizeof(strmap[0])); ++i)
+const char *ql_decode_media_type_r(const ql_status_t *status, char *buf, size_t len)
+{
+  switch(media_type(status->media_type))
   {
-    if (errs & strmap[i].bit)
-      strcat(buf, strmap[i].str);
+    case QL_MEDIA_TYPE_NO_MEDIA: return "no-media";
+    case QL_MEDIA_TYPE_CONTINUOUS: return "continuous-length-tape";
+    case QL_MEDIA_TYPE_DIECUT_LABELS: return "die-cut-labels";
+    default:
+      snprintf(buf, len, "unknown (code 0x%02hhx)", status->media_type);
+      return buf;
   }
-  return (buf[0] == 0) ? "none" : buf;
+}
+
+const char *ql_decode_model(const ql_status_t *status)
+{
+  static _Thread_local char buf[QL_DECODE_BUF_LEN];
+  return ql_decode_model_r(status, buf, sizeof(buf));
+}
+
+const char *ql_decode_errors(const ql_status_t *status)
+{
+  static _Thread_local char buf[QL_DECODE_BUF_LEN];
+  return ql_decode_errors_r(status, buf, sizeof(buf));
 }
 
 const char *ql_decode_media_type(const ql_status_t *status)
 {
-  switch(status->media_type)
+  static _Thread_local char buf[QL_DECODE_BUF_LEN];
+  return ql_decode_media_type_r(status, buf, sizeof(buf));
+}
+
+
+void ql_status_summarise(ql_status_summary_t *sum, const ql_status_t *status)
+{
+  const model_map_t *m = find_model(status->model_code);
+  memset(sum, 0, sizeof(*sum)); // no stray padding in the comparisons
+  sum->model = m ? m->model : QL_MODEL_UNKNOWN;
+  sum->mode = status->mode;
+  sum->errors = error_bits(status);
+  sum->media_type = media_type(status->media_type);
+  sum->media_width_mm = status->media_width_mm;
+  sum->media_length_mm = status->media_length_mm;
+  sum->phase_type = status->phase_type;
+}
+
+bool ql_status_summary_equal(const ql_status_summary_t *a, const ql_status_summary_t *b)
+{
+  return memcmp(a, b, sizeof(*a)) == 0;
+}
+
+
+static void print_json(FILE *f, const ql_status_t *status, unsigned flags)
+{
+  char buf[QL_DECODE_BUF_LEN];
+  const char *sep = "";
+  fputc('{', f);
+  if (flags & QL_DECODE_MODEL)
   {
-    case QL_MEDIA_TYPE_NO_MEDIA: return "no-media";
-    case QL_MEDIA_TYPE_CONTINUOUS:
-    case QL_MEDIA_TYPE_CONTINUOUS_ALT:
-      return "continuous-length-tape";
-    case QL_MEDIA_TYPE_DIECUT_LABELS:
-    case QL_MEDIA_TYPE_DIECUT_LABELS_ALT:
-      return "die-cut-labels";
-    default: {
-      static char buf[] = "unknown (code 0x$$)";
-      char *q = strchr(buf, '$');
-      sprintf(q, "%02hhx)", status->media_type);
-      return buf;
+    fprintf(f, "%s\"printer\":\"%s\"", sep,
+      ql_decode_model_r(status, buf, sizeof(buf)));
+    sep = ",";
+  }
+  if (flags & QL_DECODE_MODE)
+  {
+    fprintf(f, "%s\"mode\":\"%s\"", sep, ql_decode_mode(status));
+    sep = ",";
+  }
+  if (flags & QL_DECODE_ERROR)
+  {
+    const uint16_t errs = error_bits(status);
+    const char *esep = "";
+    fprintf(f, "%s\"errors\":[", sep);
+    for (unsigned i = 0; i < (sizeof(err_map)/sizeof(err_map[0])); ++i)
+    {
+      if (errs & err_map[i].bit)
+      {
+        fprintf(f, "%s\"%s\"", esep, err_map[i].str);
+        esep = ",";
+      }
     }
+    fputc(']', f);
+    sep = ",";
+  }
+  if (flags & QL_DECODE_MEDIA)
+  {
+    fprintf(f, "%s\"media_type\":\"%s\",\"media_width_mm\":%u", sep,
+      ql_decode_media_type_r(status, buf, sizeof(buf)),
+      status->media_width_mm);
+    if (status->media_type != QL_MEDIA_TYPE_CONTINUOUS)
+      fprintf(f, ",\"media_length_mm\":%u", status->media_length_mm);
   }
+  fputs("}\n", f);
 }
 
 void ql_decode_print_status(FILE *f, const ql_status_t *status, unsigned flags)
 {
   if (!status)
     return;
+  if (flags & QL_DECODE_JSON)
+  {
+    print_json(f, status, flags);
+    return;
+  }
 
+  char buf[QL_DECODE_BUF_LEN];
   const char *fmt_s = "%17s: %s\n";
   const char *fmt_u = "%17s: %u\n";
   if (flags & QL_DECODE_MODEL)
-    fprintf(f, fmt_s, "Printer", ql_decode_model(status));
+    fprintf(f, fmt_s, "Printer", ql_decode_model_r(status, buf, sizeof(buf)));
   if (flags & QL_DECODE_MODE)
     fprintf(f, fmt_s, "Mode", ql_decode_mode(status));
   if (flags & QL_DECODE_ERROR)
-    fprintf(f, fmt_s, "Errors", ql_decode_errors(status));
+    fprintf(f, fmt_s, "Errors", ql_decode_errors_r(status, buf, sizeof(buf)));
   if (flags & QL_DECODE_MEDIA)
   {
-    fprintf(f, fmt_s, "Media type", ql_decode_media_type(status));
+    fprintf(f, fmt_s, "Media type",
+      ql_decode_media_type_r(status, buf, sizeof(buf)));
     fprintf(f, fmt_u, "Media width (mm)", status->media_width_mm);
     if (status->media_type != QL_MEDIA_TYPE_CONTINUOUS)
       fprintf(f, fmt_u, "Media length (mm)", status->media_length_mm);
   }
 }
-
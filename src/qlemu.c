@@ -0,0 +1,183 @@
+/*
+ * Copyright 2017 DiUS Computing Pty Ltd. All rights reserved.
+ *
+ * Released under GPLv3, see LICENSE for details.
+ *
+ * @author Johny Mattsson <jmattsson@dius.com.au>
+ */
+#include "emulator.h"
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static volatile bool stop = false;
+
+static void on_signal(int sig)
+{
+  (void)sig;
+  stop = true;
+}
+
+
+typedef struct {
+  const char *prefix; // for .pbm files, NULL for none
+  unsigned page;
+} page_out_t;
+
+// Two-colour pages as a PPM image, black over red over white
+static void write_ppm(FILE *f, const ql_packed_image_t *page)
+{
+  const unsigned width = page->lines, height = page->line_bytes * 8;
+  const unsigned stride = 2 * page->line_bytes;
+  fprintf(f, "P6\n%u %u\n255\n", width, height);
+  uint8_t row[width * 3];
+  for (unsigned y = 0; y < height; ++y)
+  {
+    const uint8_t *col = page->data + y / 8;
+    const uint8_t bit = 0x80 >> (y % 8);
+    for (unsigned x = 0; x < width; ++x, col += stride)
+    {
+      const bool black = col[0] & bit, red = col[page->line_bytes] & bit;
+      row[x * 3] = black ? 0 : 255;
+      row[x * 3 + 1] = row[x * 3 + 2] = (black || red) ? 0 : 255;
+    }
+    fwrite(row, 1, sizeof(row), f);
+  }
+}
+
+
+// Writes the page as it would come out of the printer, as a PBM image
+// (PPM for two-colour)
+static void save_page(const ql_packed_image_t *page, void *arg)
+{
+  page_out_t *out = arg;
+  ++out->page;
+  printf("page %u: %u lines%s\n", out->page, page->lines,
+    page->planes == 2 ? ", two-colour" : "");
+  fflush(stdout);
+  if (!out->prefix)
+    return;
+
+  char path[strlen(out->prefix) + 16];
+  sprintf(path, "%s%04u.%s", out->prefix, out->page,
+    page->planes == 2 ? "ppm" : "pbm");
+  FILE *f = fopen(path, "wb");
+  if (!f)
+  {
+    fprintf(stderr, "Unable to write '%s': %s\n", path, strerror(errno));
+    return;
+  }
+  if (page->planes == 2)
+  {
+    write_ppm(f, page);
+    fclose(f);
+    return;
+  }
+
+  // Raster lines are image columns, print head dots are image rows
+  const unsigned width = page->lines, height = page->line_bytes * 8;
+  fprintf(f, "P4\n%u %u\n", width, height);
+  uint8_t row[(width + 7) / 8 + 1];
+  for (unsigned y = 0; y < height; ++y)
+  {
+    memset(row, 0, sizeof(row));
+    const uint8_t *col = page->data + y / 8;
+    for (unsigned x = 0; x < width; ++x, col += page->line_bytes)
+      if (*col & (0x80 >> (y % 8)))
+        row[x / 8] |= 0x80 >> (x % 8);
+    fwrite(row, 1, (width + 7) / 8, f);
+  }
+  fclose(f);
+}
+
+
+static void syntax(void)
+{
+  fprintf(stderr,
+"Syntax:\n"
+"  qlemu [-m model] [-C|-D] [-W width] [-L length] [-l bytes] [-r lines] [-o prefix]\n"
+"Where:\n"
+"  -m model      Model code to report (default 2, i.e. QL-570; 8 for QL-800)\n"
+"  -C            Continuous-length-tape loaded (default)\n"
+"  -D            Die-cut-labels loaded\n"
+"  -W width      Media width in mm (default 62)\n"
+"  -L length     Media length in mm (default 0, i.e. continuous)\n"
+"  -l bytes      Link speed in bytes per second (default unthrottled)\n"
+"  -r lines      Print speed in raster lines per second (default instant)\n"
+"  -o prefix     Save each printed page as prefixNNNN.pbm (.ppm if two-colour)\n"
+"\n"
+"The emulated printer's port is printed on startup; give it to qlprint -p.\n"
+"\n");
+
+  exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char *argv[])
+{
+  emulator_cfg_t cfg = {
+    .model_code = '2',
+    .media_type = QL_MEDIA_TYPE_CONTINUOUS,
+    .media_width_mm = 62,
+    .media_length_mm = QL_MEDIA_LENGTH_CONTINUOUS,
+  };
+  page_out_t out = { NULL, 0 };
+  int opt;
+  while ((opt = getopt(argc, argv, "m:CDW:L:l:r:o:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'm': cfg.model_code = optarg[0]; break;
+      case 'C': cfg.media_type = QL_MEDIA_TYPE_CONTINUOUS; break;
+      case 'D': cfg.media_type = QL_MEDIA_TYPE_DIECUT_LABELS; break;
+      case 'W': cfg.media_width_mm = atoi(optarg); break;
+      case 'L': cfg.media_length_mm = atoi(optarg); break;
+      case 'l': cfg.link_bytes_per_s = atoi(optarg); break;
+      case 'r': cfg.print_lines_per_s = atoi(optarg); break;
+      case 'o': out.prefix = optarg; break;
+      default: syntax();
+    }
+  }
+  if (optind != argc)
+    syntax();
+
+  int master, slave;
+  const char *port;
+  if (!emulator_open_pty(&master, &slave, &port))
+  {
+    fprintf(stderr, "Unable to create pty: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  emulator_t emu = emulator_create(&cfg, save_page, &out);
+  if (!emu)
+  {
+    fprintf(stderr, "Out of memory!\n");
+    return EXIT_FAILURE;
+  }
+
+  struct sigaction sa = { .sa_handler = on_signal };
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  printf("%s\n", port);
+  fflush(stdout);
+
+  bool ok = emulator_run(emu, master, master, &stop);
+  if (!ok)
+    fprintf(stderr, "Emulator failed: %s\n", strerror(errno));
+
+  const emulator_stats_t *stats = emulator_stats(emu);
+  printf("%u pages, %u lines (%u blank), %llu bytes received, %u errors\n",
+    stats->pages, stats->lines, stats->blank_lines,
+    (unsigned long long)stats->bytes, stats->errors);
+
+  emulator_destroy(emu);
+  close(slave);
+  close(master);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
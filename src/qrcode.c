@@ -0,0 +1,452 @@
+/*
+ * Copyright 2017 DiUS Computing Pty Ltd. All rights reserved.
+ *
+ * Released under GPLv3, see LICENSE for details.
+ *
+ * @author Johny Mattsson <jmattsson@dius.com.au>
+ */
+#include "qrcode.h"
+#include <errno.h>
+#include <string.h>
+
+#define MIN_VERSION 1
+#define MAX_VERSION 40
+
+// Per error correction level (L, M, Q, H) and version
+static const uint8_t ecc_per_block[4][MAX_VERSION + 1] = {
+  { 0, 7, 10, 15, 20, 26, 18, 20, 24, 30, 18, 20, 24, 26, 30, 22, 24, 28, 30,
+    28, 28, 28, 28, 30, 30, 26, 28, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
+    30, 30, 30, 30 },
+  { 0, 10, 16, 26, 18, 24, 16, 18, 22, 22, 26, 30, 22, 22, 24, 24, 28, 28,
+    26, 26, 26, 26, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    28, 28, 28, 28, 28 },
+  { 0, 13, 22, 18, 26, 18, 24, 18, 22, 20, 24, 28, 26, 24, 20, 30, 24, 28,
+    28, 26, 30, 28, 30, 30, 30, 30, 28, 30, 30, 30, 30, 30, 30, 30, 30, 30,
+    30, 30, 30, 30, 30 },
+  { 0, 17, 28, 22, 16, 22, 28, 26, 26, 24, 28, 24, 28, 22, 24, 24, 30, 28,
+    28, 26, 28, 30, 24, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
+    30, 30, 30, 30, 30 },
+};
+
+static const uint8_t num_blocks[4][MAX_VERSION + 1] = {
+  { 0, 1, 1, 1, 1, 1, 2, 2, 2, 2, 4, 4, 4, 4, 4, 6, 6, 6, 6, 7, 8, 8, 9, 9,
+    10, 12, 12, 12, 13, 14, 15, 16, 17, 18, 19, 19, 20, 21, 22, 24, 25 },
+  { 0, 1, 1, 1, 2, 2, 4, 4, 4, 5, 5, 5, 8, 9, 9, 10, 10, 11, 13, 14, 16, 17,
+    17, 18, 20, 21, 23, 25, 26, 28, 29, 31, 33, 35, 37, 38, 40, 43, 45, 47,
+    49 },
+  { 0, 1, 1, 2, 2, 4, 4, 6, 6, 8, 8, 8, 10, 12, 16, 12, 17, 16, 18, 21, 20,
+    23, 23, 25, 27, 29, 34, 34, 35, 38, 40, 43, 45, 48, 51, 53, 56, 59, 62,
+    65, 68 },
+  { 0, 1, 1, 2, 4, 4, 4, 5, 6, 8, 8, 11, 11, 16, 16, 18, 16, 19, 21, 25, 25,
+    25, 34, 30, 32, 35, 37, 40, 42, 45, 48, 51, 54, 57, 60, 63, 66, 70, 74,
+    77, 81 },
+};
+
+// As the format information has them
+static const uint8_t ecc_format_bits[4] = { 1, 0, 3, 2 };
+
+
+bool ql_qr_ecc_by_name(const char *name, uint8_t *ecc)
+{
+  static const char names[] = "LMQH";
+  for (uint8_t i = 0; i < 4; ++i)
+    if (name[0] == names[i] && name[1] == 0)
+    {
+      *ecc = i;
+      return true;
+    }
+  return false;
+}
+
+
+// Modules left for data and error correction, once the patterns are in
+static unsigned raw_modules(unsigned ver)
+{
+  unsigned result = (16 * ver + 128) * ver + 64;
+  if (ver >= 2)
+  {
+    const unsigned align = ver / 7 + 2;
+    result -= (25 * align - 10) * align - 55;
+    if (ver >= 7)
+      result -= 36;
+  }
+  return result;
+}
+
+
+static unsigned data_codewords(unsigned ver, uint8_t ecc)
+{
+  return raw_modules(ver) / 8 -
+    ecc_per_block[ecc][ver] * num_blocks[ecc][ver];
+}
+
+
+static unsigned alignment_positions(unsigned ver, uint8_t pos[7])
+{
+  if (ver == 1)
+    return 0;
+  const unsigned num = ver / 7 + 2;
+  const unsigned step = (ver == 32) ? 26 :
+    (ver * 4 + num * 2 + 1) / (num * 2 - 2) * 2;
+  pos[0] = 6;
+  for (unsigned i = num - 1, p = ver * 4 + 10; i >= 1; --i, p -= step)
+    pos[i] = p;
+  return num;
+}
+
+
+// GF(2^8) with the QR code's polynomial
+static uint8_t gf_mul(uint8_t x, uint8_t y)
+{
+  unsigned z = 0;
+  for (int i = 7; i >= 0; --i)
+  {
+    z = (z << 1) ^ ((z >> 7) * 0x11d);
+    z ^= ((y >> i) & 1) * x;
+  }
+  return z;
+}
+
+
+static void rs_divisor(uint8_t *div, unsigned degree)
+{
+  memset(div, 0, degree);
+  div[degree - 1] = 1;
+  uint8_t root = 1;
+  for (unsigned i = 0; i < degree; ++i)
+  {
+    for (unsigned j = 0; j < degree; ++j)
+    {
+      div[j] = gf_mul(div[j], root);
+      if (j + 1 < degree)
+        div[j] ^= div[j + 1];
+    }
+    root = gf_mul(root, 2);
+  }
+}
+
+
+static void rs_remainder(uint8_t *rem, const uint8_t *data, unsigned len, const uint8_t *div, unsigned degree)
+{
+  memset(rem, 0, degree);
+  for (unsigned i = 0; i < len; ++i)
+  {
+    const uint8_t factor = data[i] ^ rem[0];
+    memmove(rem, rem + 1, degree - 1);
+    rem[degree - 1] = 0;
+    for (unsigned j = 0; j < degree; ++j)
+      rem[j] ^= gf_mul(div[j], factor);
+  }
+}
+
+
+static void set_function(ql_qr_t *qr, unsigned x, unsigned y, bool dark)
+{
+  qr->modules[y][x] = dark;
+  qr->function[y][x] = 1;
+}
+
+
+static void draw_finder(ql_qr_t *qr, int cx, int cy)
+{
+  for (int dy = -4; dy <= 4; ++dy)
+    for (int dx = -4; dx <= 4; ++dx)
+    {
+      const int x = cx + dx, y = cy + dy;
+      if (x < 0 || y < 0 || x >= qr->size || y >= qr->size)
+        continue;
+      const int ax = dx < 0 ? -dx : dx, ay = dy < 0 ? -dy : dy;
+      const int dist = ax > ay ? ax : ay;
+      set_function(qr, x, y, dist != 2 && dist != 4);
+    }
+}
+
+
+static void draw_format(ql_qr_t *qr, uint8_t ecc, unsigned mask)
+{
+  const unsigned data = ecc_format_bits[ecc] << 3 | mask;
+  unsigned rem = data;
+  for (unsigned i = 0; i < 10; ++i)
+    rem = (rem << 1) ^ ((rem >> 9) * 0x537);
+  const unsigned bits = (data << 10 | rem) ^ 0x5412;
+  const unsigned size = qr->size;
+  #define BIT(i) ((bits >> (i)) & 1)
+
+  for (unsigned i = 0; i <= 5; ++i)
+    set_function(qr, 8, i, BIT(i));
+  set_function(qr, 8, 7, BIT(6));
+  set_function(qr, 8, 8, BIT(7));
+  set_function(qr, 7, 8, BIT(8));
+  for (unsigned i = 9; i < 15; ++i)
+    set_function(qr, 14 - i, 8, BIT(i));
+
+  for (unsigned i = 0; i < 8; ++i)
+    set_function(qr, size - 1 - i, 8, BIT(i));
+  for (unsigned i = 8; i < 15; ++i)
+    set_function(qr, 8, size - 15 + i, BIT(i));
+  set_function(qr, 8, size - 8, true);
+  #undef BIT
+}
+
+
+static void draw_function_patterns(ql_qr_t *qr, unsigned ver, uint8_t ecc)
+{
+  const unsigned size = qr->size;
+  for (unsigned i = 0; i < size; ++i)
+  {
+    set_function(qr, 6, i, i % 2 == 0);
+    set_function(qr, i, 6, i % 2 == 0);
+  }
+  draw_finder(qr, 3, 3);
+  draw_finder(qr, size - 4, 3);
+  draw_finder(qr, 3, size - 4);
+
+  uint8_t pos[7];
+  const unsigned num = alignment_positions(ver, pos);
+  for (unsigned i = 0; i < num; ++i)
+    for (unsigned j = 0; j < num; ++j)
+    {
+      if ((i == 0 && j == 0) || (i == 0 && j == num - 1) ||
+          (i == num - 1 && j == 0))
+        continue; // the finders are there
+      for (int dy = -2; dy <= 2; ++dy)
+        for (int dx = -2; dx <= 2; ++dx)
+          set_function(qr, pos[i] + dx, pos[j] + dy,
+            dx == -2 || dx == 2 || dy == -2 || dy == 2 || (!dx && !dy));
+    }
+
+  draw_format(qr, ecc, 0); // placeholder, to reserve the modules
+
+  if (ver >= 7)
+  {
+    unsigned rem = ver;
+    for (unsigned i = 0; i < 12; ++i)
+      rem = (rem << 1) ^ ((rem >> 11) * 0x1f25);
+    const unsigned bits = ver << 12 | rem;
+    for (unsigned i = 0; i < 18; ++i)
+    {
+      const unsigned a = size - 11 + i % 3, b = i / 3;
+      set_function(qr, a, b, (bits >> i) & 1);
+      set_function(qr, b, a, (bits >> i) & 1);
+    }
+  }
+}
+
+
+// Data codewords into blocks, with error correction, interleaved
+static unsigned add_ecc_and_interleave(ql_qr_t *qr, unsigned ver, uint8_t ecc)
+{
+  const unsigned blocks = num_blocks[ecc][ver];
+  const unsigned ecc_len = ecc_per_block[ecc][ver];
+  const unsigned raw = raw_modules(ver) / 8;
+  const unsigned short_blocks = blocks - raw % blocks;
+  const unsigned short_len = raw / blocks; // data and ecc, in a short block
+
+  uint8_t div[30], rem[30];
+  rs_divisor(div, ecc_len);
+  unsigned k = 0;
+  for (unsigned b = 0; b < blocks; ++b)
+  {
+    const unsigned dlen = short_len - ecc_len + (b < short_blocks ? 0 : 1);
+    const uint8_t *dat = qr->data + k;
+    // Data first, column by column over the blocks
+    for (unsigned i = 0; i < dlen; ++i)
+    {
+      unsigned at = i * blocks + b;
+      if (i == short_len - ecc_len) // only long blocks get this far
+        at -= short_blocks;
+      qr->codewords[at] = dat[i];
+    }
+    rs_remainder(rem, dat, dlen, div, ecc_len);
+    const unsigned data_total = data_codewords(ver, ecc);
+    for (unsigned i = 0; i < ecc_len; ++i)
+      qr->codewords[data_total + i * blocks + b] = rem[i];
+    k += dlen;
+  }
+  return raw;
+}
+
+
+static void draw_codewords(ql_qr_t *qr, unsigned len)
+{
+  const int size = qr->size;
+  unsigned i = 0;
+  for (int right = size - 1; right >= 1; right -= 2)
+  {
+    if (right == 6)
+      right = 5; // skip the vertical timing pattern
+    const bool upward = ((right + 1) & 2) == 0;
+    for (int vert = 0; vert < size; ++vert)
+      for (int j = 0; j < 2; ++j)
+      {
+        const int x = right - j;
+        const int y = upward ? size - 1 - vert : vert;
+        if (qr->function[y][x])
+          continue;
+        if (i < len * 8)
+          qr->modules[y][x] = (qr->codewords[i >> 3] >> (7 - (i & 7))) & 1;
+        else
+          qr->modules[y][x] = 0; // remainder bits
+        ++i;
+      }
+  }
+}
+
+
+static bool mask_bit(unsigned mask, unsigned x, unsigned y)
+{
+  switch (mask)
+  {
+    case 0: return (x + y) % 2 == 0;
+    case 1: return y % 2 == 0;
+    case 2: return x % 3 == 0;
+    case 3: return (x + y) % 3 == 0;
+    case 4: return (x / 3 + y / 2) % 2 == 0;
+    case 5: return x * y % 2 + x * y % 3 == 0;
+    case 6: return (x * y % 2 + x * y % 3) % 2 == 0;
+    default: return ((x + y) % 2 + x * y % 3) % 2 == 0;
+  }
+}
+
+
+// Masking twice undoes it
+static void apply_mask(ql_qr_t *qr, unsigned mask)
+{
+  for (unsigned y = 0; y < qr->size; ++y)
+    for (unsigned x = 0; x < qr->size; ++x)
+      if (!qr->function[y][x] && mask_bit(mask, x, y))
+        qr->modules[y][x] ^= 1;
+}
+
+
+static uint8_t module_at(const ql_qr_t *qr, unsigned i, unsigned j, bool cols)
+{
+  return cols ? qr->modules[j][i] : qr->modules[i][j];
+}
+
+
+static unsigned penalty(const ql_qr_t *qr)
+{
+  const unsigned size = qr->size;
+  unsigned score = 0, dark = 0;
+
+  for (unsigned pass = 0; pass < 2; ++pass) // rows, then columns
+  {
+    const bool cols = pass;
+    for (unsigned i = 0; i < size; ++i)
+    {
+      // Runs of five or more the same
+      unsigned run = 1;
+      for (unsigned j = 1; j <= size; ++j)
+      {
+        if (j < size &&
+            module_at(qr, i, j, cols) == module_at(qr, i, j - 1, cols))
+        {
+          ++run;
+          continue;
+        }
+        if (run >= 5)
+          score += 3 + (run - 5);
+        run = 1;
+      }
+      // Finder-like 1:1:3:1:1 with four light modules to one side
+      for (unsigned j = 0; j + 7 <= size; ++j)
+      {
+        static const uint8_t finder[7] = { 1, 0, 1, 1, 1, 0, 1 };
+        bool match = true;
+        for (unsigned k = 0; k < 7 && match; ++k)
+          match = module_at(qr, i, j + k, cols) == finder[k];
+        if (!match)
+          continue;
+        bool before = true, after = true;
+        for (unsigned k = 1; k <= 4; ++k)
+        {
+          before = before && (j < k || !module_at(qr, i, j - k, cols));
+          after = after &&
+            (j + 6 + k >= size || !module_at(qr, i, j + 6 + k, cols));
+        }
+        score += (before ? 40 : 0) + (after ? 40 : 0);
+      }
+    }
+  }
+
+  for (unsigned y = 0; y < size; ++y)
+    for (unsigned x = 0; x < size; ++x)
+    {
+      const uint8_t m = qr->modules[y][x];
+      dark += m;
+      if (x + 1 < size && y + 1 < size && m == qr->modules[y][x + 1] &&
+          m == qr->modules[y + 1][x] && m == qr->modules[y + 1][x + 1])
+        score += 3;
+    }
+
+  // Ten per 5% the proportion of dark modules is away from half
+  const unsigned total = size * size;
+  unsigned k = 0;
+  while (dark * 20 < (9 - k) * total || dark * 20 > (11 + k) * total)
+    ++k;
+  return score + k * 10;
+}
+
+
+bool ql_qr_encode(ql_qr_t *qr, const uint8_t *data, size_t len, uint8_t ecc)
+{
+  if (ecc > QL_QR_ECC_H)
+  {
+    errno = EINVAL;
+    return false;
+  }
+  unsigned ver, capacity;
+  for (ver = MIN_VERSION; ver <= MAX_VERSION; ++ver)
+  {
+    capacity = data_codewords(ver, ecc);
+    const unsigned count_bits = ver <= 9 ? 8 : 16;
+    if (len < (1u << count_bits) && 4 + count_bits + 8 * len <= 8 * capacity)
+      break;
+  }
+  if (ver > MAX_VERSION)
+  {
+    errno = EMSGSIZE;
+    return false;
+  }
+
+  // Byte mode segment, terminator, then padding
+  memset(qr->data, 0, capacity);
+  unsigned bit = 0;
+  #define PUT(val, n) \
+    for (int b_ = (n) - 1; b_ >= 0; --b_, ++bit) \
+      qr->data[bit >> 3] |= (((val) >> b_) & 1) << (7 - (bit & 7))
+  PUT(0x4, 4);
+  PUT(len, ver <= 9 ? 8 : 16);
+  for (size_t i = 0; i < len; ++i)
+    PUT(data[i], 8);
+  const unsigned term = 8 * capacity - bit < 4 ? 8 * capacity - bit : 4;
+  bit += term;
+  bit = (bit + 7) & ~7u;
+  for (uint8_t pad = 0xec; bit < 8 * capacity; pad ^= 0xec ^ 0x11)
+    PUT(pad, 8);
+  #undef PUT
+
+  qr->size = 17 + 4 * ver;
+  memset(qr->modules, 0, sizeof(qr->modules));
+  memset(qr->function, 0, sizeof(qr->function));
+  draw_function_patterns(qr, ver, ecc);
+  draw_codewords(qr, add_ecc_and_interleave(qr, ver, ecc));
+
+  unsigned best = 0, best_score = ~0u;
+  for (unsigned mask = 0; mask < 8; ++mask)
+  {
+    apply_mask(qr, mask);
+    draw_format(qr, ecc, mask);
+    const unsigned score = penalty(qr);
+    if (score < best_score)
+    {
+      best = mask;
+      best_score = score;
+    }
+    apply_mask(qr, mask);
+  }
+  apply_mask(qr, best);
+  draw_format(qr, ecc, best);
+  return true;
+}
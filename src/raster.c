@@ -0,0 +1,1055 @@
+/*
+ * Copyright 2017 DiUS Computing Pty Ltd. All rights reserved.
+ *
+ * Released under GPLv3, see LICENSE for details.
+ *
+ * @author Johny Mattsson <jmattsson@dius.com.au>
+ */
+#include "raster.h"
+#include "arena.h"
+#include "resample.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define HAVE_X86_KERNELS
+#endif
+#if defined(__ARM_NEON)
+# include <arm_neon.h>
+# define HAVE_NEON_KERNEL
+#endif
+
+/* Threshold kernels. Each packs one row of pixels into bits, MSB first,
+ * with a bit set where the pixel is black (below black_below_v). Vector
+ * kernels handle whole multiples of their width and leave the remainder
+ * to the scalar kernel, which is also the reference the others must match.
+ */
+
+static void threshold_row_scalar(uint8_t *bits, const uint8_t *gray, unsigned width, uint8_t black_below_v)
+{
+  unsigned n = 0;
+  for (; n + 8 <= width; n += 8)
+  {
+    uint8_t b = 0;
+    for (unsigned i = 0; i < 8; ++i)
+      b |= (gray[n + i] < black_below_v) << (7 - i);
+    *bits++ = b;
+  }
+  if (n < width)
+  {
+    uint8_t b = 0;
+    for (unsigned i = 0; n + i < width; ++i)
+      b |= (gray[n + i] < black_below_v) << (7 - i);
+    *bits = b;
+  }
+}
+
+static void ordered_row_scalar(uint8_t *bits, const uint8_t *gray, unsigned width, const uint8_t limits[8])
+{
+  unsigned n = 0;
+  for (; n + 8 <= width; n += 8)
+  {
+    uint8_t b = 0;
+    for (unsigned i = 0; i < 8; ++i)
+      b |= (gray[n + i] < limits[i]) << (7 - i);
+    *bits++ = b;
+  }
+  if (n < width)
+  {
+    uint8_t b = 0;
+    for (unsigned i = 0; n + i < width; ++i)
+      b |= (gray[n + i] < limits[i]) << (7 - i);
+    *bits = b;
+  }
+}
+
+static bool have_scalar(void)
+{
+  return true;
+}
+
+
+/* Bits of a byte in reverse order; movemask gives us LSB first, the
+ * printer wants MSB first, and rotating by 180 or 270 mirrors rows.
+ */
+#define R2(n) n, n + 2*64, n + 1*64, n + 3*64
+#define R4(n) R2(n), R2(n + 2*16), R2(n + 1*16), R2(n + 3*16)
+#define R6(n) R4(n), R4(n + 2*4 ), R4(n + 1*4 ), R4(n + 3*4 )
+static const uint8_t bit_reverse[256] = { R6(0), R6(2), R6(1), R6(3) };
+#undef R2
+#undef R4
+#undef R6
+
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("sse2")))
+static void threshold_row_sse2(uint8_t *bits, const uint8_t *gray, unsigned width, uint8_t black_below_v)
+{
+  if (!black_below_v)
+  {
+    memset(bits, 0, (width + 7) / 8);
+    return;
+  }
+  // No unsigned compare in SSE2, but v < t is the same as min(v, t-1) == v
+  const __m128i limit = _mm_set1_epi8((char)(black_below_v - 1));
+  unsigned n = 0;
+  for (; n + 16 <= width; n += 16, bits += 2)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)(gray + n));
+    unsigned mask =
+      _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, limit), v));
+    bits[0] = bit_reverse[mask & 0xff];
+    bits[1] = bit_reverse[mask >> 8];
+  }
+  threshold_row_scalar(bits, gray + n, width - n, black_below_v);
+}
+
+// Per-pixel limits; v < t is the same as max(v, t) != v
+__attribute__((target("sse2")))
+static void ordered_row_sse2(uint8_t *bits, const uint8_t *gray, unsigned width, const uint8_t limits[8])
+{
+  uint64_t l;
+  memcpy(&l, limits, sizeof(l));
+  const __m128i limit = _mm_set1_epi64x((long long)l);
+  unsigned n = 0;
+  for (; n + 16 <= width; n += 16, bits += 2)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)(gray + n));
+    unsigned mask = ~_mm_movemask_epi8(
+      _mm_cmpeq_epi8(_mm_max_epu8(v, limit), v)) & 0xffff;
+    bits[0] = bit_reverse[mask & 0xff];
+    bits[1] = bit_reverse[mask >> 8];
+  }
+  ordered_row_scalar(bits, gray + n, width - n, limits);
+}
+
+static bool have_sse2(void)
+{
+  return __builtin_cpu_supports("sse2");
+}
+
+
+__attribute__((target("avx2")))
+static void threshold_row_avx2(uint8_t *bits, const uint8_t *gray, unsigned width, uint8_t black_below_v)
+{
+  if (!black_below_v)
+  {
+    memset(bits, 0, (width + 7) / 8);
+    return;
+  }
+  const __m256i limit = _mm256_set1_epi8((char)(black_below_v - 1));
+  // Reversing each group of eight pixels makes movemask come out MSB first
+  const __m256i reverse = _mm256_setr_epi8(
+    7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+    7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+  unsigned n = 0;
+  for (; n + 32 <= width; n += 32, bits += 4)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(gray + n));
+    v = _mm256_shuffle_epi8(v, reverse);
+    uint32_t mask = (uint32_t)
+      _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(v, limit), v));
+    bits[0] = mask;
+    bits[1] = mask >> 8;
+    bits[2] = mask >> 16;
+    bits[3] = mask >> 24;
+  }
+  threshold_row_sse2(bits, gray + n, width - n, black_below_v);
+}
+
+__attribute__((target("avx2")))
+static void ordered_row_avx2(uint8_t *bits, const uint8_t *gray, unsigned width, const uint8_t limits[8])
+{
+  uint64_t l;
+  memcpy(&l, limits, sizeof(l));
+  const __m256i reverse = _mm256_setr_epi8(
+    7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+    7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+  // Limits reversed the same way as the pixels they go with
+  const __m256i limit =
+    _mm256_shuffle_epi8(_mm256_set1_epi64x((long long)l), reverse);
+  unsigned n = 0;
+  for (; n + 32 <= width; n += 32, bits += 4)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(gray + n));
+    v = _mm256_shuffle_epi8(v, reverse);
+    uint32_t mask = ~(uint32_t)
+      _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(v, limit), v));
+    bits[0] = mask;
+    bits[1] = mask >> 8;
+    bits[2] = mask >> 16;
+    bits[3] = mask >> 24;
+  }
+  ordered_row_sse2(bits, gray + n, width - n, limits);
+}
+
+static bool have_avx2(void)
+{
+  return __builtin_cpu_supports("avx2");
+}
+#endif
+
+
+#ifdef HAVE_NEON_KERNEL
+static void threshold_row_neon(uint8_t *bits, const uint8_t *gray, unsigned width, uint8_t black_below_v)
+{
+  const uint8x16_t limit = vdupq_n_u8(black_below_v);
+  static const uint8_t weights_init[16] = {
+    128, 64, 32, 16, 8, 4, 2, 1, 128, 64, 32, 16, 8, 4, 2, 1 };
+  const uint8x16_t weights = vld1q_u8(weights_init);
+  unsigned n = 0;
+  for (; n + 16 <= width; n += 16, bits += 2)
+  {
+    uint8x16_t m = vandq_u8(vcltq_u8(vld1q_u8(gray + n), limit), weights);
+    uint8x8_t s = vpadd_u8(vget_low_u8(m), vget_high_u8(m));
+    s = vpadd_u8(s, s);
+    s = vpadd_u8(s, s);
+    bits[0] = vget_lane_u8(s, 0);
+    bits[1] = vget_lane_u8(s, 1);
+  }
+  threshold_row_scalar(bits, gray + n, width - n, black_below_v);
+}
+
+static void ordered_row_neon(uint8_t *bits, const uint8_t *gray, unsigned width, const uint8_t limits[8])
+{
+  const uint8x16_t limit = vcombine_u8(vld1_u8(limits), vld1_u8(limits));
+  static const uint8_t weights_init[16] = {
+    128, 64, 32, 16, 8, 4, 2, 1, 128, 64, 32, 16, 8, 4, 2, 1 };
+  const uint8x16_t weights = vld1q_u8(weights_init);
+  unsigned n = 0;
+  for (; n + 16 <= width; n += 16, bits += 2)
+  {
+    uint8x16_t m = vandq_u8(vcltq_u8(vld1q_u8(gray + n), limit), weights);
+    uint8x8_t s = vpadd_u8(vget_low_u8(m), vget_high_u8(m));
+    s = vpadd_u8(s, s);
+    s = vpadd_u8(s, s);
+    bits[0] = vget_lane_u8(s, 0);
+    bits[1] = vget_lane_u8(s, 1);
+  }
+  ordered_row_scalar(bits, gray + n, width - n, limits);
+}
+
+static bool have_neon(void)
+{
+  return true; // compiled in only when the target guarantees NEON
+}
+#endif
+
+
+// Best first; the first supported entry is the automatic choice
+static const ql_pack_kernel_t kernels[] = {
+#ifdef HAVE_X86_KERNELS
+  { "avx2",   threshold_row_avx2,   ordered_row_avx2,   have_avx2 },
+  { "sse2",   threshold_row_sse2,   ordered_row_sse2,   have_sse2 },
+#endif
+#ifdef HAVE_NEON_KERNEL
+  { "neon",   threshold_row_neon,   ordered_row_neon,   have_neon },
+#endif
+  { "scalar", threshold_row_scalar, ordered_row_scalar, have_scalar },
+};
+#define NUM_KERNELS (sizeof(kernels)/sizeof(kernels[0]))
+
+static const ql_pack_kernel_t *active_kernel = NULL;
+
+
+const ql_pack_kernel_t *ql_pack_kernels(unsigned *num)
+{
+  *num = NUM_KERNELS;
+  return kernels;
+}
+
+
+const ql_pack_kernel_t *ql_pack_kernel(void)
+{
+  if (!active_kernel)
+    (void)ql_pack_select_kernel("auto");
+  return active_kernel;
+}
+
+
+bool ql_pack_select_kernel(const char *name)
+{
+  bool any = !name || strcmp(name, "auto") == 0;
+  for (unsigned i = 0; i < NUM_KERNELS; ++i)
+  {
+    if ((any || strcmp(name, kernels[i].name) == 0) && kernels[i].supported())
+    {
+      active_kernel = &kernels[i];
+      return true;
+    }
+  }
+  return false;
+}
+
+
+// 8x8 bit matrix transpose, row 0 in the MSB byte, column 0 in each MSB
+static inline uint64_t transpose8(uint64_t x)
+{
+  uint64_t t;
+  t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaull;
+  x = x ^ t ^ (t << 7);
+  t = (x ^ (x >> 14)) & 0x0000cccc0000ccccull;
+  x = x ^ t ^ (t << 14);
+  t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ull;
+  x = x ^ t ^ (t << 28);
+  return x;
+}
+
+
+// Transposes eight packed rows into byte 'band' of a plane of each raster line
+static void transpose_band(ql_packed_image_t *out, uint8_t *const rows[8], unsigned band, unsigned plane)
+{
+  const unsigned lb = out->line_bytes;
+  const unsigned stride = lb * out->planes;
+  for (unsigned g = 0; g * 8 < out->lines; ++g)
+  {
+    uint64_t x = 0;
+    for (unsigned i = 0; i < 8; ++i)
+      x = (x << 8) | rows[i][g];
+    if (!x)
+      continue; // already zeroed
+
+    x = transpose8(x);
+    uint8_t *line = out->data + (g * 8) * stride + plane * lb + band;
+    unsigned cols = out->lines - g * 8;
+    if (cols > 8)
+      cols = 8;
+    uint8_t *ink = out->ink + g * 8;
+    for (unsigned j = 0; j < cols; ++j, line += stride)
+    {
+      *line = x >> (56 - j * 8);
+      ink[j] |= *line;
+    }
+  }
+}
+
+
+/* Dithering. Ordered dithering compares each pixel against its own limit
+ * from an 8x8 Bayer matrix centred on the threshold, which the kernels do
+ * like plain thresholding. Error diffusion (Floyd-Steinberg, Atkinson)
+ * goes pixel by pixel, carrying each pixel's error in fixed point to the
+ * next pixels along and on the next one or two rows, so only three rows
+ * of error are ever held.
+ */
+static const uint8_t bayer8[8][8] = {
+  {  0, 32,  8, 40,  2, 34, 10, 42 },
+  { 48, 16, 56, 24, 50, 18, 58, 26 },
+  { 12, 44,  4, 36, 14, 46,  6, 38 },
+  { 60, 28, 52, 20, 62, 30, 54, 22 },
+  {  3, 35, 11, 43,  1, 33,  9, 41 },
+  { 51, 19, 59, 27, 49, 17, 57, 25 },
+  { 15, 47,  7, 39, 13, 45,  5, 37 },
+  { 63, 31, 55, 23, 61, 29, 53, 21 },
+};
+
+static const struct {
+  const char *name;
+  uint8_t dither;
+} dither_names[] = {
+  { "none",            QL_DITHER_NONE },
+  { "ordered",         QL_DITHER_ORDERED },
+  { "floyd-steinberg", QL_DITHER_FLOYD_STEINBERG },
+  { "atkinson",        QL_DITHER_ATKINSON },
+};
+
+
+bool ql_dither_by_name(const char *name, uint8_t *dither)
+{
+  for (unsigned i = 0; i < sizeof(dither_names)/sizeof(dither_names[0]); ++i)
+  {
+    if (strcmp(name, dither_names[i].name) == 0)
+    {
+      *dither = dither_names[i].dither;
+      return true;
+    }
+  }
+  return false;
+}
+
+
+/* Two-colour classification. A pixel is red where the red channel is well
+ * above both others and those are dark, i.e. where red ink would be put
+ * on white; otherwise it is black where its gray value (weighted as by
+ * libpng's rgb-to-gray) is below the threshold. Both bits come out of the
+ * one look at each pixel.
+ */
+#define RED_MARGIN 64
+
+static void classify_row(uint8_t *black, uint8_t *red, const uint8_t *rgb, unsigned width, uint8_t threshold)
+{
+  const unsigned t15 = threshold << 15; // compared against unshifted gray
+  uint8_t kb = 0, rb = 0;
+  for (unsigned x = 0; x < width; ++x, rgb += 3)
+  {
+    const unsigned r = rgb[0], g = rgb[1], b = rgb[2];
+    const unsigned gb = g > b ? g : b;
+    const unsigned is_red = (gb < threshold) & (r >= gb + RED_MARGIN);
+    const unsigned dark = 6968 * r + 23434 * g + 2366 * b < t15;
+    kb = (kb << 1) | (dark & !is_red);
+    rb = (rb << 1) | is_red;
+    if ((x & 7) == 7)
+    {
+      if (red)
+        red[x / 8] = rb;
+      else
+        kb |= rb; // no red plane, so red prints black
+      black[x / 8] = kb;
+    }
+  }
+  if (width & 7)
+  {
+    const unsigned shift = 8 - (width & 7);
+    if (red)
+      red[width / 8] = rb << shift;
+    else
+      kb |= rb;
+    black[width / 8] = kb << shift;
+  }
+}
+
+
+static const struct {
+  const char *name;
+  uint8_t rotate;
+} rotate_names[] = {
+  { "0",    QL_ROTATE_0 },
+  { "90",   QL_ROTATE_90 },
+  { "180",  QL_ROTATE_180 },
+  { "270",  QL_ROTATE_270 },
+  { "auto", QL_ROTATE_AUTO },
+};
+
+
+bool ql_rotate_by_name(const char *name, uint8_t *rotate)
+{
+  for (unsigned i = 0; i < sizeof(rotate_names)/sizeof(rotate_names[0]); ++i)
+  {
+    if (strcmp(name, rotate_names[i].name) == 0)
+    {
+      *rotate = rotate_names[i].rotate;
+      return true;
+    }
+  }
+  return false;
+}
+
+
+void ql_pack_opts(ql_pack_opts_t *opts, const ql_print_cfg_t *cfg, const ql_status_t *status)
+{
+  *opts = (ql_pack_opts_t){
+    .threshold = cfg->threshold,
+    .dither = cfg->dither,
+    .two_colour = cfg->two_colour,
+    .rotate = cfg->rotate,
+    .fit_dots = cfg->fit ? ql_media_dots(status) : 0,
+  };
+}
+
+
+struct ql_packer
+{
+  ql_arena_t arena; // everything is from here, or the heap if NULL
+  ql_packed_image_t *out;
+  uint16_t width, height; // as packed, i.e. after any scaling, before rotating
+  uint8_t rotate; // QL_ROTATE_xxx, never auto by now
+  uint8_t threshold;
+  uint8_t dither;
+  ql_threshold_fn threshold_row;
+  ql_ordered_fn ordered_row;
+  unsigned row; // rows added so far
+  unsigned row_bytes; // bytes per packed source row
+  uint8_t *rows[8]; // packed rows of the current band
+  uint8_t *red[8]; // and of its red plane, two-colour only
+  uint8_t limits[8][8]; // for ordered dithering, by row and column
+  int32_t *err[3]; // for error diffusion, this row and the next two
+  ql_resampler_t scale[2]; // gray and (two-colour only) RGB rows, if scaling
+  uint16_t src_width; // as added, if scaling
+  uint8_t *unpacked; // for scaling packed and (single-colour) RGB rows
+};
+
+
+static void ordered_limits(ql_packer_t p)
+{
+  for (unsigned r = 0; r < 8; ++r)
+    for (unsigned c = 0; c < 8; ++c)
+    {
+      int t = p->threshold - 128 + bayer8[r][c] * 4 + 2;
+      p->limits[r][c] = t < 0 ? 0 : t > 255 ? 255 : t;
+    }
+}
+
+
+/* The errors still to go to the right of the current pixel, and the
+ * partial sums for the row below, are kept in registers; each error row
+ * is then written exactly once per pass, so never needs clearing.
+ */
+static void diffuse_row(ql_packer_t p, uint8_t *bits, const uint8_t *gray)
+{
+  const int width = p->width; // signed, x - 1 goes into the padding
+  const int t = p->threshold;
+  // One column of padding on the left
+  int32_t *e0 = p->err[0] + 1, *e1 = p->err[1] + 1, *e2 = p->err[2] + 1;
+  uint8_t b = 0;
+
+  if (p->dither == QL_DITHER_FLOYD_STEINBERG)
+  {
+    // Errors in sixteenths: 7 right, 3 down-left, 5 down, 1 down-right
+    int right = 0, below_left = 0, below = 0;
+    for (int x = 0; x < width; ++x)
+    {
+      int v = gray[x] + ((e0[x] + right + 8) >> 4);
+      int e = v;
+      b <<= 1;
+      if (v < t)
+        b |= 1;
+      else
+        e -= 255;
+      if ((x & 7) == 7)
+        bits[x / 8] = b;
+      right = 7 * e;
+      e1[x - 1] = below_left + 3 * e;
+      below_left = below + 5 * e;
+      below = e;
+    }
+    e1[width - 1] = below_left;
+
+    int32_t *done = p->err[0];
+    p->err[0] = p->err[1];
+    p->err[1] = done;
+  }
+  else
+  {
+    // Errors in eighths, one each to six neighbours; the rest is dropped
+    int right1 = 0, right2 = 0, prev1 = 0, prev2 = 0;
+    for (int x = 0; x < width; ++x)
+    {
+      int v = gray[x] + ((e0[x] + right1 + 4) >> 3);
+      int e = v;
+      b <<= 1;
+      if (v < t)
+        b |= 1;
+      else
+        e -= 255;
+      if ((x & 7) == 7)
+        bits[x / 8] = b;
+      right1 = right2 + e;
+      right2 = e;
+      e1[x - 1] += prev2 + prev1 + e;
+      e2[x] = e;
+      prev2 = prev1;
+      prev1 = e;
+    }
+    e1[width - 1] += prev2 + prev1;
+
+    int32_t *done = p->err[0];
+    p->err[0] = p->err[1];
+    p->err[1] = p->err[2];
+    p->err[2] = done;
+  }
+  if (width & 7)
+    bits[width / 8] = b << (8 - (width & 7));
+}
+
+
+/* Works out the rotation and packed size, from the source size and the
+ * print head (or media) width; false if the image can't be made to fit.
+ */
+static bool layout(const ql_pack_opts_t *opts, uint16_t width, uint16_t height, uint16_t line_bytes, uint8_t *rotate, uint16_t *out_width, uint16_t *out_height)
+{
+  const unsigned head = line_bytes * 8u;
+  *rotate = opts->rotate;
+  if (*rotate == QL_ROTATE_AUTO)
+  {
+    // Turned to run along the tape if it would fit better that way
+    const bool turn = opts->fit_dots ?
+      height > width : (height > head && width <= head);
+    *rotate = turn ? QL_ROTATE_90 : QL_ROTATE_0;
+  }
+  else if (*rotate > QL_ROTATE_AUTO)
+    return false;
+
+  const bool turned = *rotate == QL_ROTATE_90 || *rotate == QL_ROTATE_270;
+  unsigned w = width, h = height;
+  if (opts->fit_dots)
+  {
+    // Same scale both ways, with the side across the print head exact
+    const unsigned across = turned ? width : height;
+    const uint64_t fit = opts->fit_dots;
+    w = turned ? fit : (width * fit + across / 2) / across;
+    h = turned ? (height * fit + across / 2) / across : fit;
+    if (!w || !h || w > UINT16_MAX || h > UINT16_MAX)
+      return false;
+  }
+  if ((turned ? w : h) > head)
+    return false;
+  *out_width = w;
+  *out_height = h;
+  return true;
+}
+
+
+static void scaled_gray_row(const uint8_t *gray, void *arg);
+static void scaled_rgb_row(const uint8_t *rgb, void *arg);
+
+ql_packer_t ql_packer_create_arena(uint16_t src_width, uint16_t src_height, uint16_t line_bytes, const ql_pack_opts_t *opts, ql_arena_t arena)
+{
+  const unsigned planes = opts->two_colour ? 2 : 1;
+  const uint8_t dither = opts->two_colour ? QL_DITHER_NONE : opts->dither;
+  uint8_t rotate;
+  uint16_t width, height;
+  if (dither > QL_DITHER_ATKINSON ||
+      !layout(opts, src_width, src_height, line_bytes, &rotate, &width, &height))
+    return NULL;
+
+  const bool scaling = width != src_width || height != src_height;
+  const bool turned = rotate == QL_ROTATE_90 || rotate == QL_ROTATE_270;
+  const unsigned lines = turned ? height : width;
+  const unsigned row_bytes = (width + 7) / 8;
+  const bool diffuse =
+    dither == QL_DITHER_FLOYD_STEINBERG || dither == QL_DITHER_ATKINSON;
+  const size_t err_bytes = diffuse ? 3 * (width + 1) * sizeof(int32_t) : 0;
+  ql_packer_t p = ql_arena_calloc(arena, sizeof(struct ql_packer) +
+    err_bytes + 8 * planes * row_bytes + (scaling ? src_width : 0));
+  if (!p)
+    return NULL;
+  p->arena = arena;
+
+  const size_t data_bytes = (size_t)lines * planes * line_bytes;
+  p->out = ql_arena_calloc(arena,
+    sizeof(ql_packed_image_t) + data_bytes + lines);
+  if (!p->out)
+  {
+    ql_arena_free(arena, p);
+    return NULL;
+  }
+  p->out->lines = lines;
+  p->out->line_bytes = line_bytes;
+  p->out->planes = planes;
+  p->out->ink = p->out->data + data_bytes; // found as a by-product of packing
+
+  p->width = width;
+  p->height = height;
+  p->rotate = rotate;
+  p->threshold = opts->threshold;
+  p->dither = dither;
+  p->threshold_row = ql_pack_kernel()->threshold_row;
+  p->ordered_row = ql_pack_kernel()->ordered_row;
+  p->row_bytes = row_bytes;
+  int32_t *err = (int32_t *)(p + 1);
+  for (unsigned i = 0; diffuse && i < 3; ++i)
+    p->err[i] = err + i * (width + 1);
+  uint8_t *bits = (uint8_t *)(p + 1) + err_bytes;
+  for (unsigned i = 0; i < 8; ++i)
+  {
+    p->rows[i] = bits + i * row_bytes;
+    if (planes == 2)
+      p->red[i] = bits + (8 + i) * row_bytes;
+  }
+  if (dither == QL_DITHER_ORDERED)
+    ordered_limits(p);
+
+  if (scaling)
+  {
+    p->src_width = src_width;
+    p->unpacked = bits + 8 * planes * row_bytes;
+    p->scale[0] = ql_resampler_create(src_width, src_height, width, height,
+      1, scaled_gray_row, p, arena);
+    if (planes == 2)
+      p->scale[1] = ql_resampler_create(src_width, src_height, width, height,
+        3, scaled_rgb_row, p, arena);
+    if (!p->scale[0] || (planes == 2 && !p->scale[1]))
+    {
+      ql_packer_destroy(p);
+      return NULL;
+    }
+  }
+  return p;
+}
+
+
+ql_packer_t ql_packer_create_opts(uint16_t width, uint16_t height, uint16_t line_bytes, const ql_pack_opts_t *opts)
+{
+  return ql_packer_create_arena(width, height, line_bytes, opts, NULL);
+}
+
+
+ql_packer_t ql_packer_create(uint16_t width, uint16_t height, uint16_t line_bytes, uint8_t threshold, uint8_t dither)
+{
+  const ql_pack_opts_t opts = { .threshold = threshold, .dither = dither };
+  return ql_packer_create_opts(width, height, line_bytes, &opts);
+}
+
+
+ql_packer_t ql_packer_create_two_colour(uint16_t width, uint16_t height, uint16_t line_bytes, uint8_t threshold)
+{
+  const ql_pack_opts_t opts = { .threshold = threshold, .two_colour = true };
+  return ql_packer_create_opts(width, height, line_bytes, &opts);
+}
+
+
+// Where the row being added goes in the band; turned rows skip the band
+static unsigned band_slot(ql_packer_t p)
+{
+  switch (p->rotate)
+  {
+    case QL_ROTATE_0: return p->row % 8;
+    case QL_ROTATE_180: return (p->height - 1 - p->row) % 8;
+    default: return 0;
+  }
+}
+
+
+// Mirrors a packed row in place, so pixel x becomes pixel width - 1 - x
+static void mirror_bits(uint8_t *bits, unsigned width)
+{
+  const unsigned n = (width + 7) / 8, pad = n * 8 - width;
+  for (unsigned i = 0; i < n / 2; ++i)
+  {
+    const uint8_t a = bits[i];
+    bits[i] = bit_reverse[bits[n - 1 - i]];
+    bits[n - 1 - i] = bit_reverse[a];
+  }
+  if (n & 1)
+    bits[n / 2] = bit_reverse[bits[n / 2]];
+  if (pad) // the padding bits have ended up at the front
+  {
+    for (unsigned i = 0; i + 1 < n; ++i)
+      bits[i] = (bits[i] << pad) | (bits[i + 1] >> (8 - pad));
+    bits[n - 1] <<= pad;
+  }
+}
+
+
+// A turned row is already a raster line, only the print head's way round
+static void put_line(ql_packer_t p, unsigned slot, unsigned line)
+{
+  const unsigned lb = p->out->line_bytes;
+  uint8_t *out = p->out->data + line * lb * p->out->planes;
+  uint8_t *const planes[2] = { p->rows[slot], p->red[slot] };
+  uint8_t ink = 0;
+  for (unsigned i = 0; i < p->out->planes; ++i, out += lb)
+  {
+    memcpy(out, planes[i], p->row_bytes);
+    for (unsigned n = 0; n < p->row_bytes; ++n)
+      ink |= planes[i][n];
+  }
+  p->out->ink[line] = ink;
+}
+
+
+/* Rotation happens here, as each row is placed. Unturned rows are
+ * transposed a band at a time, from the top (or for 180, the bottom, with
+ * rows mirrored); turned ones each make a raster line as they are, from
+ * the far end of the label for 90 and mirrored for 270.
+ */
+static void end_row(ql_packer_t p)
+{
+  const unsigned slot = band_slot(p);
+  if (p->rotate == QL_ROTATE_180 || p->rotate == QL_ROTATE_270)
+  {
+    mirror_bits(p->rows[slot], p->width);
+    if (p->out->planes == 2)
+      mirror_bits(p->red[slot], p->width);
+  }
+
+  switch (p->rotate)
+  {
+    case QL_ROTATE_0:
+    case QL_ROTATE_180:
+      if (slot == (p->rotate == QL_ROTATE_0 ? 7u : 0u))
+      {
+        const unsigned band = p->rotate == QL_ROTATE_0 ?
+          p->row / 8 : (p->height - 1 - p->row) / 8;
+        transpose_band(p->out, p->rows, band, 0);
+        if (p->out->planes == 2)
+          transpose_band(p->out, p->red, band, 1);
+      }
+      break;
+    case QL_ROTATE_90: put_line(p, slot, p->height - 1 - p->row); break;
+    case QL_ROTATE_270: put_line(p, slot, p->row); break;
+  }
+  ++p->row;
+}
+
+
+static void pack_gray_row(ql_packer_t p, const uint8_t *gray)
+{
+  const unsigned slot = band_slot(p);
+  uint8_t *bits = p->rows[slot];
+  if (p->out->planes == 2)
+    memset(p->red[slot], 0, p->row_bytes);
+  switch (p->dither)
+  {
+    case QL_DITHER_NONE:
+      p->threshold_row(bits, gray, p->width, p->threshold); break;
+    case QL_DITHER_ORDERED:
+      p->ordered_row(bits, gray, p->width, p->limits[p->row % 8]); break;
+    default: diffuse_row(p, bits, gray); break;
+  }
+  end_row(p);
+}
+
+
+static void pack_rgb_row(ql_packer_t p, const uint8_t *rgb)
+{
+  const unsigned slot = band_slot(p);
+  classify_row(p->rows[slot],
+    p->out->planes == 2 ? p->red[slot] : NULL, rgb, p->width, p->threshold);
+  end_row(p);
+}
+
+
+static void scaled_gray_row(const uint8_t *gray, void *arg)
+{
+  pack_gray_row(arg, gray);
+}
+
+
+static void scaled_rgb_row(const uint8_t *rgb, void *arg)
+{
+  pack_rgb_row(arg, rgb);
+}
+
+
+void ql_packer_add_row(ql_packer_t p, const uint8_t *gray)
+{
+  if (p->scale[0])
+    ql_resampler_add_row(p->scale[0], gray);
+  else if (p->row < p->height)
+    pack_gray_row(p, gray);
+}
+
+
+void ql_packer_add_bits(ql_packer_t p, const uint8_t *bits)
+{
+  if (p->scale[0]) // needs to be gray again to resample
+  {
+    for (unsigned x = 0; x < p->src_width; ++x)
+      p->unpacked[x] = (bits[x / 8] & (0x80 >> (x % 8))) ? 0 : 255;
+    ql_packer_add_row(p, p->unpacked);
+    return;
+  }
+  if (p->row >= p->height)
+    return;
+  const unsigned slot = band_slot(p);
+  memcpy(p->rows[slot], bits, p->row_bytes);
+  if (p->width % 8) // bits past the width may be anything (PBM, libpng)
+    p->rows[slot][p->row_bytes - 1] &= 0xff << (8 - p->width % 8);
+  if (p->out->planes == 2)
+    memset(p->red[slot], 0, p->row_bytes);
+  end_row(p);
+}
+
+
+void ql_packer_add_rgb_row(ql_packer_t p, const uint8_t *rgb)
+{
+  if (p->scale[1])
+    ql_resampler_add_row(p->scale[1], rgb);
+  else if (p->scale[0])
+  {
+    // Single-colour and scaling; gray it as libpng would
+    for (unsigned x = 0; x < p->src_width; ++x, rgb += 3)
+      p->unpacked[x] = (6968 * rgb[0] + 23434 * rgb[1] + 2366 * rgb[2]) >> 15;
+    ql_resampler_add_row(p->scale[0], p->unpacked);
+  }
+  else if (p->row < p->height)
+    pack_rgb_row(p, rgb);
+}
+
+
+ql_packed_image_t *ql_packer_finish(ql_packer_t p)
+{
+  // Any partial band is transposed with the rows still to come left white
+  unsigned band = 0, from = 8, to = 8;
+  if (p->rotate == QL_ROTATE_0 && p->row % 8)
+  {
+    band = p->row / 8;
+    from = p->row % 8;
+  }
+  else if (p->rotate == QL_ROTATE_180 && p->row < p->height &&
+           (p->height - 1 - p->row) % 8 != 7)
+  {
+    band = (p->height - 1 - p->row) / 8;
+    from = 0;
+    to = (p->height - 1 - p->row) % 8 + 1;
+  }
+  if (from < to)
+  {
+    for (unsigned i = from; i < to; ++i)
+      memset(p->rows[i], 0, p->row_bytes);
+    transpose_band(p->out, p->rows, band, 0);
+    if (p->out->planes == 2)
+    {
+      for (unsigned i = from; i < to; ++i)
+        memset(p->red[i], 0, p->row_bytes);
+      transpose_band(p->out, p->red, band, 1);
+    }
+  }
+  ql_packed_image_t *out = p->out;
+  p->out = NULL;
+  ql_packer_destroy(p);
+  return out;
+}
+
+
+void ql_packer_destroy(ql_packer_t p)
+{
+  if (!p)
+    return;
+  ql_resampler_destroy(p->scale[0]);
+  ql_resampler_destroy(p->scale[1]);
+  ql_arena_free(p->arena, p->out);
+  ql_arena_free(p->arena, p);
+}
+
+
+ql_packed_image_t *ql_pack_image(const ql_raster_image_t *img, uint16_t line_bytes, uint8_t threshold, uint8_t dither)
+{
+  const ql_pack_opts_t opts = { .threshold = threshold, .dither = dither };
+  return ql_pack_image_opts(img, line_bytes, &opts);
+}
+
+
+static unsigned pack_threads = 1;
+
+// Fewer lines than this in a stripe and threads cost more than they save
+#define MIN_STRIPE_LINES 2048
+
+void ql_pack_set_threads(unsigned threads)
+{
+  pack_threads = threads ? threads : 1;
+}
+
+
+typedef struct {
+  const ql_raster_image_t *img;
+  unsigned from, to; // image columns
+  ql_packer_t packer;
+  ql_packed_image_t *out;
+} stripe_t;
+
+// Only adds rows and finishes, which take nothing from the packer's arena
+static void *pack_stripe(void *arg)
+{
+  stripe_t *s = arg;
+  const ql_raster_image_t *img = s->img;
+  for (unsigned r = 0; r < img->height; ++r)
+    ql_packer_add_row(s->packer, img->data + r * img->width + s->from);
+  s->out = ql_packer_finish(s->packer);
+  return NULL;
+}
+
+
+// NULL with *split false if the image isn't to be split
+static ql_packed_image_t *pack_striped(const ql_raster_image_t *img, uint16_t line_bytes, const ql_pack_opts_t *opts, ql_arena_t arena, bool *split)
+{
+  uint8_t rotate;
+  uint16_t width, height;
+  const uint8_t dither = opts->two_colour ? QL_DITHER_NONE : opts->dither;
+  unsigned n = img->width / MIN_STRIPE_LINES;
+  if (n > pack_threads)
+    n = pack_threads;
+  *split = n > 1 &&
+    (dither == QL_DITHER_NONE || dither == QL_DITHER_ORDERED) &&
+    layout(opts, img->width, img->height, line_bytes, &rotate, &width, &height) &&
+    rotate == QL_ROTATE_0 && width == img->width && height == img->height;
+  if (!*split)
+    return NULL;
+
+  /* The stripes' packers are all made here, as arenas are not for sharing
+   * between threads; the stripes then come from the same arena as the
+   * result, and a warmed-up arena is enough for packing in stripes too.
+   */
+  ql_pack_opts_t stripe_opts = *opts;
+  stripe_opts.rotate = QL_ROTATE_0;
+  stripe_opts.fit_dots = 0;
+  stripe_t stripes[n];
+  pthread_t threads[n];
+  bool created = true;
+  for (unsigned i = 0; i < n; ++i)
+  {
+    // On multiples of eight, to keep the ordered dither pattern in step
+    stripes[i] = (stripe_t){
+      .img = img,
+      .from = (img->width * i / n) & ~7u,
+      .to = i + 1 < n ? (img->width * (i + 1) / n) & ~7u : img->width,
+    };
+    stripes[i].packer = created ? ql_packer_create_arena(
+      stripes[i].to - stripes[i].from, img->height, line_bytes,
+      &stripe_opts, arena) : NULL;
+    created = created && stripes[i].packer;
+  }
+  if (!created)
+  {
+    for (unsigned i = 0; i < n; ++i)
+      ql_packer_destroy(stripes[i].packer);
+    return NULL;
+  }
+
+  // The first stripe is done on this thread, and any that won't start
+  bool started[n];
+  for (unsigned i = 1; i < n; ++i)
+    started[i] = pthread_create(&threads[i], NULL, pack_stripe, &stripes[i]) == 0;
+  pack_stripe(&stripes[0]);
+  for (unsigned i = 1; i < n; ++i)
+  {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+    else
+      pack_stripe(&stripes[i]);
+  }
+
+  const unsigned planes = opts->two_colour ? 2 : 1;
+  const size_t data_bytes = (size_t)img->width * planes * line_bytes;
+  ql_packed_image_t *out =
+    ql_arena_calloc(arena, sizeof(ql_packed_image_t) + data_bytes + img->width);
+  for (unsigned i = 0; i < n; ++i)
+    if (!stripes[i].out)
+    {
+      ql_arena_free(arena, out);
+      out = NULL;
+    }
+  if (out)
+  {
+    out->lines = img->width;
+    out->line_bytes = line_bytes;
+    out->planes = planes;
+    out->ink = out->data + data_bytes;
+    for (unsigned i = 0; i < n; ++i)
+    {
+      const ql_packed_image_t *part = stripes[i].out;
+      memcpy(out->data + (size_t)stripes[i].from * planes * line_bytes,
+        part->data, (size_t)part->lines * planes * line_bytes);
+      memcpy(out->ink + stripes[i].from, part->ink, part->lines);
+    }
+  }
+  for (unsigned i = 0; i < n; ++i)
+    ql_arena_free(arena, stripes[i].out);
+  return out;
+}
+
+
+ql_packed_image_t *ql_pack_image_opts(const ql_raster_image_t *img, uint16_t line_bytes, const ql_pack_opts_t *opts)
+{
+  return ql_pack_image_arena(img, line_bytes, opts, NULL);
+}
+
+
+ql_packed_image_t *ql_pack_image_arena(const ql_raster_image_t *img, uint16_t line_bytes, const ql_pack_opts_t *opts, ql_arena_t arena)
+{
+  bool split;
+  ql_packed_image_t *out = pack_striped(img, line_bytes, opts, arena, &split);
+  if (split)
+    return out;
+
+  ql_packer_t p =
+    ql_packer_create_arena(img->width, img->height, line_bytes, opts, arena);
+  if (!p)
+    return NULL;
+  for (unsigned r = 0; r < img->height; ++r)
+    ql_packer_add_row(p, img->data + r * img->width);
+  return ql_packer_finish(p);
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright 2017 DiUS Computing Pty Ltd. All rights reserved.
+ *
+ * Released under GPLv3, see LICENSE for details.
+ *
+ * @author Johny Mattsson <jmattsson@dius.com.au>
+ */
+#include "rasterpool.h"
+#include "arena.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+typedef struct
+{
+  const label_cache_entry_t *entry;
+  bool done;
+} slot_t;
+
+struct raster_pool
+{
+  pthread_mutex_t lock;
+  pthread_cond_t ready; // a label is done
+  pthread_cond_t room;  // a label was taken, or stopping
+  label_cache_t cache;
+  char *const *paths;
+  unsigned num_paths, total, ahead;
+  uint16_t line_bytes;
+  ql_pack_opts_t opts;
+  unsigned next;  // next label for a thread to start on
+  unsigned taken; // labels taken by the caller so far
+  bool stopping;
+  slot_t *slots;  // ahead of them, label n in slot n % ahead
+  unsigned num_threads;
+  pthread_t threads[];
+};
+
+
+static void *rasterise(void *arg)
+{
+  raster_pool_t pool = arg;
+  pthread_mutex_lock(&pool->lock);
+  for (;;)
+  {
+    while (!pool->stopping && pool->next < pool->total &&
+           pool->next - pool->taken >= pool->ahead)
+      pthread_cond_wait(&pool->room, &pool->lock);
+    if (pool->stopping || pool->next >= pool->total)
+      break;
+    const unsigned n = pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+
+    const label_cache_entry_t *entry = label_cache_get(pool->cache,
+      pool->paths[n % pool->num_paths], pool->line_bytes, &pool->opts);
+
+    pthread_mutex_lock(&pool->lock);
+    slot_t *slot = &pool->slots[n % pool->ahead];
+    slot->entry = entry;
+    slot->done = true;
+    pthread_cond_broadcast(&pool->ready);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+
+raster_pool_t raster_pool_start(label_cache_t cache, unsigned threads, unsigned ahead, char *const paths[], unsigned num_paths, unsigned total, uint16_t line_bytes, const ql_pack_opts_t *opts)
+{
+  if (!num_paths)
+    return NULL;
+  if (!threads)
+    threads = 1;
+  if (!ahead)
+    ahead = 1;
+  raster_pool_t pool =
+    ql_calloc(1, sizeof(struct raster_pool) + threads * sizeof(pthread_t));
+  if (!pool)
+    return NULL;
+  pool->slots = ql_calloc(ahead, sizeof(slot_t));
+  if (!pool->slots)
+  {
+    ql_free(pool);
+    return NULL;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->ready, NULL);
+  pthread_cond_init(&pool->room, NULL);
+  pool->cache = cache;
+  pool->paths = paths;
+  pool->num_paths = num_paths;
+  pool->total = total;
+  pool->ahead = ahead;
+  pool->line_bytes = line_bytes;
+  pool->opts = *opts;
+
+  // Make do with however many threads can be had
+  while (pool->num_threads < threads &&
+         pthread_create(&pool->threads[pool->num_threads], NULL, rasterise,
+           pool) == 0)
+    ++pool->num_threads;
+  if (!pool->num_threads)
+  {
+    raster_pool_stop(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+
+const label_cache_entry_t *raster_pool_next(raster_pool_t pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  const label_cache_entry_t *entry = NULL;
+  if (pool->taken < pool->total)
+  {
+    slot_t *slot = &pool->slots[pool->taken % pool->ahead];
+    while (!slot->done)
+      pthread_cond_wait(&pool->ready, &pool->lock);
+    entry = slot->entry;
+    slot->entry = NULL;
+    slot->done = false;
+    ++pool->taken;
+    pthread_cond_broadcast(&pool->room);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return entry;
+}
+
+
+void raster_pool_stop(raster_pool_t pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->room);
+  pthread_mutex_unlock(&pool->lock);
+  for (unsigned i = 0; i < pool->num_threads; ++i)
+    pthread_join(pool->threads[i], NULL);
+
+  for (unsigned i = 0; i < pool->ahead; ++i)
+    if (pool->slots[i].done)
+      label_cache_put(pool->cache, pool->slots[i].entry);
+  pthread_cond_destroy(&pool->room);
+  pthread_cond_destroy(&pool->ready);
+  pthread_mutex_destroy(&pool->lock);
+  ql_free(pool->slots);
+  ql_free(pool);
+}
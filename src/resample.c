@@ -0,0 +1,178 @@
+/*
+ * Copyright 2017 DiUS Computing Pty Ltd. All rights reserved.
+ *
+ * Released under GPLv3, see LICENSE for details.
+ *
+ * @author Johny Mattsson <jmattsson@dius.com.au>
+ */
+#include "resample.h"
+#include "arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct ql_resampler
+{
+  ql_arena_t arena;
+  unsigned src_width, src_height, dst_width, dst_height, channels;
+  ql_resample_row_fn emit;
+  void *arg;
+  unsigned row;     // source rows added so far
+  unsigned out_row; // rows emitted so far
+
+  bool box_x, box_y; // shrinking, else enlarging, along each axis
+  uint32_t *x0;     // per output pixel, first (box) or left (bilinear) source
+  uint32_t *xw;     // reciprocal of box size in 16.16, or weight of the right
+  uint8_t *prev, *cur; // horizontally resampled rows, the last two
+  uint32_t *sum;    // vertical box total so far
+  unsigned count;   // rows in it
+  uint8_t *out;
+};
+
+
+// Bilinear source position of output pixel i, in 8.8 fixed point
+static uint32_t bilinear_pos(unsigned i, unsigned src, unsigned dst)
+{
+  // Centre of output pixel mapped to the source, less half a source pixel
+  int64_t pos = ((2 * (int64_t)i + 1) * src * 128) / dst - 128;
+  if (pos < 0)
+    pos = 0;
+  if (pos > (src - 1) * 256ll)
+    pos = (src - 1) * 256ll;
+  return pos;
+}
+
+
+ql_resampler_t ql_resampler_create(uint16_t src_width, uint16_t src_height, uint16_t dst_width, uint16_t dst_height, unsigned channels, ql_resample_row_fn emit, void *arg, ql_arena_t arena)
+{
+  if (!src_width || !src_height || !dst_width || !dst_height || !channels)
+    return NULL;
+
+  const size_t row = (size_t)dst_width * channels;
+  ql_resampler_t rs = ql_arena_calloc(arena, sizeof(struct ql_resampler) +
+    2 * dst_width * sizeof(uint32_t) + row * sizeof(uint32_t) + 3 * row);
+  if (!rs)
+    return NULL;
+  rs->arena = arena;
+  rs->src_width = src_width;
+  rs->src_height = src_height;
+  rs->dst_width = dst_width;
+  rs->dst_height = dst_height;
+  rs->channels = channels;
+  rs->emit = emit;
+  rs->arg = arg;
+  rs->box_x = dst_width < src_width;
+  rs->box_y = dst_height < src_height;
+
+  rs->x0 = (uint32_t *)(rs + 1);
+  rs->xw = rs->x0 + dst_width;
+  rs->sum = rs->xw + dst_width;
+  rs->prev = (uint8_t *)(rs->sum + row);
+  rs->cur = rs->prev + row;
+  rs->out = rs->cur + row;
+
+  for (unsigned x = 0; x < dst_width; ++x)
+  {
+    if (rs->box_x)
+    {
+      unsigned start = (uint64_t)x * src_width / dst_width;
+      unsigned end = (uint64_t)(x + 1) * src_width / dst_width;
+      rs->x0[x] = start;
+      rs->xw[x] = (65536 + (end - start) / 2) / (end - start);
+    }
+    else
+    {
+      uint32_t pos = bilinear_pos(x, src_width, dst_width);
+      rs->x0[x] = pos >> 8;
+      rs->xw[x] = pos & 0xff;
+    }
+  }
+  return rs;
+}
+
+
+static void resample_x(ql_resampler_t rs, uint8_t *out, const uint8_t *in)
+{
+  const unsigned ch = rs->channels, w = rs->dst_width;
+  if (rs->box_x)
+  {
+    for (unsigned x = 0; x < w; ++x)
+    {
+      const unsigned start = rs->x0[x];
+      const unsigned end = x + 1 < w ? rs->x0[x + 1] : rs->src_width;
+      for (unsigned c = 0; c < ch; ++c)
+      {
+        uint32_t sum = 0;
+        for (unsigned i = start; i < end; ++i)
+          sum += in[i * ch + c];
+        *out++ = (sum * rs->xw[x] + 32768) >> 16;
+      }
+    }
+  }
+  else
+  {
+    const unsigned last = rs->src_width - 1;
+    for (unsigned x = 0; x < w; ++x)
+    {
+      const unsigned x0 = rs->x0[x], x1 = x0 < last ? x0 + 1 : last;
+      const unsigned f = rs->xw[x];
+      for (unsigned c = 0; c < ch; ++c)
+        *out++ = (in[x0 * ch + c] * (256 - f) + in[x1 * ch + c] * f + 128) >> 8;
+    }
+  }
+}
+
+
+void ql_resampler_add_row(ql_resampler_t rs, const uint8_t *row)
+{
+  if (rs->row >= rs->src_height)
+    return;
+  const unsigned r = rs->row++;
+  const size_t len = (size_t)rs->dst_width * rs->channels;
+  resample_x(rs, rs->cur, row);
+
+  if (rs->box_y)
+  {
+    for (size_t i = 0; i < len; ++i)
+      rs->sum[i] += rs->cur[i];
+    ++rs->count;
+    const unsigned end =
+      (uint64_t)(rs->out_row + 1) * rs->src_height / rs->dst_height;
+    if (r + 1 == end)
+    {
+      const uint32_t recip = (65536 + rs->count / 2) / rs->count;
+      for (size_t i = 0; i < len; ++i)
+        rs->out[i] = (rs->sum[i] * recip + 32768) >> 16;
+      rs->emit(rs->out, rs->arg);
+      ++rs->out_row;
+      memset(rs->sum, 0, len * sizeof(uint32_t));
+      rs->count = 0;
+    }
+    return;
+  }
+
+  // Every output row between the previous source row and this one
+  const unsigned last = rs->src_height - 1;
+  while (rs->out_row < rs->dst_height)
+  {
+    const uint32_t pos = bilinear_pos(rs->out_row, rs->src_height, rs->dst_height);
+    const unsigned y0 = pos >> 8, y1 = y0 < last ? y0 + 1 : last;
+    const unsigned f = pos & 0xff;
+    if (y1 > r)
+      break;
+    const uint8_t *a = y0 == r ? rs->cur : rs->prev, *b = rs->cur;
+    for (size_t i = 0; i < len; ++i)
+      rs->out[i] = (a[i] * (256 - f) + b[i] * f + 128) >> 8;
+    rs->emit(rs->out, rs->arg);
+    ++rs->out_row;
+  }
+  uint8_t *t = rs->prev;
+  rs->prev = rs->cur;
+  rs->cur = t;
+}
+
+
+void ql_resampler_destroy(ql_resampler_t rs)
+{
+  if (rs)
+    ql_arena_free(rs->arena, rs);
+}
@@ -0,0 +1,363 @@
+/*
+ * Copyright 2017 DiUS Computing Pty Ltd. All rights reserved.
+ *
+ * Released under GPLv3, see LICENSE for details.
+ *
+ * @author Johny Mattsson <jmattsson@dius.com.au>
+ */
+#include "spool.h"
+#include "arena.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SPOOL_MAGIC "QLSPOOL1"
+
+typedef struct {
+  char magic[8];
+  uint32_t labels;
+  uint32_t rsvd;
+  uint64_t index;   // offset of the index
+  uint64_t journal; // offset of the journal
+  ql_status_t status;
+} spool_header_t;
+
+#define SPOOL_COMPRESSED 0x01
+#define SPOOL_ZERO_LINES 0x02
+
+typedef struct {
+  uint64_t offset; // of the encoded lines, followed by the name and a NUL
+  uint32_t len;
+  uint32_t blank_lines;
+  uint16_t lines;
+  uint16_t line_bytes;
+  uint16_t name_len;
+  uint8_t planes;
+  uint8_t encoding; // SPOOL_xxx flags
+  uint8_t cfg_flags;
+  uint8_t media_type;
+  uint8_t media_width;
+  uint8_t media_length;
+  uint8_t first_page;
+  uint8_t rsvd[3];
+} spool_entry_t;
+
+_Static_assert(sizeof(spool_header_t) == 64, "spool header layout");
+_Static_assert(sizeof(spool_entry_t) == 32, "spool index layout");
+
+struct spool_writer
+{
+  char *path, *tmp;
+  FILE *f;
+  spool_header_t hdr;
+  uint64_t pos;
+  spool_entry_t *entries;
+  unsigned cap;
+  uint8_t *buf; // for encoding into
+  size_t buf_len;
+};
+
+struct spool
+{
+  int fd;
+  const uint8_t *map;
+  size_t size;
+  const spool_header_t *hdr;
+  const spool_entry_t *index;
+  const uint8_t *journal; // seen through the mapping as it is written
+  unsigned done;
+};
+
+
+spool_writer_t spool_create(const char *path, const ql_status_t *status)
+{
+  spool_writer_t sw = ql_calloc(1, sizeof(struct spool_writer));
+  if (!sw)
+    return NULL;
+  sw->path = ql_strdup(path);
+  sw->tmp = ql_malloc(strlen(path) + sizeof(".tmp"));
+  if (!sw->path || !sw->tmp)
+    goto fail;
+  strcpy(sw->tmp, path);
+  strcat(sw->tmp, ".tmp");
+
+  memcpy(sw->hdr.magic, SPOOL_MAGIC, sizeof(sw->hdr.magic));
+  sw->hdr.status = *status;
+  sw->f = fopen(sw->tmp, "wb");
+  if (!sw->f)
+    goto fail;
+  // The header goes in last, once the rest has been written
+  static const spool_header_t blank;
+  if (fwrite(&blank, sizeof(blank), 1, sw->f) != 1)
+    goto fail;
+  sw->pos = sizeof(blank);
+  return sw;
+
+fail:
+  spool_abort(sw);
+  return NULL;
+}
+
+
+bool spool_add(spool_writer_t sw, const char *name, const ql_packed_image_t *img, const ql_print_cfg_t *cfg)
+{
+  const size_t need = ql_encoded_max(img);
+  if (need > sw->buf_len)
+  {
+    ql_free(sw->buf);
+    sw->buf = ql_malloc(need);
+    sw->buf_len = sw->buf ? need : 0;
+    if (!sw->buf)
+      return false;
+  }
+  if (sw->hdr.labels == sw->cap)
+  {
+    unsigned cap = sw->cap ? 2 * sw->cap : 64;
+    spool_entry_t *entries = ql_malloc(cap * sizeof(spool_entry_t));
+    if (!entries)
+      return false;
+    if (sw->hdr.labels)
+      memcpy(entries, sw->entries, sw->hdr.labels * sizeof(spool_entry_t));
+    ql_free(sw->entries);
+    sw->entries = entries;
+    sw->cap = cap;
+  }
+
+  ql_encoded_image_t enc;
+  if (!ql_encode_packed_image(&sw->hdr.status, img, cfg, sw->buf, &enc))
+    return false;
+  const size_t name_len = strlen(name);
+  if (name_len > UINT16_MAX)
+  {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  if (fwrite(enc.data, 1, enc.len, sw->f) != enc.len ||
+      fwrite(name, 1, name_len + 1, sw->f) != name_len + 1)
+    return false;
+
+  sw->entries[sw->hdr.labels++] = (spool_entry_t){
+    .offset = sw->pos,
+    .len = enc.len,
+    .blank_lines = enc.blank_lines,
+    .lines = enc.lines,
+    .line_bytes = enc.line_bytes,
+    .name_len = name_len,
+    .planes = enc.planes,
+    .encoding = (enc.compressed ? SPOOL_COMPRESSED : 0) |
+      (enc.zero_lines ? SPOOL_ZERO_LINES : 0),
+    .cfg_flags = cfg->flags,
+    .media_type = cfg->media_type,
+    .media_width = cfg->media_width,
+    .media_length = cfg->media_length,
+    .first_page = cfg->first_page,
+  };
+  sw->pos += enc.len + name_len + 1;
+  return true;
+}
+
+
+bool spool_finish(spool_writer_t sw)
+{
+  // The index after the data, aligned for reading in place
+  const uint8_t pad[8] = { 0, };
+  const size_t padding = (8 - sw->pos % 8) % 8;
+  sw->hdr.index = sw->pos + padding;
+  sw->hdr.journal = sw->hdr.index + sw->hdr.labels * sizeof(spool_entry_t);
+  const unsigned labels = sw->hdr.labels;
+  if (fwrite(pad, 1, padding, sw->f) != padding ||
+      fwrite(sw->entries, sizeof(spool_entry_t), labels, sw->f) != labels)
+    goto fail;
+  for (unsigned i = 0; i < labels; ++i)
+    if (fputc(0, sw->f) == EOF)
+      goto fail;
+
+  if (fseek(sw->f, 0, SEEK_SET) != 0 ||
+      fwrite(&sw->hdr, sizeof(sw->hdr), 1, sw->f) != 1 ||
+      fflush(sw->f) != 0 || fsync(fileno(sw->f)) != 0)
+    goto fail;
+  int ret = fclose(sw->f);
+  sw->f = NULL;
+  if (ret != 0 || rename(sw->tmp, sw->path) != 0)
+    goto fail;
+
+  ql_free(sw->tmp);
+  sw->tmp = NULL; // nothing left to remove
+  spool_abort(sw);
+  return true;
+
+fail:
+  spool_abort(sw);
+  return false;
+}
+
+
+void spool_abort(spool_writer_t sw)
+{
+  if (!sw)
+    return;
+  int err = errno;
+  if (sw->f)
+    fclose(sw->f);
+  if (sw->tmp)
+    unlink(sw->tmp);
+  ql_free(sw->buf);
+  ql_free(sw->entries);
+  ql_free(sw->tmp);
+  ql_free(sw->path);
+  ql_free(sw);
+  errno = err;
+}
+
+
+// Everything the header and index point at must lie within the file
+static bool spool_valid(const spool_t sp)
+{
+  const spool_header_t *hdr = sp->hdr;
+  if (sp->size < sizeof(*hdr) ||
+      memcmp(hdr->magic, SPOOL_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->index % 8 || hdr->index > sp->size ||
+      hdr->labels > (sp->size - hdr->index) / sizeof(spool_entry_t) ||
+      hdr->journal != hdr->index + hdr->labels * sizeof(spool_entry_t) ||
+      hdr->labels > sp->size - hdr->journal)
+    return false;
+
+  const spool_entry_t *index = (const spool_entry_t *)(sp->map + hdr->index);
+  for (unsigned i = 0; i < hdr->labels; ++i)
+  {
+    const spool_entry_t *e = &index[i];
+    if (e->offset < sizeof(*hdr) || e->offset > hdr->index ||
+        (uint64_t)e->len + e->name_len + 1 > hdr->index - e->offset ||
+        sp->map[e->offset + e->len + e->name_len] != 0 ||
+        (e->planes != 1 && e->planes != 2))
+      return false;
+  }
+  return true;
+}
+
+
+spool_t spool_open(const char *path)
+{
+  spool_t sp = ql_calloc(1, sizeof(struct spool));
+  if (!sp)
+    return NULL;
+  sp->fd = open(path, O_RDWR);
+  if (sp->fd < 0)
+    goto fail;
+  struct stat st;
+  if (fstat(sp->fd, &st) != 0)
+    goto fail;
+  if ((size_t)st.st_size < sizeof(spool_header_t))
+  {
+    errno = EINVAL;
+    goto fail;
+  }
+  sp->size = st.st_size;
+  void *map = mmap(NULL, sp->size, PROT_READ, MAP_SHARED, sp->fd, 0);
+  if (map == MAP_FAILED)
+    goto fail;
+  sp->map = map;
+  (void)madvise(map, sp->size, MADV_SEQUENTIAL);
+
+  sp->hdr = (const spool_header_t *)sp->map;
+  if (!spool_valid(sp))
+  {
+    errno = EINVAL;
+    goto fail;
+  }
+  sp->index = (const spool_entry_t *)(sp->map + sp->hdr->index);
+  sp->journal = sp->map + sp->hdr->journal;
+  for (unsigned i = 0; i < sp->hdr->labels; ++i)
+    if (sp->journal[i])
+      ++sp->done;
+  return sp;
+
+fail:
+  spool_close(sp);
+  return NULL;
+}
+
+
+void spool_close(spool_t sp)
+{
+  if (!sp)
+    return;
+  int err = errno;
+  if (sp->map)
+    munmap((void *)sp->map, sp->size);
+  if (sp->fd >= 0)
+    close(sp->fd);
+  ql_free(sp);
+  errno = err;
+}
+
+
+const ql_status_t *spool_status(spool_t sp)
+{
+  return &sp->hdr->status;
+}
+
+
+unsigned spool_labels(spool_t sp)
+{
+  return sp->hdr->labels;
+}
+
+
+unsigned spool_done(spool_t sp)
+{
+  return sp->done;
+}
+
+
+void spool_label(spool_t sp, unsigned i, ql_encoded_image_t *img, ql_print_cfg_t *cfg, const char **name)
+{
+  const spool_entry_t *e = &sp->index[i];
+  *img = (ql_encoded_image_t){
+    .lines = e->lines,
+    .line_bytes = e->line_bytes,
+    .planes = e->planes,
+    .compressed = e->encoding & SPOOL_COMPRESSED,
+    .zero_lines = e->encoding & SPOOL_ZERO_LINES,
+    .blank_lines = e->blank_lines,
+    .len = e->len,
+    .data = sp->map + e->offset,
+  };
+  *cfg = (ql_print_cfg_t){
+    .flags = e->cfg_flags,
+    .media_type = e->media_type,
+    .media_width = e->media_width,
+    .media_length = e->media_length,
+    .first_page = e->first_page,
+    .compress = img->compressed,
+    .two_colour = img->planes == 2,
+  };
+  if (name)
+    *name = (const char *)sp->map + e->offset + e->len;
+}
+
+
+bool spool_is_done(spool_t sp, unsigned i)
+{
+  return sp->journal[i] != 0;
+}
+
+
+bool spool_mark_done(spool_t sp, unsigned i)
+{
+  if (sp->journal[i])
+    return true;
+  const uint8_t done = 1;
+  const off_t at = sp->hdr->journal + i;
+  ssize_t n;
+  while ((n = pwrite(sp->fd, &done, 1, at)) == -1 && errno == EINTR)
+    ;
+  if (n != 1 || fdatasync(sp->fd) != 0)
+    return false;
+  ++sp->done;
+  return true;
+}